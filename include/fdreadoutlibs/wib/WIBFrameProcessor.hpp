@@ -64,6 +64,10 @@ enum CollectionOrInduction {
 }
 
 namespace dunedaq {
+ERS_DECLARE_ISSUE(fdreadoutlibs,
+                  SoftwareTPGUnsupportedCPU,
+                  "The WIB1 software TPG needs " << isa << ", which this CPU doesn't support",
+                  ((std::string)isa))
 
 namespace fdreadoutlibs {
 
@@ -248,6 +252,12 @@ public:
     m_clock_frequency = config.clock_speed_hz;
 
     if (config.enable_software_tpg) {
+      // The WIB1 kernels are AVX2 only
+      __builtin_cpu_init();
+      if (!__builtin_cpu_supports("avx2")) {
+        throw SoftwareTPGUnsupportedCPU(ERS_HERE, "AVX2");
+      }
+
       m_sw_tpg_enabled = true;
 
       m_channel_map = dunedaq::detchannelmaps::make_map(config.channel_map_name);
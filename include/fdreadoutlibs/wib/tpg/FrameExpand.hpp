@@ -17,6 +17,12 @@
 #include <array>
 #include <immintrin.h>
 
+// The WIB1 software TPG only has AVX2 kernels. They are built for AVX2
+// even though the rest of the library targets the baseline instruction
+// set: WIBFrameProcessor checks that the CPU supports AVX2 before using them
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
 namespace swtpg {
 
 struct MessageCollectionADCs
@@ -660,4 +666,6 @@ induction_index_to_channel(int index);
 
 } // namespace swtpg
 
+#pragma GCC pop_options
+
 #endif // FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB_TPG_FRAMEEXPAND_HPP_
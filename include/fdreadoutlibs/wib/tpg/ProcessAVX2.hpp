@@ -15,6 +15,10 @@
 
 #include <immintrin.h>
 
+// Built for AVX2, see FrameExpand.hpp
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
 namespace swtpg {
 
 inline void
@@ -373,4 +377,6 @@ process_window_avx2(ProcessingInfo<NREGISTERS>& info)
 
 } // namespace swtpg
 
+#pragma GCC pop_options
+
 #endif // READOUT_SRC_WIB_TPG_PROCESSAVX2_HPP_
@@ -0,0 +1,78 @@
+/**
+ * @file WIB2EventCount.hpp Wait for, and signal, new items in the
+ * lock-free queues between the WIB2 software TPG stages
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#ifndef FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_WIB2EVENTCOUNT_HPP_
+#define FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_WIB2EVENTCOUNT_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace dunedaq {
+namespace fdreadoutlibs {
+
+// An event count: consumers sleep in the kernel (on a futex) until a
+// producer signals that there is something new for them, instead of
+// polling. Producers pay one atomic increment per notify, plus a system
+// call only when somebody is asleep. The consumer checks for work
+// between announcing itself and going to sleep, so a notify can't slip
+// in unnoticed between the two
+class WIB2EventCount
+{
+public:
+  WIB2EventCount() = default;
+  WIB2EventCount(const WIB2EventCount&) = delete;
+  WIB2EventCount& operator=(const WIB2EventCount&) = delete;
+
+  // Wake up the consumers waiting in await. Call after making the new
+  // items visible, eg after pushing them to the queue
+  void notify()
+  {
+    m_epoch.fetch_add(1, std::memory_order_seq_cst);
+    if (m_waiters.load(std::memory_order_seq_cst) > 0) {
+      futex(FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr);
+    }
+  }
+
+  // Sleep until notify is called or timeout passes, unless ready() is
+  // already true. Spurious wake ups are possible, so the caller checks
+  // again whatever it waited for
+  template<typename Predicate>
+  void await(Predicate&& ready, std::chrono::microseconds timeout)
+  {
+    m_waiters.fetch_add(1, std::memory_order_seq_cst);
+    const uint32_t epoch = m_epoch.load(std::memory_order_seq_cst); // NOLINT(build/unsigned)
+    if (!ready()) {
+      struct timespec ts;
+      ts.tv_sec = timeout.count() / 1000000;
+      ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+      futex(FUTEX_WAIT_PRIVATE, epoch, &ts);
+    }
+    m_waiters.fetch_sub(1, std::memory_order_seq_cst);
+  }
+
+private:
+  void futex(int op, uint32_t value, const struct timespec* timeout) // NOLINT(build/unsigned)
+  {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_epoch), op, value, timeout, nullptr, 0); // NOLINT
+  }
+
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "The futex word must be a plain 32-bit integer"); // NOLINT(build/unsigned)
+
+  std::atomic<uint32_t> m_epoch{ 0 }; // NOLINT(build/unsigned)
+  std::atomic<int> m_waiters{ 0 };
+};
+
+} // namespace fdreadoutlibs
+} // namespace dunedaq
+
+#endif // FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_WIB2EVENTCOUNT_HPP_
@@ -23,34 +23,49 @@
 #include "readoutlibs/utils/ReusableThread.hpp"
 
 #include "detchannelmaps/TPCChannelMap.hpp"
+#include "folly/ProducerConsumerQueue.h"
 #include "detdataformats/wib2/WIB2Frame.hpp"
 
 
 #include "fdreadoutlibs/DUNEWIBSuperChunkTypeAdapter.hpp"
 #include "fdreadoutlibs/TriggerPrimitiveTypeAdapter.hpp"
 
+#include "fdreadoutlibs/wib2/WIB2EventCount.hpp"
+#include "fdreadoutlibs/wib2/WIB2HitBufferPool.hpp"
+#include "fdreadoutlibs/wib2/WIB2LatencyHistogram.hpp"
 #include "fdreadoutlibs/wib2/WIB2TPHandler.hpp"
+#include "fdreadoutlibs/wib2tpgconfig/Nljs.hpp"
+#include "fdreadoutlibs/wib2tpginfo/InfoNljs.hpp"
 #include "rcif/cmd/Nljs.hpp"
 #include "trigger/TPSet.hpp"
 #include "triggeralgs/TriggerPrimitive.hpp"
 
 #include "tpg/DesignFIR.hpp"
 #include "tpg/FrameExpand.hpp"
-#include "tpg/ProcessAVX2.hpp"
-#include "tpg/ProcessRSAVX2.hpp"
+#include "tpg/KernelDispatch.hpp"
 #include "tpg/ProcessingInfo.hpp"
 #include "tpg/RegisterToChannelNumber.hpp"
 #include "tpg/TPGConstants_wib2.hpp"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <bitset>
+#include <cassert>
+#include <chrono>
+#include <cstring>
 #include <functional>
 #include <future>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <pthread.h>
 #include <queue>
+#include <set>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -63,9 +78,38 @@ ERS_DECLARE_ISSUE(fdreadoutlibs,
                   "Failed to push hits to TP handler " << sid,
                   ((int)sid))
 
+ERS_DECLARE_ISSUE(fdreadoutlibs,
+                  TPGLoadShedding,
+                  "The TP handler of source " << sid << " can't keep up: dropped the TPs of " << num_windows
+                  << " software TPG windows (" << num_tps << " TPs) since the last warning",
+                  ((int)sid)((uint64_t)num_windows)((uint64_t)num_tps)) // NOLINT(build/unsigned)
+
+ERS_DECLARE_ISSUE(fdreadoutlibs,
+                  InvalidTPGWindow,
+                  "Invalid number of superchunks per software TPG window: " << superchunks_per_window
+                  << " . It must be between 1 and " << max_superchunks,
+                  ((size_t)superchunks_per_window)((size_t)max_superchunks))
+
+ERS_DECLARE_ISSUE(fdreadoutlibs,
+                  InvalidTPGPartitioning,
+                  "Cannot split the software TPG channels into " << num_frame_handlers
+                  << " frame handlers pinned to " << num_cpus << " CPUs . Select 1, 2, 4 or 8 frame handlers and either none or one CPU each.",
+                  ((size_t)num_frame_handlers)((size_t)num_cpus))
+
+ERS_DECLARE_ISSUE(fdreadoutlibs,
+                  TPGThreadPinningFailed,
+                  "Failed to pin the software TPG thread of registers " << first_register << "-" << last_register
+                  << " to CPU " << cpu << ": " << error,
+                  ((size_t)first_register)((size_t)last_register)((int)cpu)((std::string)error))
+
+ERS_DECLARE_ISSUE(fdreadoutlibs,
+                  TPHandlerThreadPinningFailed,
+                  "Failed to pin the TP handler thread of source " << sid << " to CPU " << cpu << ": " << error,
+                  ((int)sid)((int)cpu)((std::string)error))
+
 ERS_DECLARE_ISSUE(fdreadoutlibs,
                   TPGAlgorithmInexistent,
-                  "The selected algorithm does not exist: " << algorithm_selection << " . Check your configuration file and seelect either SWTPG or AbsRS.",
+                  "The selected algorithm does not exist: " << algorithm_selection << " . Check your configuration file and seelect either SWTPG, AbsRS or FIR.",
                   ((std::string)algorithm_selection))
 
 
@@ -74,18 +118,37 @@ namespace fdreadoutlibs {
 
 
 
+// The TPs found in a window, handed from the thread of a frame handler
+// to the TP handler thread. They are reused from window to window, so
+// the vector soon stops allocating
 struct swtpg_output{
-  uint16_t* output_location;
+  std::vector<triggeralgs::TriggerPrimitive> tps;
   uint64_t timestamp;
+  // When the output was handed to the TP handler thread
+  std::chrono::steady_clock::time_point enqueue_time;
 };
 
 
 class WIB2FrameHandler {
 
 public: 
-  explicit WIB2FrameHandler(int register_selector_params, iomanager::FollyMPMCQueue<uint16_t*> &dest_queue ) : m_dest_queue_frame_handler(dest_queue) 
+  // The handler processes the AVX2 registers [first_register, last_register) of each frame,
+  // on a thread pinned to the given CPU if it isn't negative. The kernels
+  // write their hits to primfind_dest, and up to num_outputs windows of
+  // TPs can wait for the TP handler thread, plus the last window of the
+  // run at stop
+  explicit WIB2FrameHandler(size_t first_register, size_t last_register, uint16_t* primfind_dest, size_t num_outputs, int cpu = -1)
+    : m_first_register(first_register)
+    , m_last_register(last_register)
+    , m_cpu(cpu)
+    , m_primfind_dest(primfind_dest)
+    , m_outputs(num_outputs)
+    , m_hits_queue(num_outputs + 2)
+    , m_free_output_queue(num_outputs + 1)
   {
-    m_register_selector = register_selector_params;
+    for (auto& output : m_outputs) {
+      m_free_output_queue.write(&output);
+    }
   }
   WIB2FrameHandler(const WIB2FrameHandler&) = delete;
   WIB2FrameHandler& operator=(const WIB2FrameHandler&) = delete;
@@ -96,25 +159,90 @@ public:
 
  }
 
-  std::unique_ptr<swtpg_wib2::ProcessingInfo<swtpg_wib2::NUM_REGISTERS_PER_FRAME>> m_tpg_processing_info;
+  std::unique_ptr<swtpg_wib2::ProcessingInfoBase<swtpg_wib2::NUM_REGISTERS_PER_FRAME>> m_tpg_processing_info;
 
   // Map from expanded AVX register position to offline channel number
   swtpg_wib2::RegisterChannelMap register_channel_map; 
 
   bool first_hit = true;                                                  
+
+  // Consecutive superchunks waiting to be processed as one time window,
+  // when there is more than one superchunk per window. The superchunks
+  // are copied, as the latency buffer doesn't promise to keep them
+  size_t superchunks_per_window = 1;
+  std::vector<types::DUNEWIBSuperChunkTypeAdapter> window;
+  size_t window_num_superchunks = 0;
+  uint64_t window_timestamp = 0; // NOLINT(build/unsigned)
+  uint64_t next_timestamp = 0;   // NOLINT(build/unsigned)
                                                   
-  int get_registers_selector() {
-    return m_register_selector;
-  }
+  size_t get_first_register() const { return m_first_register; }
+  size_t get_last_register() const { return m_last_register; }
+  int get_cpu() const { return m_cpu; }
+
+  // Superchunks still to go through the warm-up, in which the pedestals
+  // are measured and no hits are looked for, and the pedestals kept from
+  // the previous run, if any
+  size_t warmup_remaining = 0;
+  bool has_saved_pedestals = false;
+  // The m_tpg_params_generation of the processor last put in the
+  // channel state
+  uint64_t params_generation = 0; // NOLINT(build/unsigned)
+  // Whether the handler drops the TPs of its windows, rather than
+  // waiting for the TP handler thread, when shedding load
+  bool shedding = false;
+  swtpg_wib2::ChannelPedestals<swtpg_wib2::NUM_REGISTERS_PER_FRAME> saved_pedestals;
 
   void reset() {
     delete[] m_tpg_taps_p;
     m_tpg_taps_p = nullptr;
     first_hit = true;
+    window_num_superchunks = 0;
+    warmup_remaining = 0;
+    shedding = false;
+    m_warmup_samples.clear();
+  }
+
+  // Keep the samples of the registers of the handler in the expanded
+  // superchunk, for measure_pedestals
+  void add_warmup_superchunk(const swtpg_wib2::MessageRegisters& registers) {
+    const uint16_t* input16 = registers.data(); // NOLINT(build/unsigned)
+    for (size_t itime = 0; itime < swtpg_wib2::FRAMES_PER_MSG; ++itime) {
+      for (size_t ireg = m_first_register; ireg < m_last_register; ++ireg) {
+        const uint16_t* tick = input16 + (ireg * swtpg_wib2::FRAMES_PER_MSG + itime) * swtpg_wib2::SAMPLES_PER_REGISTER; // NOLINT(build/unsigned)
+        m_warmup_samples.insert(m_warmup_samples.end(), tick, tick + swtpg_wib2::SAMPLES_PER_REGISTER);
+      }
+    }
+  }
+
+  // The exact median and quartiles of the samples of each channel kept by
+  // add_warmup_superchunk, which are then dropped
+  void measure_pedestals(swtpg_wib2::ChannelPedestals<swtpg_wib2::NUM_REGISTERS_PER_FRAME>& pedestals) {
+    const size_t num_channels = (m_last_register - m_first_register) * swtpg_wib2::SAMPLES_PER_REGISTER;
+    const size_t num_samples = m_warmup_samples.size() / num_channels;
+    std::vector<int16_t> channel_samples(num_samples);
+    for (size_t ichan = 0; ichan < num_channels; ++ichan) {
+      for (size_t isample = 0; isample < num_samples; ++isample) {
+        channel_samples[isample] = m_warmup_samples[isample * num_channels + ichan];
+      }
+      std::sort(channel_samples.begin(), channel_samples.end());
+
+      const size_t j = m_first_register * swtpg_wib2::SAMPLES_PER_REGISTER + ichan;
+      pedestals.median[j] = channel_samples[num_samples / 2];
+      pedestals.quantile25[j] = channel_samples[num_samples / 4];
+      pedestals.quantile75[j] = channel_samples[(3 * num_samples) / 4];
+    }
+    m_warmup_samples.clear();
   }
    
 
-  void initialize(int threshold_value) {
+  // make_processing_info is that of the selected algorithm, for the
+  // channel state to be laid out the way its kernels expect. The state
+  // itself is only made by allocate_state
+  void initialize(int threshold_value, size_t superchunks_per_window_, swtpg_wib2::make_info_fn_t make_processing_info) {
+    superchunks_per_window = superchunks_per_window_;
+    window_num_superchunks = 0;
+    m_make_processing_info = make_processing_info;
+
     m_tpg_taps = swtpg_wib2::firwin_int(7, 0.1, m_tpg_multiplier);
     m_tpg_taps.push_back(0);    
 
@@ -128,41 +256,109 @@ public:
       m_tpg_taps_p[i] = m_tpg_taps[i];
     }
 
-    m_tpg_processing_info = std::make_unique<swtpg_wib2::ProcessingInfo<swtpg_wib2::NUM_REGISTERS_PER_FRAME>>(
-      nullptr,
-      swtpg_wib2::FRAMES_PER_MSG,
-      0,
-      swtpg_wib2::NUM_REGISTERS_PER_FRAME,
-      nullptr,
-      m_tpg_taps_p,
-      (uint8_t)m_tpg_taps.size(), // NOLINT(build/unsigned)
-      m_tpg_tap_exponent,
-      m_tpg_threshold,
-      0,
-      0
-    );
+  }
 
+  // Make the channel state and the window of the handler, replacing
+  // those of the previous run. Called by the thread of the handler with
+  // its first superchunk, once the thread is pinned: the memory is then
+  // first touched, and so placed by the kernel, on the NUMA node of the
+  // CPU that works on it
+  void allocate_state() {
+    std::vector<types::DUNEWIBSuperChunkTypeAdapter>(superchunks_per_window > 1 ? superchunks_per_window : 0)
+      .swap(window);
+    m_tpg_processing_info = m_make_processing_info(m_first_register,
+                                                   m_last_register,
+                                                   m_tpg_taps_p,
+                                                   (uint8_t)m_tpg_taps.size(), // NOLINT(build/unsigned)
+                                                   m_tpg_tap_exponent,
+                                                   m_tpg_threshold);
   }
 
-  // Pop one destination ptr for the frame handler
-  uint16_t* get_primfind_dest() {
-      uint16_t* primfind_dest;
+  // The destination of the hits of the kernels. The hits are turned into
+  // TPs right after, so it is free again by the next window
+  uint16_t* get_primfind_dest() { return m_primfind_dest; }
 
-      while(!m_dest_queue_frame_handler.try_pop(primfind_dest, std::chrono::milliseconds(0))) {
-        std::this_thread::sleep_for(std::chrono::microseconds(10));        
+  // Pop one output for the TPs of a window, waiting for the TP handler
+  // thread to give one back if they are all in use
+  swtpg_output* get_free_output() {
+      swtpg_output* output;
+
+      while (!m_free_output_queue.read(output)) {
+        m_free_output_event.await([this] { return !m_free_output_queue.isEmpty(); }, std::chrono::milliseconds(100));
       }
-      return primfind_dest;
+      return output;
+  }
+
+  // Pop one output for the TPs of a window, or nullptr if they are all
+  // in use
+  swtpg_output* try_get_free_output() {
+      swtpg_output* output;
+      return m_free_output_queue.read(output) ? output : nullptr;
+  }
+
+  // The output kept aside for the last window of the run, which stop
+  // flushes: waiting for a free output there could wait forever, as the
+  // TP handler thread may be waiting for a window of another handler
+  // that only stop can produce
+  swtpg_output* get_flush_output() {
+      m_flush_output_in_use.store(true);
+      return &m_flush_output;
+  }
+
+  size_t get_num_outputs() const { return m_outputs.size(); }
+  size_t get_num_free_outputs() const { return m_free_output_queue.sizeGuess(); }
+
+  // Give an output back to the frame handler, from the TP handler thread
+  void free_output(swtpg_output* output) {
+    if (output == &m_flush_output) {
+      m_flush_output_in_use.store(false);
+    } else {
+      m_free_output_queue.write(output);
+    }
+    m_free_output_event.notify();
+  }
+
+  // Whether the TP handler thread has given all the outputs back, so
+  // that no window waits in the hits queue
+  bool all_outputs_free() const {
+    return m_free_output_queue.sizeGuess() == m_outputs.size() && !m_flush_output_in_use.load();
   }
 
+  // Wait for the TP handler thread to give all the outputs back
+  void await_free_outputs() {
+    auto all_free = [this] { return all_outputs_free(); };
+    while (!all_free()) {
+      m_free_output_event.await(all_free, std::chrono::milliseconds(100));
+    }
+  }
+
+  // The windows whose TPs wait for the TP handler thread. Written by
+  // the postprocess thread of the handler (and by stop, once it is
+  // gone), read by the TP handler thread. It has room for all the
+  // outputs and the flush output, so it can't overflow
+  folly::ProducerConsumerQueue<swtpg_output*>& get_hits_queue() { return m_hits_queue; }
+
 
 private: 
-  int m_register_selector;    
-  iomanager::FollyMPMCQueue<uint16_t*> &m_dest_queue_frame_handler;
+  size_t m_first_register;
+  size_t m_last_register;
+  int m_cpu;
+  uint16_t* m_primfind_dest;
+  std::vector<swtpg_output> m_outputs;
+  swtpg_output m_flush_output;
+  std::atomic<bool> m_flush_output_in_use{ false };
+  folly::ProducerConsumerQueue<swtpg_output*> m_hits_queue;
+  folly::ProducerConsumerQueue<swtpg_output*> m_free_output_queue;
+  WIB2EventCount m_free_output_event;
   uint16_t m_tpg_threshold;                    // units of sigma // NOLINT(build/unsigned)
   const uint8_t m_tpg_tap_exponent = 6;                  // NOLINT(build/unsigned)
   const int m_tpg_multiplier = 1 << m_tpg_tap_exponent;  // 64
   std::vector<int16_t> m_tpg_taps;                       // firwin_int(7, 0.1, multiplier);
   int16_t* m_tpg_taps_p = nullptr;
+  swtpg_wib2::make_info_fn_t m_make_processing_info = nullptr;
+  // The samples of the warm-up, tick by tick, the channels of each tick
+  // in register order
+  std::vector<int16_t> m_warmup_samples;
 };
 
 
@@ -189,9 +385,9 @@ public:
 
   ~WIB2FrameProcessor()
   {
-    m_wib2_frame_handler->reset();
-    m_wib2_frame_handler_second_half->reset();
-
+    for (auto& frame_handler : m_wib2_frame_handlers) {
+      frame_handler->reset();
+    }
   }
 
   void start(const nlohmann::json& args) override
@@ -201,13 +397,22 @@ public:
 
       rcif::cmd::StartParams start_params = args.get<rcif::cmd::StartParams>();
       m_tphandler->set_run_number(start_params.run);
-  
+
+      // Nothing of the previous run may reach the TP handler. stop
+      // waits for all the outputs to come back, so the hits queues are
+      // empty, and leaves the TP handler thread idle. The queues are
+      // single-consumer: only the TP handler thread may pop them
+      for (auto& frame_handler : m_wib2_frame_handlers) {
+        assert(frame_handler->all_outputs_free());
+      }
       m_tphandler->reset();
 
       m_tps_dropped = 0;
 
-      m_wib2_frame_handler->initialize(m_tpg_threshold_selected);
-      m_wib2_frame_handler_second_half->initialize(m_tpg_threshold_selected);
+      std::lock_guard<std::mutex> params_lock(m_tpg_params_mutex);
+      for (auto& frame_handler : m_wib2_frame_handlers) {
+        frame_handler->initialize(m_tpg_threshold_selected, m_superchunks_per_window, m_tpg_make_processing_info);
+      }
     } // end if(m_sw_tpg_enabled)
 
     // Reset timestamp check
@@ -222,6 +427,18 @@ public:
     m_new_hits = 0;
     m_new_tps = 0;
     m_swtpg_hits_count.exchange(0);
+    m_num_mapped_registers = 0;
+    m_windows_shed = 0;
+    m_tps_shed = 0;
+    m_windows_shed_unreported = 0;
+    m_tps_shed_unreported = 0;
+    m_last_shed_report = 0;
+    m_kernel_latency.take();
+    m_convert_latency.take();
+    m_queue_latency.take();
+    for (auto& count : m_tp_channel_counts) {
+      count.store(0, std::memory_order_relaxed);
+    }
 
     inherited::start(args);
   }
@@ -230,9 +447,30 @@ public:
   {
     inherited::stop(args);
     if (m_sw_tpg_enabled) {
-      // Make temp. buffers reusable on next start.
-      m_wib2_frame_handler->reset();    
-      m_wib2_frame_handler_second_half->reset();  
+      // The postprocess threads are stopped: find the hits of the last,
+      // incomplete windows, in the flush outputs. Then let the TP handler
+      // thread take the windows of the handlers in timestamp order even
+      // though the other handlers have none left, until it has given all
+      // the outputs back
+      for (auto& frame_handler : m_wib2_frame_handlers) {
+        process_window(frame_handler.get(), true);
+      }
+      m_draining.store(true);
+      m_hits_event.notify();
+      for (auto& frame_handler : m_wib2_frame_handlers) {
+        frame_handler->await_free_outputs();
+      }
+      m_draining.store(false);
+
+      // Make temp. buffers reusable on next start
+      for (auto& frame_handler : m_wib2_frame_handlers) {
+        // Only pedestals that had the time to settle are worth keeping
+        if (m_keep_pedestals && !frame_handler->first_hit && frame_handler->warmup_remaining == 0) {
+          frame_handler->m_tpg_processing_info->getPedestals(frame_handler->saved_pedestals);
+          frame_handler->has_saved_pedestals = true;
+        }
+        frame_handler->reset();
+      }
       
       auto runtime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - m_t0).count();
       TLOG() << "Ran for " << runtime << "ms.";
@@ -257,22 +495,18 @@ public:
 
   void conf(const nlohmann::json& cfg) override
   {
-    // Populate the queue of primfind destinations
-    for(size_t i=0; i<m_capacity_dest_queue; ++i) {
-      uint16_t* dest = new uint16_t[100000];
-      m_dest_queue.push(std::move(dest), std::chrono::milliseconds(0));    
-    }
-    
     auto config = cfg["rawdataprocessorconf"].get<readoutlibs::readoutconfig::RawDataProcessorConf>();
     m_sourceid.id = config.source_id;
     m_sourceid.subsystem = types::DUNEWIBSuperChunkTypeAdapter::subsystem;
     m_tpg_algorithm = config.software_tpg_algorithm;
     TLOG() << "Selected software TPG algorithm: " << m_tpg_algorithm;
 
+    std::unique_lock<std::mutex> params_lock(m_tpg_params_mutex);
     m_channel_mask_vec = config.software_tpg_channel_mask; 
-    // Converting the input vector of channels masks into an std::set
-    // AAA: The set provides faster look up than a std::vector 
-    m_channel_mask_set.insert(m_channel_mask_vec.begin(), m_channel_mask_vec.end());
+    // Converting the input vector of channels masks into an std::set.
+    // It is only looked up once per channel, by apply_channel_params,
+    // to set up the lane masks of the kernels
+    m_channel_mask_set = std::set<uint>(m_channel_mask_vec.begin(), m_channel_mask_vec.end());
     for (int el : m_channel_mask_set) {        
       TLOG() << "Software TPG channel mask: " << el;
     }
@@ -281,11 +515,108 @@ public:
     m_tpg_threshold_selected = config.software_tpg_threshold;
     TLOG() << "Selected threshold value: " << m_tpg_threshold_selected;
 
+    // The WIB2 specific settings are optional, and not part of the
+    // RawDataProcessorConf shared by all the readout types
+    wib2tpgconfig::Conf tpg_config;
+    if (cfg.contains("wib2tpgconf")) {
+      tpg_config = cfg["wib2tpgconf"].get<wib2tpgconfig::Conf>();
+    }
+    if (tpg_config.superchunks_per_window < 1 ||
+        tpg_config.superchunks_per_window > swtpg_wib2::MAX_SUPERCHUNKS_PER_WINDOW) {
+      throw InvalidTPGWindow(ERS_HERE, tpg_config.superchunks_per_window, swtpg_wib2::MAX_SUPERCHUNKS_PER_WINDOW);
+    }
+    m_superchunks_per_window = tpg_config.superchunks_per_window;
+    TLOG() << "Selected superchunks per software TPG window: " << m_superchunks_per_window;
+
+    m_warmup_superchunks = tpg_config.warmup_superchunks;
+    m_keep_pedestals = tpg_config.keep_pedestals;
+    TLOG() << "Software TPG warm-up superchunks: " << m_warmup_superchunks
+           << ", pedestals kept between runs: " << (m_keep_pedestals ? "yes" : "no");
+
+    m_shed_load = tpg_config.shed_load;
+    TLOG() << "Software TPG load shedding: " << (m_shed_load ? "on" : "off");
+
+    m_channel_thresholds.clear();
+    for (const auto& channel_threshold : tpg_config.channel_thresholds) {
+      m_channel_thresholds[channel_threshold.channel] = channel_threshold.threshold;
+      TLOG() << "Software TPG threshold of channel " << channel_threshold.channel << ": " << channel_threshold.threshold;
+    }
+    m_tpg_params_generation++;
+    params_lock.unlock();
+
     if (config.enable_software_tpg) {
       m_sw_tpg_enabled = true;
 
       m_channel_map = dunedaq::detchannelmaps::make_map(config.channel_map_name);
 
+      // Build the register-to-channel map of the link now if its address
+      // is known, rather than with the first superchunk of the run
+      {
+        std::lock_guard<std::mutex> lock(m_register_channel_maps_mutex);
+        m_register_channel_maps.clear();
+      }
+      if (tpg_config.crate >= 0 && tpg_config.slot >= 0 && tpg_config.link >= 0) {
+        get_register_channel_map(tpg_config.crate, tpg_config.slot, tpg_config.link);
+      }
+
+      // Pick the fastest kernels this CPU can run
+      m_tpg_kernels = &swtpg_wib2::select_tpg_kernels();
+      TLOG() << "Selected software TPG kernels: " << swtpg_wib2::kernel_isa_name(m_tpg_kernels->isa);
+
+      // Resolve the algorithm once, rather than on every window
+      const swtpg_wib2::TPGAlgorithm* algorithm = m_tpg_kernels->find_algorithm(m_tpg_algorithm);
+      if (algorithm == nullptr) {
+        throw TPGAlgorithmInexistent(ERS_HERE, m_tpg_algorithm);
+      }
+      m_tpg_make_processing_info = algorithm->make_processing_info;
+      m_tpg_process_window = algorithm->process_window_fused;
+
+      // Split the registers of the frame evenly between the frame
+      // handlers. Unless configured otherwise: with AVX2 (or without
+      // SIMD at all) a single thread can't keep up with a whole link, so
+      // the registers are divided in two halves. The AVX-512 kernels
+      // process 32 channels per register, and a single frame handler
+      // covers the whole link
+      size_t num_frame_handlers = tpg_config.num_frame_handlers;
+      if (num_frame_handlers == 0) {
+        num_frame_handlers = (m_tpg_kernels->isa == swtpg_wib2::KernelISA::kAVX512) ? 1 : 2;
+      }
+      const wib2tpgconfig::CPUs& cpus = tpg_config.frame_handler_cpus;
+      if ((num_frame_handlers != 1 && num_frame_handlers != 2 && num_frame_handlers != 4 && num_frame_handlers != 8) ||
+          (!cpus.empty() && cpus.size() != num_frame_handlers)) {
+        throw InvalidTPGPartitioning(ERS_HERE, num_frame_handlers, cpus.size());
+      }
+      // Even 8 frame handlers get 2 registers each, the register
+      // granularity of the AVX-512 kernels
+      static_assert(swtpg_wib2::NUM_REGISTERS_PER_FRAME / 8 % 2 == 0);
+      const size_t registers_per_handler = swtpg_wib2::NUM_REGISTERS_PER_FRAME / num_frame_handlers;
+
+      // Allocate a primfind destination for each frame handler. It has
+      // room for as many hits as a window can have and the MAGIC tuple.
+      // The hits are turned into TPs on the thread of the frame handler,
+      // and the TPs of a window wait for the TP handler thread in one of
+      // the outputs of the handler, so their number bounds the windows
+      // in flight
+      const size_t dest_size =
+        (swtpg_wib2::max_hits_per_window(m_superchunks_per_window * swtpg_wib2::FRAMES_PER_MSG) + 1) *
+          swtpg_wib2::HIT_TUPLE_SIZE;
+      m_dest_pool.allocate(num_frame_handlers, dest_size, tpg_config.output_buffers_on_huge_pages);
+      const size_t outputs_per_handler = std::max<size_t>(tpg_config.num_output_buffers / num_frame_handlers, 1);
+      TLOG() << "Software TPG hit buffers: " << m_dest_pool.get_num_bytes() << " bytes"
+             << (m_dest_pool.on_huge_pages() ? " on huge pages" : "") << ", TP outputs per frame handler: " << outputs_per_handler;
+
+      for (size_t i = 0; i < num_frame_handlers; ++i) {
+        m_wib2_frame_handlers.push_back(std::make_unique<WIB2FrameHandler>(i * registers_per_handler,
+                                                                           (i + 1) * registers_per_handler,
+                                                                           m_dest_pool.buffer(i),
+                                                                           outputs_per_handler,
+                                                                           cpus.empty() ? -1 : cpus[i]));
+        TLOG() << "Software TPG frame handler " << i << ": registers " << i * registers_per_handler << "-"
+               << (i + 1) * registers_per_handler << ", CPU " << (cpus.empty() ? "any" : std::to_string(cpus[i]));
+      }
+      m_tphandler_cpu = tpg_config.tphandler_cpu;
+      TLOG() << "Software TPG TP handler thread CPU: " << (m_tphandler_cpu >= 0 ? std::to_string(m_tphandler_cpu) : "any");
+
       daqdataformats::SourceID tpset_sourceid;
       tpset_sourceid.id = config.tpset_sourceid;
       tpset_sourceid.subsystem = daqdataformats::SourceID::Subsystem::kTrigger;
@@ -295,11 +626,11 @@ public:
         new WIB2TPHandler(*m_tp_sink, *m_tpset_sink, config.tp_timeout, config.tpset_window_size, tpset_sourceid));
 
 
-      TaskRawDataProcessorModel<types::DUNEWIBSuperChunkTypeAdapter>::add_postprocess_task(
-        std::bind(&WIB2FrameProcessor::find_hits, this, std::placeholders::_1, m_wib2_frame_handler.get()));
-
-      TaskRawDataProcessorModel<types::DUNEWIBSuperChunkTypeAdapter>::add_postprocess_task(
-        std::bind(&WIB2FrameProcessor::find_hits, this, std::placeholders::_1, m_wib2_frame_handler_second_half.get()));
+      // One postprocess task (and thread) per frame handler
+      for (auto& frame_handler : m_wib2_frame_handlers) {
+        TaskRawDataProcessorModel<types::DUNEWIBSuperChunkTypeAdapter>::add_postprocess_task(
+          std::bind(&WIB2FrameProcessor::find_hits, this, std::placeholders::_1, frame_handler.get()));
+      }
 
       // Launch the thread for adding hits to tphandler
       m_add_hits_tphandler_thread_should_run.store(true);
@@ -315,29 +646,73 @@ public:
     TaskRawDataProcessorModel<types::DUNEWIBSuperChunkTypeAdapter>::conf(cfg);
   }
 
+  // Replace the threshold, the channel mask and/or the per-channel
+  // thresholds of conf while running, eg to tune a noisy detector
+  // without cycling the run. The frame handlers pick them up between
+  // two windows, and keep their pedestals and the rest of the channel
+  // state. Hits in progress in channels that get masked end there.
+  // Whatever params leave out keeps its current value
+  void tune(const nlohmann::json& args)
+  {
+    auto params = args.get<wib2tpgconfig::TuneParams>();
+
+    std::lock_guard<std::mutex> params_lock(m_tpg_params_mutex);
+    if (params.threshold != 0) {
+      m_tpg_threshold_selected = params.threshold;
+    }
+    if (params.replace_channel_mask) {
+      m_channel_mask_set = std::set<uint>(params.channel_mask.begin(), params.channel_mask.end());
+    }
+    if (params.replace_channel_thresholds) {
+      m_channel_thresholds.clear();
+      for (const auto& channel_threshold : params.channel_thresholds) {
+        m_channel_thresholds[channel_threshold.channel] = channel_threshold.threshold;
+      }
+    }
+    m_tpg_params_generation.fetch_add(1, std::memory_order_release);
+    TLOG() << "Software TPG tuned: threshold " << m_tpg_threshold_selected << ", " << m_channel_mask_set.size()
+           << " masked channels, " << m_channel_thresholds.size() << " channels with their own threshold";
+  }
+
   void scrap(const nlohmann::json& args) override
   {
    if(m_sw_tpg_enabled) {	  
       TLOG() << "Waiting to join add_hits_tphandler_thread";
       m_add_hits_tphandler_thread_should_run.store(false);
+      m_hits_event.notify();
       m_add_hits_tphandler_thread.join();
       TLOG() << "add_hits_tphandler_thread joined";
       m_tphandler.reset();
-
-      // Pop and delete all the elements of the destination queues
-      while (m_dest_queue.can_pop()) {
-        uint16_t* dest;
-        m_dest_queue.pop(dest, std::chrono::milliseconds(0));
-        delete[] dest;
-      }
-
    }    
    TaskRawDataProcessorModel<types::DUNEWIBSuperChunkTypeAdapter>::scrap(args);
+
+   // The postprocess tasks bound to the frame handlers are gone now, and
+   // with the handlers the last references to the output buffers
+   m_wib2_frame_handlers.clear();
+   m_dest_pool.release();
+   m_tpg_kernels = nullptr;
+   m_tpg_make_processing_info = nullptr;
+   m_tpg_process_window = nullptr;
+  }
+
+  // Publish the latencies of a stage since the last get_info
+  void add_latency_info(opmonlib::InfoCollector& ci, const std::string& name, WIB2LatencyHistogram& latency)
+  {
+    const WIB2LatencyHistogram::Summary summary = latency.take();
+    wib2tpginfo::LatencyInfo latency_info;
+    latency_info.count = summary.count;
+    latency_info.p50_ns = summary.p50;
+    latency_info.p99_ns = summary.p99;
+    latency_info.max_ns = summary.max;
+    opmonlib::InfoCollector tmp_ic;
+    tmp_ic.add(latency_info);
+    ci.add(name, tmp_ic);
   }
 
   void get_info(opmonlib::InfoCollector& ci, int level)
   {
     readoutlibs::readoutinfo::RawDataProcessorInfo info;
+    wib2tpginfo::ChannelInfo tpg_channel_info;
 
     if (m_tphandler != nullptr) {
       info.num_tps_sent = m_tphandler->get_and_reset_num_sent_tps();
@@ -354,43 +729,108 @@ public:
       TLOG_DEBUG(TLVL_BOOKKEEPING) << "Total new hits: " << new_hits << " new TPs: " << new_tps;
       info.rate_tp_hits = new_hits / seconds / 1000.;
     
-      // Find the channels with the top  TP rates
-      // Create a vector of pairs to store the map elements
-      std::vector<std::pair<uint, int>> channel_tp_rate_vec(m_tp_channel_rate_map.begin(), m_tp_channel_rate_map.end());
-      // Sort the vector in descending order of the value of the pairs
-      sort(channel_tp_rate_vec.begin(), channel_tp_rate_vec.end(), [](std::pair<uint, int>& a, std::pair<uint, int>& b) {
-        return a.second > b.second;
-      });
-      // Add the metrics to opmon
-      // For convenience we are selecting only the top 10 elements
-      if (channel_tp_rate_vec.size() != 0) {
-        int top_highest_values = 10;
-        if (channel_tp_rate_vec.size() < 10) {
-          top_highest_values = channel_tp_rate_vec.size();
+      // Take the TP counts of the channels since the last call, and
+      // start them again from 0. Each counter is taken and reset in one
+      // atomic exchange, so no TP is lost or counted twice, without
+      // holding up the frame handlers
+      std::array<uint32_t, s_num_register_channels> channel_tps; // NOLINT(build/unsigned)
+      for (size_t i = 0; i < s_num_register_channels; ++i) {
+        channel_tps[i] = m_tp_channel_counts[i].exchange(0, std::memory_order_relaxed);
+      }
+
+      // The counters are indexed by register position, which only maps
+      // to offline channels once every frame handler has seen its first
+      // superchunk
+      if (m_num_mapped_registers.load() == swtpg_wib2::NUM_REGISTERS_PER_FRAME) {
+        std::array<size_t, s_num_register_channels> by_channel;
+        std::iota(by_channel.begin(), by_channel.end(), 0);
+        std::sort(by_channel.begin(), by_channel.end(), [this](size_t a, size_t b) {
+          return m_register_channels[a] < m_register_channels[b];
+        });
+        for (size_t i : by_channel) {
+          tpg_channel_info.channels.push_back(m_register_channels[i]);
+          tpg_channel_info.num_tps.push_back(channel_tps[i]);
         }
-        for (int i = 0; i < top_highest_values; i++) {
+
+        // The channels with the top TP rates, also on their own. Fewer
+        // than 10 if fewer channels had TPs
+        std::partial_sort(by_channel.begin(), by_channel.begin() + 10, by_channel.end(), [&channel_tps](size_t a, size_t b) {
+          return channel_tps[a] > channel_tps[b];
+        });
+        for (size_t i = 0; i < 10 && channel_tps[by_channel[i]] > 0; ++i) {
           std::stringstream info_name;
-          info_name << "channel_" <<  channel_tp_rate_vec[i].first;
+          info_name << "channel_" << m_register_channels[by_channel[i]];
           opmonlib::InfoCollector tmp_ic;
           readoutlibs::readoutinfo::TPChannelInfo tp_info;
-          tp_info.num_tp = channel_tp_rate_vec[i].second;
+          tp_info.num_tp = channel_tps[by_channel[i]];
           tmp_ic.add(tp_info);
           ci.add(info_name.str(), tmp_ic);
         }
       }
 
-      // Reset the counter in the channel rate map
-      for (auto& el : m_tp_channel_rate_map) {
-        el.second = 0;
-      }
-
     }
     m_t0 = now;
 
+    if (m_tpg_kernels != nullptr) {
+      wib2tpginfo::Info tpg_info;
+      tpg_info.kernel_isa = swtpg_wib2::kernel_isa_name(m_tpg_kernels->isa);
+      tpg_info.num_frame_handlers = m_wib2_frame_handlers.size();
+      tpg_info.num_windows_shed = m_windows_shed.exchange(0);
+      tpg_info.num_tps_shed = m_tps_shed.exchange(0);
+      ci.add(tpg_info);
+
+      add_latency_info(ci, "latency_kernel", m_kernel_latency);
+      add_latency_info(ci, "latency_convert", m_convert_latency);
+      add_latency_info(ci, "latency_queue", m_queue_latency);
+      if (m_tphandler != nullptr) {
+        add_latency_info(ci, "latency_tpset", m_tphandler->get_tpset_latency());
+      }
+      if (!tpg_channel_info.channels.empty()) {
+        ci.add(tpg_channel_info);
+      }
+    }
+
     readoutlibs::TaskRawDataProcessorModel<types::DUNEWIBSuperChunkTypeAdapter>::get_info(ci, level);
     ci.add(info);
   }
 
+  // Send the TPs and TPSets to the given senders instead of the
+  // connections of init, eg to in-process stand-ins when the pipeline
+  // is driven offline. Must be called before conf
+  void set_tp_sinks(std::shared_ptr<iomanager::SenderConcept<types::TriggerPrimitiveTypeAdapter>> tp_sink,
+                    std::shared_ptr<iomanager::SenderConcept<trigger::TPSet>> tpset_sink)
+  {
+    m_tp_sink = tp_sink;
+    m_tpset_sink = tpset_sink;
+  }
+
+  // Number of superchunks waiting in the fullest of the postprocess
+  // queues, ie for the slowest frame handler
+  size_t get_postprocess_queue_occupancy() const
+  {
+    size_t occupancy = 0;
+    for (auto& queue : inherited::m_items_to_postprocess_queues) {
+      occupancy = std::max(occupancy, queue->sizeGuess());
+    }
+    return occupancy;
+  }
+
+  size_t get_postprocess_queue_capacity() const
+  {
+    return inherited::m_items_to_postprocess_queues.empty() ? 0
+                                                            : inherited::m_items_to_postprocess_queues.front()->capacity();
+  }
+
+  // Number of windows whose hits wait for the TP handler thread
+  size_t get_tphandler_queue_occupancy()
+  {
+    size_t occupancy = 0;
+    for (auto& frame_handler : m_wib2_frame_handlers) {
+      occupancy += frame_handler->get_hits_queue().sizeGuess();
+    }
+    return occupancy;
+  }
+
 protected:
   // Internals
   timestamp_t m_previous_ts = 0;
@@ -461,11 +901,9 @@ protected:
     auto wfptr = reinterpret_cast<dunedaq::detdataformats::wib2::WIB2Frame*>((uint8_t*)fp); // NOLINT
     uint64_t timestamp = wfptr->get_timestamp();                        // NOLINT(build/unsigned)
 
-    // Frame expansion
-    swtpg_wib2::MessageRegisters registers_array;
-    int register_selection = frame_handler->get_registers_selector();    
-    expand_wib2_adcs(fp, &registers_array, register_selection); 
-      
+    const size_t first_register = frame_handler->get_first_register();
+    const size_t last_register = frame_handler->get_last_register();
+
 
     // Only for the first superchunk, create an offline register map 
     if (frame_handler->first_hit) {
@@ -476,9 +914,42 @@ protected:
       tid = syscall(SYS_gettid);
       TLOG_DEBUG(TLVL_BOOKKEEPING) << " Thread ID " << thread_id << " PID " << tid ;
 
-      frame_handler->register_channel_map = swtpg_wib2::get_register_to_offline_channel_map_wib2(wfptr, m_channel_map, register_selection);
+      // The postprocess thread of the frame handler only becomes known
+      // here, so this is where it gets pinned
+      if (frame_handler->get_cpu() >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(frame_handler->get_cpu(), &cpuset);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+        if (ret != 0) {
+          ers::warning(TPGThreadPinningFailed(ERS_HERE, first_register, last_register, frame_handler->get_cpu(), std::strerror(ret)));
+        }
+      }
+      frame_handler->allocate_state();
+
+      frame_handler->register_channel_map =
+        get_register_channel_map(wfptr->header.crate, wfptr->header.slot, wfptr->header.link);
+
+      // The hit finding kernels unpack the ADCs themselves, but setState
+      // reads the pedestals from expanded registers in the AVX2 layout
+      swtpg_wib2::MessageRegisters first_registers_array;
+      swtpg_wib2::expand_wib2_adcs_scalar(fp, &first_registers_array, first_register, last_register);
+      frame_handler->m_tpg_processing_info->setState(first_registers_array);
+
+      // A single tick is a poor estimate of the pedestals, and the
+      // kernels would fire on every channel until the frugal median
+      // caught up with them. Start from the pedestals of the previous
+      // run or, failing that, measure them in a warm-up
+      if (frame_handler->has_saved_pedestals) {
+        frame_handler->m_tpg_processing_info->setPedestals(frame_handler->saved_pedestals);
+      } else {
+        frame_handler->warmup_remaining = m_warmup_superchunks;
+      }
 
-      frame_handler->m_tpg_processing_info->setState(registers_array);
+      // The configured thresholds and channel mask are per offline
+      // channel, so they can only be put in place once the channel map
+      // is known
+      apply_channel_params(frame_handler);
 
       // Debugging statements 
       m_link = wfptr->header.link;
@@ -486,14 +957,14 @@ protected:
       m_slot_no = wfptr->header.slot;
       TLOG() << "Got first item, link/crate/slot=" << m_link << "/" << m_crate_no << "/" << m_slot_no;      
     
-      // Add WIB2FrameHandler channel map to the common m_register_channels. 
-      // Populate the array taking into account the position of the register selector
-      for (size_t i = 0; i < swtpg_wib2::NUM_REGISTERS_PER_FRAME * swtpg_wib2::SAMPLES_PER_REGISTER; ++i) {	      
-          m_register_channels[i+register_selection * swtpg_wib2::NUM_REGISTERS_PER_FRAME * swtpg_wib2::SAMPLES_PER_REGISTER] = frame_handler->register_channel_map.channel[i];          
-
-          // Set up a map of channels and number of TPs for monitoring/debug
-          m_tp_channel_rate_map[frame_handler->register_channel_map.channel[i]] = 0;
+      // Add the channels of this WIB2FrameHandler to the common m_register_channels. 
+      // The register positions are absolute within the frame
+      for (size_t i = first_register * swtpg_wib2::SAMPLES_PER_REGISTER; i < last_register * swtpg_wib2::SAMPLES_PER_REGISTER; ++i) {	      
+          m_register_channels[i] = frame_handler->register_channel_map.channel[i];          
       }
+      // Let get_info know that the TP counters of these registers can
+      // be published under their offline channel
+      m_num_mapped_registers += last_register - first_register;
 
       TLOG() << "Processed the first superchunk ";
 
@@ -503,146 +974,334 @@ protected:
 
     } // end if (frame_handler->first_hit)
 
-    // Execute the SWTPG algorithm
-    frame_handler->m_tpg_processing_info->input = &registers_array;
+    // Pick up the thresholds and channel mask of tune, if they changed.
+    // The window being filled hasn't gone through the kernels yet, so
+    // the whole of it sees the new ones
+    if (frame_handler->params_generation != m_tpg_params_generation.load(std::memory_order_acquire)) {
+      apply_channel_params(frame_handler);
+    }
+
+    // During the warm-up the superchunks are only used to measure the
+    // pedestals, and no hits are looked for
+    if (frame_handler->warmup_remaining > 0) {
+      swtpg_wib2::MessageRegisters registers_array;
+      swtpg_wib2::expand_wib2_adcs_scalar(fp, &registers_array, first_register, last_register);
+      frame_handler->add_warmup_superchunk(registers_array);
+      if (--frame_handler->warmup_remaining == 0) {
+        swtpg_wib2::ChannelPedestals<swtpg_wib2::NUM_REGISTERS_PER_FRAME> pedestals;
+        frame_handler->measure_pedestals(pedestals);
+        frame_handler->m_tpg_processing_info->setPedestals(pedestals);
+      }
+      return;
+    }
+
+    if (frame_handler->superchunks_per_window == 1) {
+      run_tpg_kernels(frame_handler, fp, 1, timestamp);
+      return;
+    }
+
+    // The hit times count from the start of the window, so a gap in the
+    // timestamps ends the window early
+    if (frame_handler->window_num_superchunks > 0 && timestamp != frame_handler->next_timestamp) {
+      process_window(frame_handler);
+    }
+    if (frame_handler->window_num_superchunks == 0) {
+      frame_handler->window_timestamp = timestamp;
+    }
+    frame_handler->window[frame_handler->window_num_superchunks++] = *fp;
+    frame_handler->next_timestamp =
+      timestamp + types::DUNEWIBSuperChunkTypeAdapter::expected_tick_difference * fp->get_num_frames();
+
+    if (frame_handler->window_num_superchunks == frame_handler->superchunks_per_window) {
+      process_window(frame_handler);
+    }
+  }
+
+  // Find the hits in the superchunks collected in the window of the
+  // frame handler, if any. At stop (flush) the TPs go to the flush output
+  // of the handler
+  void process_window(WIB2FrameHandler* frame_handler, bool flush = false)
+  {
+    if (frame_handler->window_num_superchunks == 0) {
+      return;
+    }
+    run_tpg_kernels(frame_handler,
+                    frame_handler->window.data(),
+                    frame_handler->window_num_superchunks,
+                    frame_handler->window_timestamp,
+                    flush);
+    frame_handler->window_num_superchunks = 0;
+  }
+
+  // The register-to-channel map of the frames of a crate, slot and link.
+  // Building it takes 256 channel map lookups and the expansion of a
+  // whole superchunk, so it is only done once for each link, at conf
+  // when its address is configured, and kept until the next conf
+  const swtpg_wib2::RegisterChannelMap& get_register_channel_map(uint crate, uint slot, uint link)
+  {
+    std::lock_guard<std::mutex> lock(m_register_channel_maps_mutex);
+    const auto address = std::make_tuple(crate, slot, link);
+    auto register_channel_map = m_register_channel_maps.find(address);
+    if (register_channel_map == m_register_channel_maps.end()) {
+      register_channel_map =
+        m_register_channel_maps
+          .emplace(address, swtpg_wib2::get_register_to_offline_channel_map_wib2(crate, slot, link, m_channel_map))
+          .first;
+    }
+    return register_channel_map->second;
+  }
+
+  // Put the threshold and the mask of each channel of the frame handler
+  // in its channel state, keeping the pedestals and the rest of the
+  // state. The kernels apply the mask themselves, so the masked channels
+  // never make it to the output. The channel map must be known
+  void apply_channel_params(WIB2FrameHandler* frame_handler)
+  {
+    std::lock_guard<std::mutex> lock(m_tpg_params_mutex);
+    frame_handler->params_generation = m_tpg_params_generation.load();
+    for (size_t i = frame_handler->get_first_register() * swtpg_wib2::SAMPLES_PER_REGISTER;
+         i < frame_handler->get_last_register() * swtpg_wib2::SAMPLES_PER_REGISTER;
+         ++i) {
+      const uint channel = frame_handler->register_channel_map.channel[i];
+      auto channel_threshold = m_channel_thresholds.find(channel);
+      frame_handler->m_tpg_processing_info->setChannelThreshold(
+        i, channel_threshold != m_channel_thresholds.end() ? channel_threshold->second : m_tpg_threshold_selected);
+      frame_handler->m_tpg_processing_info->setChannelMasked(i, m_channel_mask_set.count(channel) > 0);
+    }
+  }
+
+  // Execute the configured algorithm on num_superchunks consecutive
+  // superchunks starting at ucs, whose first frame has the given
+  // timestamp. The fused kernels unpack the ADCs straight from the
+  // frames, with no intermediate MessageRegisters
+  void run_tpg_kernels(WIB2FrameHandler* frame_handler,
+                       constframeptr ucs,
+                       size_t num_superchunks,
+                       uint64_t timestamp, // NOLINT(build/unsigned)
+                       bool flush = false)
+  {
+    const auto kernel_start = std::chrono::steady_clock::now();
     uint16_t* destination_ptr = frame_handler->get_primfind_dest();
     *destination_ptr = swtpg_wib2::MAGIC;
     frame_handler->m_tpg_processing_info->output = destination_ptr;
+    frame_handler->m_tpg_processing_info->timeWindowNumFrames = num_superchunks * swtpg_wib2::FRAMES_PER_MSG;
     
-    if (m_tpg_algorithm == "SWTPG") {
-      swtpg_wib2::process_window_avx2(*frame_handler->m_tpg_processing_info, register_selection*swtpg_wib2::NUM_REGISTERS_PER_FRAME * swtpg_wib2::SAMPLES_PER_REGISTER);
-    } else if (m_tpg_algorithm == "AbsRS" ){
-      swtpg_wib2::process_window_rs_avx2(*frame_handler->m_tpg_processing_info, register_selection*swtpg_wib2::NUM_REGISTERS_PER_FRAME * swtpg_wib2::SAMPLES_PER_REGISTER);
-    } else {
-      throw TPGAlgorithmInexistent(ERS_HERE, "m_tpg_algo");
-    }     
+    m_tpg_process_window(*frame_handler->m_tpg_processing_info, ucs);
+    const auto kernel_end = std::chrono::steady_clock::now();
+    m_kernel_latency.add(kernel_end - kernel_start);
     
-    // Insert output of the AVX processing into the swtpg_output 
-    swtpg_output swtpg_processing_result = {destination_ptr, timestamp};
-
-    // Push to the MPMC tphandler queue only if it's possible, else drop the TPs.
-    if(!m_tphandler_queue.try_push(std::move(swtpg_processing_result), std::chrono::milliseconds(0))) {
+    // Turn the hits into TPs here, on the thread of the frame handler,
+    // so that the TP handler thread only has to put them in TPSets
+    swtpg_output* swtpg_processing_result = nullptr;
+    if (flush) {
+      swtpg_processing_result = frame_handler->get_flush_output();
+    } else if (m_shed_load) {
+      swtpg_processing_result = get_output_or_shed(frame_handler);
+    } else {
+      swtpg_processing_result = frame_handler->get_free_output();
+    }
+    if (swtpg_processing_result == nullptr) {
+      // The kernels still ran, so the channel state doesn't skip the
+      // window, but its hits are dropped
+      m_windows_shed++;
+      m_tps_shed += frame_handler->m_tpg_processing_info->nhits;
+      m_windows_shed_unreported++;
+      m_tps_shed_unreported += frame_handler->m_tpg_processing_info->nhits;
+      report_load_shedding();
+      return;
+    }
+    swtpg_processing_result->timestamp = timestamp;
+    swtpg_processing_result->tps.clear();
+    m_swtpg_hits_count += process_swtpg_hits(destination_ptr, timestamp, swtpg_processing_result->tps);
+    // The kernels write the hits by end time and register, so their
+    // start times are out of order. Sorting them here, rather than on
+    // the TP handler thread, leaves it a merge of sorted windows
+    WIB2TPHandler::sort_tps(swtpg_processing_result->tps);
+
+    // Hand the TPs over to the TP handler thread, and wake it up. The
+    // queue has room for all the outputs of the handler, so this only
+    // fails if the output didn't come from the handler
+    swtpg_processing_result->enqueue_time = std::chrono::steady_clock::now();
+    m_convert_latency.add(swtpg_processing_result->enqueue_time - kernel_end);
+    if (!frame_handler->get_hits_queue().write(swtpg_processing_result)) {
         // we're going to loose these hits
         ers::warning(TPHandlerBacklog(ERS_HERE, m_sourceid.id));
     }
-
+    m_hits_event.notify();
 
   }
 
 
 
-  unsigned int process_swtpg_hits(uint16_t* primfind_it, timestamp_t timestamp)
+  // An output for the TPs of the window, or nullptr to drop them. A
+  // frame handler starts shedding load when it has no free output left,
+  // ie when the TP handler thread falls behind, and stops by itself once
+  // a quarter of its outputs are back, so as not to flip at every window
+  swtpg_output* get_output_or_shed(WIB2FrameHandler* frame_handler)
+  {
+    if (frame_handler->shedding) {
+      if (frame_handler->get_num_free_outputs() < std::max<size_t>(frame_handler->get_num_outputs() / 4, 1)) {
+        return nullptr;
+      }
+      frame_handler->shedding = false;
+      TLOG() << "Software TPG frame handler of registers " << frame_handler->get_first_register() << "-"
+             << frame_handler->get_last_register() << " of source " << m_sourceid.id << " stopped shedding load";
+    }
+    swtpg_output* output = frame_handler->try_get_free_output();
+    frame_handler->shedding = (output == nullptr);
+    return output;
+  }
+
+  // Warn about the windows shed since the last warning, at most once
+  // every s_shed_report_interval, from whichever frame handler thread
+  // gets there first. ers::warning is far too heavy to call for every
+  // window when the TPG is already overloaded
+  void report_load_shedding()
+  {
+    const int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+    int64_t last_report = m_last_shed_report.load(std::memory_order_relaxed);
+    if (now - last_report < std::chrono::steady_clock::duration(s_shed_report_interval).count() ||
+        !m_last_shed_report.compare_exchange_strong(last_report, now)) {
+      return;
+    }
+    ers::warning(TPGLoadShedding(
+      ERS_HERE, m_sourceid.id, m_windows_shed_unreported.exchange(0), m_tps_shed_unreported.exchange(0)));
+  }
+
+  // Append the TPs of the hits at primfind_it, found in the window
+  // starting at timestamp, to tps. Returns the number of hits
+  unsigned int process_swtpg_hits(uint16_t* primfind_it,
+                                  timestamp_t timestamp,
+                                  std::vector<triggeralgs::TriggerPrimitive>& tps)
   {
 
     constexpr int clocksPerTPCTick = 32;
 
-    uint16_t chan[16], hit_end[16], hit_charge[16], hit_tover[16]; // NOLINT(build/unsigned)
     unsigned int nhits = 0;
 
+    // The kernels write one (channel, end time, charge, time over
+    // threshold, peak ADC, peak time, 0, 0) tuple per hit, and end the
+    // list with a tuple of MAGIC
     while (*primfind_it != swtpg_wib2::MAGIC) {
-      // First, get all of the register values (including those with no hit) into local variables
-      for (int i = 0; i < 16; ++i) {
-        chan[i] = *primfind_it++; // NOLINT(runtime/increment_decrement)
-      }
-      for (int i = 0; i < 16; ++i) {
-        hit_end[i] = *primfind_it++; // NOLINT(runtime/increment_decrement)
-      }
-      for (int i = 0; i < 16; ++i) {
-        hit_charge[i] = *primfind_it++; // NOLINT(runtime/increment_decrement)
-        //TLOG() << "hit_charge:" << hit_charge[i];
-      }
-      for (int i = 0; i < 16; ++i) {
-        //hit_tover[i] = static_cast<uint16_t>(*primfind_it++); // NOLINT(runtime/increment_decrement)
-        hit_tover[i] = *primfind_it++; // NOLINT(runtime/increment_decrement)
-      }
-
-      // Now that we have all the register values in local
-      // variables, loop over the register index (ie, channel) and
-      // find the channels which actually had a hit, as indicated by
-      // nonzero value of hit_charge
-      for (int i = 0; i < 16; ++i) {
-        if (hit_charge[i] && chan[i] != swtpg_wib2::MAGIC) {
-
-          // This channel had a hit ending here, so we can create and output the hit here
-          const uint16_t offline_channel = m_register_channels[chan[i]];
-          if (m_channel_mask_set.find(offline_channel) == m_channel_mask_set.end()) {   
-
-            uint64_t tp_t_begin =                                                        // NOLINT(build/unsigned)
-              timestamp + clocksPerTPCTick * (int64_t(hit_end[i]) - int64_t(hit_tover[i]));       // NOLINT(build/unsigned)
-            uint64_t tp_t_end = timestamp + clocksPerTPCTick * int64_t(hit_end[i]);      // NOLINT(build/unsigned)
-  
-            // May be needed for TPSet:
-            // uint64_t tspan = clocksPerTPCTick * hit_tover[i]; // is/will be this needed?
-            //
-  
-            // For quick n' dirty debugging: print out time/channel of hits.
-            // Can then make a text file suitable for numpy plotting with, eg:
-            //
-            // sed -n -e 's/.*Hit: \(.*\) \(.*\).*/\1 \2/p' log.txt  > hits.txt
-            //
-            //TLOG() << "Hit: " << tp_t_begin << " " << offline_channel;
-  
-            triggeralgs::TriggerPrimitive trigprim;
-            trigprim.time_start = tp_t_begin;
-            trigprim.time_peak = (tp_t_begin + tp_t_end) / 2;
-            trigprim.time_over_threshold = int64_t(hit_tover[i]) * clocksPerTPCTick;
-            trigprim.channel = offline_channel;
-            trigprim.adc_integral = hit_charge[i];
-            trigprim.adc_peak = hit_charge[i] / 20;
-            trigprim.detid =
-              m_link; // TODO: convert crate/slot/link to SourceID Roland Sipos rsipos@cern.ch July-22-2021
-            trigprim.type = triggeralgs::TriggerPrimitive::Type::kTPC;
-            trigprim.algorithm = triggeralgs::TriggerPrimitive::Algorithm::kTPCDefault;
-            trigprim.version = 1;
-  
-            if (!m_tphandler->add_tp(trigprim, timestamp)) {
-              m_tps_dropped++;
-            }
-  
-            m_new_tps++;
-            ++nhits;
+      const uint16_t chan = primfind_it[0];          // NOLINT(build/unsigned)
+      const uint16_t hit_end = primfind_it[1];       // NOLINT(build/unsigned)
+      const uint16_t hit_charge = primfind_it[2];    // NOLINT(build/unsigned)
+      const uint16_t hit_tover = primfind_it[3];     // NOLINT(build/unsigned)
+      const uint16_t hit_peak_adc = primfind_it[4];  // NOLINT(build/unsigned)
+      const uint16_t hit_peak_time = primfind_it[5]; // NOLINT(build/unsigned)
+      primfind_it += swtpg_wib2::HIT_TUPLE_SIZE;
+
+      const uint16_t offline_channel = m_register_channels[chan];
+
+      uint64_t tp_t_begin =                                                        // NOLINT(build/unsigned)
+        timestamp + clocksPerTPCTick * (int64_t(hit_end) - int64_t(hit_tover));   // NOLINT(build/unsigned)
+
+      // For quick n' dirty debugging: print out time/channel of hits.
+      // Can then make a text file suitable for numpy plotting with, eg:
+      //
+      // sed -n -e 's/.*Hit: \(.*\) \(.*\).*/\1 \2/p' log.txt  > hits.txt
+      //
+      //TLOG() << "Hit: " << tp_t_begin << " " << offline_channel;
+
+      triggeralgs::TriggerPrimitive trigprim;
+      trigprim.time_start = tp_t_begin;
+      trigprim.time_peak = tp_t_begin + clocksPerTPCTick * int64_t(hit_peak_time);
+      trigprim.time_over_threshold = int64_t(hit_tover) * clocksPerTPCTick;
+      trigprim.channel = offline_channel;
+      trigprim.adc_integral = hit_charge;
+      trigprim.adc_peak = hit_peak_adc;
+      trigprim.detid =
+        m_link; // TODO: convert crate/slot/link to SourceID Roland Sipos rsipos@cern.ch July-22-2021
+      trigprim.type = triggeralgs::TriggerPrimitive::Type::kTPC;
+      trigprim.algorithm = triggeralgs::TriggerPrimitive::Algorithm::kTPCDefault;
+      trigprim.version = 1;
+
+      tps.push_back(trigprim);
+
+      // Count the TPs of each channel for monitoring. Each counter is
+      // only incremented by the frame handler of its register, so the
+      // increment is uncontended
+      m_tp_channel_counts[chan].fetch_add(1, std::memory_order_relaxed);
+
+      ++nhits;
+    }
+    // One atomic update per window, as the frame handlers share the counter
+    m_new_tps += nhits;
+    return nhits;
+  }
 
-            // Update the channel/rate map. Increment the value associated with the TP channel 
-            m_tp_channel_rate_map[offline_channel]++;
 
-          }
+  // The frame handler whose next window is the earliest, provided all of
+  // them have one ready: the windows of each handler come in time
+  // order, so the others can't come up with an earlier one. Null if a
+  // handler has nothing ready yet. When draining at stop, all the windows
+  // of the run are already in the queues, and the handlers that have
+  // none left are skipped
+  WIB2FrameHandler* next_window_handler() {
+    const bool draining = m_draining.load();
+    WIB2FrameHandler* earliest = nullptr;
+    for (auto& frame_handler : m_wib2_frame_handlers) {
+      swtpg_output* const* front = frame_handler->get_hits_queue().frontPtr();
+      if (front == nullptr) {
+        if (draining) {
+          continue;
         }
+        return nullptr;
+      }
+      if (earliest == nullptr || (*front)->timestamp < (*earliest->get_hits_queue().frontPtr())->timestamp) {
+        earliest = frame_handler.get();
       }
     }
-    return nhits;
+    return earliest;
   }
 
-
-  // Push destination ptr to the common queue
-  void free_primfind_dest(uint16_t* dest) {
-    m_dest_queue.push(std::move(dest), std::chrono::milliseconds(0));
-  } 
-
-
   // Function for the TPHandler threads. 
-  // Reads the m_tpthread_queue and then process the hits
+  // Merges the hits queues of the frame handlers by window timestamp
+  // and then hands the TPs of each window, sorted by start time, to the
+  // TP handler.
+  // Sleeps until a frame handler has new hits when there aren't windows
+  // from all of them
   void add_hits_to_tphandler() {
 
     std::stringstream thread_name;
     thread_name << "tphandler-" << m_sourceid.id;
     pthread_setname_np(pthread_self(), thread_name.str().c_str());    
 
+    if (m_tphandler_cpu >= 0) {
+      cpu_set_t cpuset;
+      CPU_ZERO(&cpuset);
+      CPU_SET(m_tphandler_cpu, &cpuset);
+      int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+      if (ret != 0) {
+        ers::warning(TPHandlerThreadPinningFailed(ERS_HERE, m_sourceid.id, m_tphandler_cpu, std::strerror(ret)));
+      }
+    }
+
+    auto can_merge = [this] {
+      return next_window_handler() != nullptr || !m_add_hits_tphandler_thread_should_run.load();
+    };
+
     while (m_add_hits_tphandler_thread_should_run.load()) {
-      swtpg_output result_from_swtpg; 
-      while(m_tphandler_queue.can_pop()) {
-	    if(m_tphandler_queue.try_pop(result_from_swtpg, std::chrono::milliseconds(0))) {
-      
-            // Process the trigger primitve
-            unsigned int nhits = process_swtpg_hits(result_from_swtpg.output_location, result_from_swtpg.timestamp);
-        
-            m_swtpg_hits_count += nhits;
-            m_tphandler->try_sending_tpsets(result_from_swtpg.timestamp);
-  
-            // After sending the TPset, add back the dest pointer to the queue
-            free_primfind_dest(result_from_swtpg.output_location);
-            }
+      WIB2FrameHandler* frame_handler = next_window_handler();
+      if (frame_handler == nullptr) {
+        m_hits_event.await(can_merge, std::chrono::milliseconds(100));
+        continue;
       }
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+      swtpg_output* result_from_swtpg = *frame_handler->get_hits_queue().frontPtr();
+      frame_handler->get_hits_queue().popFront();
+      const auto dequeue_time = std::chrono::steady_clock::now();
+      m_queue_latency.add(dequeue_time - result_from_swtpg->enqueue_time);
+      m_tphandler->add_window_arrival(result_from_swtpg->timestamp, dequeue_time);
+
+      // Merge the trigger primitives of the window, sorted by the frame
+      // handler, into the TP handler
+      m_tps_dropped += m_tphandler->add_tps(
+        result_from_swtpg->tps.begin(), result_from_swtpg->tps.end(), result_from_swtpg->timestamp);
+      m_tphandler->try_sending_tpsets(result_from_swtpg->timestamp);
+
+      // After sending the TPset, give the output back to the frame handler
+      frame_handler->free_output(result_from_swtpg);
     } 
   }
 
@@ -651,9 +1310,42 @@ private:
   std::string m_tpg_algorithm;
   std::vector<int> m_channel_mask_vec;
   std::set<uint> m_channel_mask_set;
+  std::map<uint, uint16_t> m_channel_thresholds; // NOLINT(build/unsigned)
   uint16_t m_tpg_threshold_selected;
-
-  std::map<uint, std::atomic<int>> m_tp_channel_rate_map;
+  // Guards the threshold and the channel mask above, which tune can
+  // replace while the frame handlers run. The frame handlers only take
+  // it when m_tpg_params_generation moves on
+  std::mutex m_tpg_params_mutex;
+  std::atomic<uint64_t> m_tpg_params_generation{ 0 }; // NOLINT(build/unsigned)
+  size_t m_superchunks_per_window = 1;
+  size_t m_warmup_superchunks = 0;
+  bool m_keep_pedestals = false;
+
+  // Load shedding. The first two counters are for opmon, the others for
+  // the warnings, and all of them count since they were last read
+  static constexpr std::chrono::seconds s_shed_report_interval{ 10 };
+  bool m_shed_load = false;
+  std::atomic<uint64_t> m_windows_shed{ 0 };            // NOLINT(build/unsigned)
+  std::atomic<uint64_t> m_tps_shed{ 0 };                // NOLINT(build/unsigned)
+  std::atomic<uint64_t> m_windows_shed_unreported{ 0 }; // NOLINT(build/unsigned)
+  std::atomic<uint64_t> m_tps_shed_unreported{ 0 };     // NOLINT(build/unsigned)
+  std::atomic<int64_t> m_last_shed_report{ 0 };         // steady_clock ticks
+
+  // Wall time spent by the windows in each stage of the pipeline: in the
+  // kernels, turning the hits into TPs (and waiting for an output), and
+  // waiting for the TP handler thread. The time to a TPSet is kept by
+  // WIB2TPHandler
+  WIB2LatencyHistogram m_kernel_latency;
+  WIB2LatencyHistogram m_convert_latency;
+  WIB2LatencyHistogram m_queue_latency;
+
+  static constexpr size_t s_num_register_channels = swtpg_wib2::NUM_REGISTERS_PER_FRAME * swtpg_wib2::SAMPLES_PER_REGISTER;
+
+  // Number of TPs of each channel since the last get_info, indexed by
+  // register position like m_register_channels
+  std::array<std::atomic<uint32_t>, s_num_register_channels> m_tp_channel_counts{}; // NOLINT(build/unsigned)
+  // Number of registers whose offline channels are in m_register_channels
+  std::atomic<size_t> m_num_mapped_registers{ 0 };
 
   size_t m_num_msg = 0;
   size_t m_num_push_fail = 0;
@@ -661,6 +1353,9 @@ private:
   std::atomic<int> m_swtpg_hits_count{ 0 };
 
   std::atomic<bool> m_add_hits_tphandler_thread_should_run;
+  // Set by stop while the TP handler thread empties the hits queues
+  std::atomic<bool> m_draining{ false };
+  int m_tphandler_cpu = -1;
 
   uint32_t m_link; // NOLINT(build/unsigned)
   uint32_t m_slot_no;  // NOLINT(build/unsigned)
@@ -668,8 +1363,14 @@ private:
 
   std::shared_ptr<detchannelmaps::TPCChannelMap> m_channel_map;
 
+  // The register-to-channel maps of the crate, slot and link of the
+  // frames seen since conf. Only ever more than one if the frames of the
+  // link change address
+  std::mutex m_register_channel_maps_mutex;
+  std::map<std::tuple<uint, uint, uint>, swtpg_wib2::RegisterChannelMap> m_register_channel_maps;
+
   // Mapping from expanded AVX register position to offline channel number
-  std::array<uint, 256> m_register_channels;
+  std::array<uint, s_num_register_channels> m_register_channels;
 
 
 
@@ -679,32 +1380,31 @@ private:
 
   std::unique_ptr<WIB2TPHandler> m_tphandler;
 
-  // AAA: TODO: make selection of the initial capacity of the queue configurable
-  size_t m_capacity_mpmc_queue = 300000; 
-  iomanager::FollyMPMCQueue<swtpg_output> m_tphandler_queue{"tphandler_queue", m_capacity_mpmc_queue};
+  // Signalled by the frame handlers when they have new hits for the TP
+  // handler thread
+  WIB2EventCount m_hits_event;
 
 
-  // Destination queue represents the queue of primfind
-  // destinations after the execution of the SWTPG. We 
-  // are using queues because we want to avoid adding a 
-  // memcpy. Previously the processing threads were also 
+  // The primfind destinations, written by the SWTPG and
+  // read by the TP handler thread. We are passing buffers
+  // around because we want to avoid adding a memcpy.
+  // Previously the processing threads were also
   // performing the TPHandler task so this was not needed
-  // (look at ProtoWIB SWTPG implementation). The size of 
-  // the queues was set big enough for the March coldbox 
-  // tests. The size of each uint16_t buffer is 100 000, 
-  // therefore the total impact on memory is: 
-  // 100 000 * (16bit = 2 bytes) * 300 000 ~ 55 GB
-  size_t m_capacity_dest_queue = m_capacity_mpmc_queue+4; 
-  iomanager::FollyMPMCQueue<uint16_t*> m_dest_queue{"dest_queue", m_capacity_dest_queue};
-
-
-  // Select the registers where to process the frame expansion. 
-  // E.g.: 0 --> divide registers by 2 (= 16/2) and select the first half 
-  // E.g.: 1 --> divide registers by 2 (= 16/2) and select the second half
-  int selection_of_register = 0; 
-  std::unique_ptr<WIB2FrameHandler> m_wib2_frame_handler = std::make_unique<WIB2FrameHandler>(selection_of_register, m_dest_queue);
-  int selection_of_register_second_half = 1; 
-  std::unique_ptr<WIB2FrameHandler> m_wib2_frame_handler_second_half = std::make_unique<WIB2FrameHandler>(selection_of_register_second_half, m_dest_queue);
+  // (look at ProtoWIB SWTPG implementation). The buffers
+  // are carved out of one slab, sized at conf from the
+  // window and num_output_buffers, and each frame handler
+  // gets an equal share
+  WIB2HitBufferPool m_dest_pool;
+
+
+  // Kernels for the instruction set selected at conf, the fused kernel
+  // of the configured algorithm and how to make its channel state, and
+  // the frame handlers (one postprocess thread each) the 16 registers of
+  // the frame are split into
+  const swtpg_wib2::TPGKernels* m_tpg_kernels = nullptr;
+  swtpg_wib2::make_info_fn_t m_tpg_make_processing_info = nullptr;
+  swtpg_wib2::fused_process_fn_t m_tpg_process_window = nullptr;
+  std::vector<std::unique_ptr<WIB2FrameHandler>> m_wib2_frame_handlers;
   
 
   std::thread m_add_hits_tphandler_thread;
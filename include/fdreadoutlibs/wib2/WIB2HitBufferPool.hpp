@@ -0,0 +1,108 @@
+/**
+ * @file WIB2HitBufferPool.hpp Output buffers of the WIB2 software TPG
+ * kernels, carved out of a single slab
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#ifndef FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_WIB2HITBUFFERPOOL_HPP_
+#define FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_WIB2HITBUFFERPOOL_HPP_
+
+#include "ers/Issue.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace dunedaq {
+
+ERS_DECLARE_ISSUE(fdreadoutlibs,
+                  HitBufferAllocationFailed,
+                  "Failed to allocate " << num_buffers << " software TPG output buffers (" << num_bytes
+                  << " bytes): " << error,
+                  ((size_t)num_buffers)((size_t)num_bytes)((std::string)error))
+
+namespace fdreadoutlibs {
+
+// A fixed number of equally sized buffers for the hits that the kernels
+// find in a window, in one anonymous mapping instead of one allocation
+// each. Each buffer starts on a page of its own (a huge page with huge
+// pages), and nothing here touches them: the kernel places the pages of
+// a buffer on the NUMA node of the thread that writes it first, which is
+// the pinned thread of its frame handler. With huge pages the mapping is
+// first tried on explicit huge pages (MAP_HUGETLB), then on transparent
+// ones (MADV_HUGEPAGE), which the kernel may or may not honour
+class WIB2HitBufferPool
+{
+public:
+  static constexpr size_t s_huge_page_size = 2 * 1024 * 1024;
+
+  WIB2HitBufferPool() = default;
+  WIB2HitBufferPool(const WIB2HitBufferPool&) = delete;
+  WIB2HitBufferPool& operator=(const WIB2HitBufferPool&) = delete;
+  ~WIB2HitBufferPool() { release(); }
+
+  // Map num_buffers buffers of at least buffer_size uint16_t each,
+  // replacing the previous ones
+  void allocate(size_t num_buffers, size_t buffer_size, bool use_huge_pages)
+  {
+    release();
+
+    const size_t page_size = use_huge_pages ? s_huge_page_size : static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t buffer_bytes = (buffer_size * sizeof(uint16_t) + page_size - 1) / page_size * page_size; // NOLINT(build/unsigned)
+    const size_t bytes = num_buffers * buffer_bytes;
+    void* slab = MAP_FAILED;
+    m_on_huge_pages = false;
+    if (use_huge_pages) {
+      slab = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      m_on_huge_pages = (slab != MAP_FAILED);
+    }
+    if (slab == MAP_FAILED) {
+      slab = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (slab == MAP_FAILED) {
+        throw HitBufferAllocationFailed(ERS_HERE, num_buffers, bytes, std::strerror(errno));
+      }
+      if (use_huge_pages) {
+        madvise(slab, bytes, MADV_HUGEPAGE);
+      }
+    }
+
+    m_slab = static_cast<char*>(slab);
+    m_slab_bytes = bytes;
+    m_buffer_bytes = buffer_bytes;
+    m_num_buffers = num_buffers;
+  }
+
+  void release()
+  {
+    if (m_slab != nullptr) {
+      munmap(m_slab, m_slab_bytes);
+    }
+    m_slab = nullptr;
+    m_slab_bytes = 0;
+    m_num_buffers = 0;
+    m_on_huge_pages = false;
+  }
+
+  uint16_t* buffer(size_t i) const { return reinterpret_cast<uint16_t*>(m_slab + i * m_buffer_bytes); } // NOLINT
+
+  size_t size() const { return m_num_buffers; }
+  size_t get_num_bytes() const { return m_slab_bytes; }
+  bool on_huge_pages() const { return m_on_huge_pages; }
+
+private:
+  char* m_slab = nullptr;
+  size_t m_slab_bytes = 0;
+  size_t m_buffer_bytes = 0;
+  size_t m_num_buffers = 0;
+  bool m_on_huge_pages = false;
+};
+
+} // namespace fdreadoutlibs
+} // namespace dunedaq
+
+#endif // FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_WIB2HITBUFFERPOOL_HPP_
@@ -0,0 +1,106 @@
+/**
+ * @file WIB2LatencyHistogram.hpp Lock-free, log-bucketed histogram of
+ * the latencies of a stage of the WIB2 software TPG
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#ifndef FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_WIB2LATENCYHISTOGRAM_HPP_
+#define FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_WIB2LATENCYHISTOGRAM_HPP_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace dunedaq {
+namespace fdreadoutlibs {
+
+// Latencies in ns, in buckets of 4 per power of 2: each bucket is at
+// most 25% wide, whatever the latency, and the whole range of uint64_t
+// fits in 252 counters. Any number of threads can add to it, with one
+// relaxed atomic increment, while take() reads and empties it
+class WIB2LatencyHistogram
+{
+public:
+  static constexpr size_t s_num_buckets = 252;
+
+  struct Summary
+  {
+    uint64_t count = 0; // NOLINT(build/unsigned)
+    // Upper bounds of the buckets of the median and of the 99th
+    // percentile, and the largest latency, in ns
+    uint64_t p50 = 0; // NOLINT(build/unsigned)
+    uint64_t p99 = 0; // NOLINT(build/unsigned)
+    uint64_t max = 0; // NOLINT(build/unsigned)
+  };
+
+  void add(std::chrono::nanoseconds latency)
+  {
+    const uint64_t ns = latency.count() > 0 ? latency.count() : 0; // NOLINT(build/unsigned)
+    m_buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = m_max.load(std::memory_order_relaxed); // NOLINT(build/unsigned)
+    while (ns > max && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+  }
+
+  // The latencies added since the last call, which are then dropped
+  Summary take()
+  {
+    std::array<uint64_t, s_num_buckets> counts; // NOLINT(build/unsigned)
+    Summary summary;
+    for (size_t i = 0; i < s_num_buckets; ++i) {
+      counts[i] = m_buckets[i].exchange(0, std::memory_order_relaxed);
+      summary.count += counts[i];
+    }
+    summary.max = m_max.exchange(0, std::memory_order_relaxed);
+    if (summary.count == 0) {
+      return summary;
+    }
+
+    uint64_t below = 0; // NOLINT(build/unsigned)
+    for (size_t i = 0; i < s_num_buckets; ++i) {
+      below += counts[i];
+      if (summary.p50 == 0 && 2 * below >= summary.count) {
+        summary.p50 = upper_bound(i);
+      }
+      if (100 * below >= 99 * summary.count) {
+        summary.p99 = upper_bound(i);
+        break;
+      }
+    }
+    return summary;
+  }
+
+private:
+  // Latencies up to 3 ns get a bucket each. Above, the bucket is given
+  // by the position of the highest bit set and the two bits below it
+  static size_t bucket(uint64_t ns) // NOLINT(build/unsigned)
+  {
+    if (ns < 4) {
+      return ns;
+    }
+    const int exponent = 63 - __builtin_clzll(ns);
+    return ((exponent - 1) << 2) | ((ns >> (exponent - 2)) & 3);
+  }
+
+  // The largest latency of bucket i
+  static uint64_t upper_bound(size_t i) // NOLINT(build/unsigned)
+  {
+    if (i < 4) {
+      return i;
+    }
+    const int exponent = (i >> 2) + 1;
+    const uint64_t mantissa = 4 | (i & 3); // NOLINT(build/unsigned)
+    return ((mantissa + 1) << (exponent - 2)) - 1;
+  }
+
+  std::array<std::atomic<uint64_t>, s_num_buckets> m_buckets{}; // NOLINT(build/unsigned)
+  std::atomic<uint64_t> m_max{ 0 };                             // NOLINT(build/unsigned)
+};
+
+} // namespace fdreadoutlibs
+} // namespace dunedaq
+
+#endif // FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_WIB2LATENCYHISTOGRAM_HPP_
@@ -16,8 +16,13 @@
 #include "trigger/TPSet.hpp"
 #include "triggeralgs/TriggerPrimitive.hpp"
 #include "fdreadoutlibs/TriggerPrimitiveTypeAdapter.hpp"
+#include "fdreadoutlibs/wib2/WIB2LatencyHistogram.hpp"
 
-#include <queue>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -59,26 +64,85 @@ public:
   bool add_tp(triggeralgs::TriggerPrimitive trigprim, uint64_t currentTime) // NOLINT(build/unsigned)
   {
     if (trigprim.time_start + m_tp_timeout > currentTime) {
-      m_tp_buffer.push(trigprim);
+      // Keep the buffer sorted by start time. The search from the back
+      // is short for a TP among the latest ones, see add_tps otherwise
+      auto position = m_tp_buffer.end();
+      while (position != m_tp_buffer.begin() && std::prev(position)->time_start > trigprim.time_start) {
+        --position;
+      }
+      m_tp_buffer.insert(position, trigprim);
       return true;
     } else {
       return false;
     }
   }
 
+  // Sort a run of TPs for add_tps, by start time and then channel so
+  // that the order doesn't depend on how the TPs were found. Meant for
+  // the threads that find the TPs, to keep the sort off the thread of
+  // the handler
+  static void sort_tps(std::vector<triggeralgs::TriggerPrimitive>& tps)
+  {
+    std::sort(tps.begin(), tps.end(), [](const triggeralgs::TriggerPrimitive& a, const triggeralgs::TriggerPrimitive& b) {
+      return std::tie(a.time_start, a.channel) < std::tie(b.time_start, b.channel);
+    });
+  }
+
+  // Add the TPs of [first, last), sorted by start time, dropping those
+  // older than the timeout like add_tp. The run is merged into the
+  // buffer from the first TP it overlaps, so a window costs about its
+  // own size plus the TPs of the buffer it interleaves with. Returns
+  // the number of TPs dropped
+  template<typename Iterator>
+  size_t add_tps(Iterator first, Iterator last, uint64_t currentTime) // NOLINT(build/unsigned)
+  {
+    const size_t old_size = m_tp_buffer.size();
+    size_t dropped = 0;
+    for (; first != last; ++first) {
+      if (first->time_start + m_tp_timeout > currentTime) {
+        m_tp_buffer.push_back(*first);
+      } else {
+        ++dropped;
+      }
+    }
+    const auto middle = m_tp_buffer.begin() + old_size;
+    if (middle != m_tp_buffer.end()) {
+      auto by_start = [](const triggeralgs::TriggerPrimitive& a, const triggeralgs::TriggerPrimitive& b) {
+        return a.time_start < b.time_start;
+      };
+      std::inplace_merge(std::upper_bound(m_tp_buffer.begin(), middle, *middle, by_start), middle, m_tp_buffer.end(), by_start);
+    }
+    return dropped;
+  }
+
+  // Note that the TPs of the window starting at timestamp reached the
+  // handler at arrival, to time how long they wait for their TPSet
+  void add_window_arrival(uint64_t timestamp, std::chrono::steady_clock::time_point arrival) // NOLINT(build/unsigned)
+  {
+    m_window_arrivals.emplace_back(timestamp, arrival);
+  }
+
   void try_sending_tpsets(uint64_t currentTime) // NOLINT(build/unsigned)
   {
-    if (!m_tp_buffer.empty() && m_tp_buffer.top().time_start + m_tpset_window_size + m_tp_timeout < currentTime) {
+    // Only keep the arrivals from the window of the oldest TP waiting on
+    if (m_tp_buffer.empty()) {
+      m_window_arrivals.clear();
+    }
+    while (m_window_arrivals.size() > 1 && m_window_arrivals[1].first <= m_tp_buffer.front().time_start) {
+      m_window_arrivals.pop_front();
+    }
+
+    if (!m_tp_buffer.empty() && m_tp_buffer.front().time_start + m_tpset_window_size + m_tp_timeout < currentTime) {
       trigger::TPSet tpset;
       tpset.run_number = m_run_number;
-      tpset.start_time = (m_tp_buffer.top().time_start / m_tpset_window_size) * m_tpset_window_size;
+      tpset.start_time = (m_tp_buffer.front().time_start / m_tpset_window_size) * m_tpset_window_size;
       tpset.end_time = tpset.start_time + m_tpset_window_size;
       tpset.seqno = m_next_tpset_seqno++; // NOLINT(runtime/increment_decrement)
       tpset.type = trigger::TPSet::Type::kPayload;
       tpset.origin = m_sourceid;
       
-      while (!m_tp_buffer.empty() && m_tp_buffer.top().time_start < tpset.end_time) {
-        triggeralgs::TriggerPrimitive tp = m_tp_buffer.top();
+      while (!m_tp_buffer.empty() && m_tp_buffer.front().time_start < tpset.end_time) {
+        triggeralgs::TriggerPrimitive tp = m_tp_buffer.front();
         types::TriggerPrimitiveTypeAdapter* tp_readout_type =
           reinterpret_cast<types::TriggerPrimitiveTypeAdapter*>(&tp); // NOLINT
         try {
@@ -89,7 +153,7 @@ public:
           ers::error(readoutlibs::CannotWriteToQueue(ERS_HERE, m_sourceid, "m_tp_sink"));
         }
         tpset.objects.emplace_back(std::move(tp));
-        m_tp_buffer.pop();
+        m_tp_buffer.pop_front();
       }
 
       if (tpset.start_time < m_timestamp_counter) {
@@ -100,6 +164,11 @@ public:
         m_tpset_sink.send(std::move(tpset), std::chrono::milliseconds(10));
         m_sent_tpsets++;
         m_timestamp_counter = tpset.start_time;        
+        // The oldest TP of the TPSet came with the oldest window still
+        // kept
+        if (!m_window_arrivals.empty()) {
+          m_tpset_latency.add(std::chrono::steady_clock::now() - m_window_arrivals.front().second);
+        }
       } catch (const dunedaq::iomanager::TimeoutExpired& excpt) {
         ers::error(readoutlibs::CannotWriteToQueue(ERS_HERE, m_sourceid, "m_tpset_sink"));
       }      
@@ -108,19 +177,23 @@ public:
 
   void reset()
   {
-    while (!m_tp_buffer.empty()) {
-      m_tp_buffer.pop();
-    }
+    m_tp_buffer.clear();
     m_next_tpset_seqno = 0;
     m_sent_tps = 0;
     m_sent_tpsets = 0;
     m_timestamp_counter = 0;
+    m_window_arrivals.clear();
+    m_tpset_latency.take();
   }
 
   size_t get_and_reset_num_sent_tps() { return m_sent_tps.exchange(0); }
 
   size_t get_and_reset_num_sent_tpsets() { return m_sent_tpsets.exchange(0); }
 
+  // The wall time from the arrival of the oldest TP of each TPSet to the
+  // TPSet being sent
+  WIB2LatencyHistogram& get_tpset_latency() { return m_tpset_latency; }
+
 private:
   iomanager::SenderConcept<types::TriggerPrimitiveTypeAdapter>& m_tp_sink;
   iomanager::SenderConcept<trigger::TPSet>& m_tpset_sink;
@@ -134,16 +207,13 @@ private:
   std::atomic<size_t> m_sent_tps{ 0 };    // NOLINT(build/unsigned)
   std::atomic<size_t> m_sent_tpsets{ 0 }; // NOLINT(build/unsigned)
 
-  class TPComparator
-  {
-  public:
-    bool operator()(triggeralgs::TriggerPrimitive& left, triggeralgs::TriggerPrimitive& right)
-    {
-      return left.time_start > right.time_start;
-    }
-  };
-  std::priority_queue<triggeralgs::TriggerPrimitive, std::vector<triggeralgs::TriggerPrimitive>, TPComparator>
-    m_tp_buffer;
+  // The TPs waiting to be sent, sorted by start time
+  std::deque<triggeralgs::TriggerPrimitive> m_tp_buffer;
+
+  // The timestamp and arrival time of the windows, in arrival order,
+  // from the one of the oldest TP in m_tp_buffer
+  std::deque<std::pair<uint64_t, std::chrono::steady_clock::time_point>> m_window_arrivals; // NOLINT(build/unsigned)
+  WIB2LatencyHistogram m_tpset_latency;
 };
 
 } // namespace fdreadoutlibs
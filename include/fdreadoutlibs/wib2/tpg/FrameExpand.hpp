@@ -36,15 +36,27 @@ public:
 
   // RegisterArray(RegisterArray&& other) = default;
 
-  // Get the value at the ith position as a 256-bit register
-  inline __m256i ymm(size_t i) const
+  // Get the value at the ith position as a 256-bit register. Built for
+  // AVX2 whatever the translation unit, like the kernels that use it
+  __attribute__((target("avx2"))) inline __m256i ymm(size_t i) const
   {
     return _mm256_lddqu_si256(reinterpret_cast<const __m256i*>(m_array) + i); // NOLINT
   }
-  inline void set_ymm(size_t i, __m256i val)
+  __attribute__((target("avx2"))) inline void set_ymm(size_t i, __m256i val)
   {
     _mm256_storeu_si256(reinterpret_cast<__m256i*>(m_array) + i, val); // NOLINT
   }
+
+  // Get the value at the ith position as a 512-bit register, for the
+  // AVX-512 kernels
+  __attribute__((target("avx512f"))) inline __m512i zmm(size_t i) const
+  {
+    return _mm512_loadu_si512(reinterpret_cast<const __m512i*>(m_array) + i); // NOLINT
+  }
+  __attribute__((target("avx512f"))) inline void set_zmm(size_t i, __m512i val)
+  {
+    _mm512_storeu_si512(reinterpret_cast<__m512i*>(m_array) + i, val); // NOLINT
+  }
   inline uint16_t uint16(size_t i) const { return m_array[i]; }        // NOLINT(build/unsigned)
   inline void set_uint16(size_t i, uint16_t val) { m_array[i] = val; } // NOLINT(build/unsigned)
 
@@ -58,14 +70,21 @@ public:
   inline size_t size() const { return N; }
 
 private:
-  alignas(32) uint16_t __restrict__ m_array[N * 16]; // NOLINT(build/unsigned)
+  alignas(64) uint16_t __restrict__ m_array[N * 16]; // NOLINT(build/unsigned)
 };
 
 typedef RegisterArray<swtpg_wib2::NUM_REGISTERS_PER_FRAME> FrameRegisters;
 
 typedef RegisterArray<swtpg_wib2::NUM_REGISTERS_PER_FRAME * swtpg_wib2::FRAMES_PER_MSG> MessageRegisters;
 
-
+// The rest of this file is built for AVX2, while the library itself is
+// built for the baseline instruction set: it must only run once
+// select_tpg_kernels has checked that the CPU supports AVX2 (see
+// KernelDispatch.hpp). Only the code between push_options and
+// pop_options is built for AVX2, so the inline functions of the headers
+// included above never get an AVX2 copy
+#pragma GCC push_options
+#pragma GCC target("avx2")
 
 //==============================================================================
 // Print a 256-bit register interpreting it as packed 8-bit values
@@ -85,131 +104,104 @@ print256_as16_dec(__m256i var);
 //==============================================================================
 inline __m256i unpack_one_register(const dunedaq::detdataformats::wib2::WIB2Frame::word_t* first_word)
 {
-    __m256i reg=_mm256_lddqu_si256((__m256i*)first_word);
-    // printf("Input:      ");
-    // print256(reg);
-    // printf("\n");
-
-    // The register initially contains 18-and-a-bit 14-bit ADCs, but
-    // we only have space for 16 after expansion, so the last 32-bit
-    // word is unused. Copy word 3 so it appears twice, and move the
-    // later words down one
-    __m256i idx=_mm256_set_epi32(6, 5, 4, 3, 3, 2, 1, 0);
-    __m256i shuf1=_mm256_permutevar8x32_epi32(reg, idx);
-    // printf("shuf1:      ");
-    // print256(shuf1);
-    // printf("\n");
-
-    // Each 32-bit word contains at least one full 14-bit ADC. Shift
-    // the words by variable amounts s.t. the high 16 bits of each
-    // word contains a 14-bit ADC at the right place (with the two
-    // high bits still needing to be masked to zero). That result is
-    // in `high_half`
-    // __mmask8 mask=0xffu;
-    // __m256i src=_mm256_set1_epi32(0);
-    // The amounts by which we shift each 32-bit word
-    __m256i count1=_mm256_set_epi32(12, 8, 4, 0, 14, 10, 6, 2);
-    // __m256i high_half=_mm256_mask_sllv_epi32(src, mask, shuf1, count1);
-    __m256i high_half=_mm256_sllv_epi32(shuf1, count1);
-    // Mask out the low 16 bits, and the high two bits in the high half
-    __m256i high_half_mask=_mm256_set1_epi32(0x3fff0000u);
-
-    high_half=_mm256_and_si256(high_half, high_half_mask);
-    // high_half2=_mm256_and_si256(high_half2, high_half_mask);
-
-    // printf("high_half:  ");
-    // print256(high_half);
-    // printf("\n");
-
-    //------------------------------------------------------------------
-    // Now we start the process of setting the low 16 bits of each
-    // word to the right value. This is trickier because now the bits
-    // are spread across two words. First, left-shift each word so
-    // that the higher bits of the ADC are in the right place
-    __m256i count2=_mm256_set_epi32(10, 6, 2, 0, 12, 8, 4, 0);
-    __m256i shift2=_mm256_sllv_epi32(shuf1, count2);
-    // printf("shift2:     ");
-    // print256(shift2);
-    // printf("\n");
-
-    // Next, permute the register so that the words containing the low
-    // bits of the ADCs we want are in the same positions as the words
-    // containing the corresponding high bits. This just amounts to
-    // moving the words down by one
-    __m256i idx2=_mm256_set_epi32(5, 4, 3, 2, 2, 1, 0, 0);
-    __m256i shuf2=_mm256_permutevar8x32_epi32(reg, idx2);
-    // printf("shuf2:      ");
-    // print256(shuf2);
-    // printf("\n");
-
-    // Shift each word right by the amount that brings those low bits
-    // into the right place, putting the result in `shift3`
-    __m256i count3=_mm256_set_epi32(22, 26, 30, 0, 20, 24, 28, 0);
-    __m256i shift3=_mm256_srlv_epi32(shuf2, count3);
-    // printf("shift3:     ");
-    // print256(shift3);
-    // printf("\n");
-
-    // OR together the registers containing the high and low bits of
-    // the ADCs. At this point, the low 16 bits of each word should
-    // contain the 14 bits of the ADCs in the right place (with the
-    // two high bits still needing to be masked out)
-    __m256i low_half=_mm256_or_si256(shift2, shift3);
-    // Mask out the high 16 bits, and the high two bits in the high half
-    __m256i low_half_mask=_mm256_set1_epi32(0x3fffu);
-    low_half=_mm256_and_si256(low_half, low_half_mask);
-    // printf("low_half:   ");
-    // print256(low_half);
-    // printf("\n");
-
-    // Nearly there... Now we OR together the low and high halves
-    __m256i both=_mm256_or_si256(low_half, high_half);
-    // zero out the slot where we want to put the 16th value
-    both=_mm256_andnot_si256(_mm256_set_epi32(0, 0, 0, 0xffffu, 0, 0, 0, 0), both);
-    // printf("both:       ");
-    // print256(both);
-    // printf("\n");
-
-    // We just missed the 16th value, and the lw 16 bits of the 8th
-    // word are available, so shuffle it around to put it there
-    __m256i shift4=_mm256_srli_epi32(reg, 18);
-    // Mask so that's the only nonzero thing
-    shift4=_mm256_and_si256(_mm256_set_epi32(0, 0x3fffu, 0, 0, 0, 0, 0, 0), shift4);
-    // Move the word containing the value we want into the position we want
-    __m256i idx3=_mm256_set_epi32(0, 0, 0, 6, 0, 0, 0, 0);
-    __m256i shuf3=_mm256_permutevar8x32_epi32(shift4, idx3);
-
-    both=_mm256_or_si256(both, shuf3);
-    // printf("both':      ");
-    // print256(both);
-    // printf("\n");
-
-    return both;
+    // The 16 14-bit ADCs of the register take 28 bytes. Load the 14
+    // bytes holding ADCs 0-7 in the low 128-bit lane, and the 14 bytes
+    // holding ADCs 8-15 in the high one, so that everything below can
+    // work within lanes
+    const char* first_byte = reinterpret_cast<const char*>(first_word); // NOLINT
+    __m256i reg = _mm256_loadu2_m128i(reinterpret_cast<const __m128i*>(first_byte + 14), // NOLINT
+                                      reinterpret_cast<const __m128i*>(first_byte));     // NOLINT
+
+    // The ADC in each 16-bit slot starts at bit s of byte b of its
+    // lane, with s one of 0, 6, 4, 2, and spans 3 bytes at most. The
+    // slots are in the order of the original AVX2 unpacking, where the
+    // 16th ADC ends up in slot 8: {0, ..., 7, 15, 8, ..., 14}
+    //
+    // Put byte b in the high byte of each slot, and the two bytes after
+    // it in a second register. Multiplying by 2^(8-s) then shifts them
+    // into place: the high half of the product brings the top 8-s bits
+    // of byte b down to bit 0, and the low half the next two bytes up
+    // to bit 8-s
+    const __m256i low_bytes = _mm256_setr_epi8(-1, 0,  -1, 1, -1, 3, -1, 5, -1, 7,  -1, 8, -1, 10, -1, 12,
+                                               -1, 12, -1, 0, -1, 1, -1, 3, -1, 5, -1, 7, -1, 8,  -1, 10);
+    const __m256i high_bytes = _mm256_setr_epi8(1,  2,  2, 3, 4, 5, 6, 7, 8, 9, 9, 10, 11, 12, 13, 14,
+                                                13, 14, 1, 2, 2, 3, 4, 5, 6, 7, 8, 9,  9,  10, 11, 12);
+    const __m256i shift = _mm256_setr_epi16(256, 4, 16, 64, 256, 4, 16, 64, 64, 256, 4, 16, 64, 256, 4, 16);
+
+    __m256i low = _mm256_mulhi_epu16(_mm256_shuffle_epi8(reg, low_bytes), shift);
+    __m256i high = _mm256_mullo_epi16(_mm256_shuffle_epi8(reg, high_bytes), shift);
+
+    // OR the two parts together and mask out the bits of the next ADC
+    return _mm256_and_si256(_mm256_or_si256(low, high), _mm256_set1_epi16(0x3fff));
 }
 
 
 
 
-// Expand 14-bit ADCs to 16-bits using the WIB2 format
+// Expand 14-bit ADCs to 16-bits using the WIB2 format. Only the
+// registers in [first_register, last_register) are expanded, and they
+// are stored at their absolute position in the register array, so
+// that frame handlers working on different parts of the frame agree
+// on the register numbering
 inline void
 expand_wib2_adcs(const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* __restrict__ ucs,
-                            swtpg_wib2::MessageRegisters* __restrict__ register_array, 
-                            int registers_selection
-                            )
+                 swtpg_wib2::MessageRegisters* __restrict__ register_array,
+                 size_t first_register,
+                 size_t last_register)
 {
   for (size_t iframe = 0; iframe < swtpg_wib2::FRAMES_PER_MSG; ++iframe) {
     const dunedaq::detdataformats::wib2::WIB2Frame* frame =
       reinterpret_cast<const dunedaq::detdataformats::wib2::WIB2Frame*>(ucs) + iframe; // NOLINT
 
-    for (size_t iblock = 0; iblock < swtpg_wib2::NUM_REGISTERS_PER_FRAME ; ++iblock) {
-      register_array->set_ymm(iframe + iblock * swtpg_wib2::FRAMES_PER_MSG, swtpg_wib2::unpack_one_register(frame->adc_words+7*(iblock+registers_selection*swtpg_wib2::NUM_REGISTERS_PER_FRAME)));
+    for (size_t iblock = first_register; iblock < last_register; ++iblock) {
+      register_array->set_ymm(iframe + iblock * swtpg_wib2::FRAMES_PER_MSG,
+                              swtpg_wib2::unpack_one_register(frame->adc_words + 7 * iblock));
     }
-    
-
   }
 }
 
+// The samples of register ireg at time itime of the window, from a
+// register array filled by expand_wib2_adcs
+template<size_t NREGISTERS>
+inline __m256i
+expanded_sample_avx2(const RegisterArray<NREGISTERS * FRAMES_PER_MSG>* __restrict__ input, size_t ireg, size_t itime)
+{
+  const size_t msg_index = itime / FRAMES_PER_MSG;
+  const size_t msg_time_offset = itime % FRAMES_PER_MSG;
+  return input->ymm(msg_index * NREGISTERS * FRAMES_PER_MSG + FRAMES_PER_MSG * ireg + msg_time_offset);
+}
+
+// The same samples, unpacked straight from the frames for the fused
+// kernels. The window is num_frames ticks of consecutive superchunks
+// starting at ucs. When the kernel starts on a register, all the ticks
+// of the register are unpacked at once into a block that stays in L1
+// (unpacking one tick at a time inside the hit finding loop runs out of
+// registers)
+class FrameSamplesAVX2
+{
+public:
+  FrameSamplesAVX2(const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs, size_t num_frames)
+    : m_frames(reinterpret_cast<const dunedaq::detdataformats::wib2::WIB2Frame*>(ucs)) // NOLINT
+    , m_num_frames(num_frames)
+  {}
+
+  inline __m256i operator()(size_t ireg, size_t itime)
+  {
+    if (itime == 0) {
+      for (size_t iframe = 0; iframe < m_num_frames; ++iframe) {
+        m_block[iframe] = unpack_one_register(m_frames[iframe].adc_words + 7 * ireg);
+      }
+    }
+    return m_block[itime];
+  }
+
+private:
+  const dunedaq::detdataformats::wib2::WIB2Frame* __restrict__ m_frames;
+  size_t m_num_frames;
+  __m256i m_block[FRAMES_PER_MSG * MAX_SUPERCHUNKS_PER_WINDOW];
+};
 
+#pragma GCC pop_options
 
 } // namespace swtpg_wib2
 
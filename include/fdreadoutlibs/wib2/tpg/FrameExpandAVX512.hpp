@@ -0,0 +1,145 @@
+/**
+ * @file FrameExpandAVX512.hpp WIB2 specific frame expansion using AVX-512
+ * registers. Each 512-bit register holds 32 channels, ie two adjacent
+ * AVX2 registers worth of channels
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#ifndef FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_TPG_FRAMEEXPANDAVX512_HPP_
+#define FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_TPG_FRAMEEXPANDAVX512_HPP_
+
+#include "FrameExpand.hpp"
+#include "TPGConstants_wib2.hpp"
+
+#include <immintrin.h>
+
+// Built for AVX-512, see FrameExpand.hpp
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+// Silenced as in UtilsAVX512.hpp
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+namespace swtpg_wib2 {
+
+//==============================================================================
+// Same algorithm as unpack_one_register, but working on the 14 words
+// (32 ADCs) starting at first_word at once. The low 256 bits of the
+// result are identical to unpack_one_register(first_word) and the high
+// 256 bits to unpack_one_register(first_word+7)
+inline __m512i
+unpack_one_register_avx512(const dunedaq::detdataformats::wib2::WIB2Frame::word_t* first_word)
+{
+  // Only load the 14 words we need, so we never read past the ADC words of the frame
+  __m512i reg = _mm512_maskz_loadu_epi32(0x3fff, first_word);
+
+  // Each half of the register is handled as in the AVX2 version:
+  // copy word 3 (10 in the high half) so it appears twice, and move
+  // the later words down one
+  __m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6, 7, 8, 9, 10, 10, 11, 12, 13);
+  __m512i shuf1 = _mm512_permutexvar_epi32(idx, reg);
+
+  // Shift the words s.t. the high 16 bits of each word contains a
+  // 14-bit ADC at the right place
+  __m512i count1 = _mm512_setr_epi32(2, 6, 10, 14, 0, 4, 8, 12, 2, 6, 10, 14, 0, 4, 8, 12);
+  __m512i high_half = _mm512_sllv_epi32(shuf1, count1);
+  high_half = _mm512_and_si512(high_half, _mm512_set1_epi32(0x3fff0000u));
+
+  //------------------------------------------------------------------
+  // Low 16 bits of each word: left-shift the words holding the high
+  // bits of the ADC...
+  __m512i count2 = _mm512_setr_epi32(0, 4, 8, 12, 0, 2, 6, 10, 0, 4, 8, 12, 0, 2, 6, 10);
+  __m512i shift2 = _mm512_sllv_epi32(shuf1, count2);
+
+  // ...and bring the words holding the low bits into the same position
+  __m512i idx2 = _mm512_setr_epi32(0, 0, 1, 2, 2, 3, 4, 5, 7, 7, 8, 9, 9, 10, 11, 12);
+  __m512i shuf2 = _mm512_permutexvar_epi32(idx2, reg);
+
+  __m512i count3 = _mm512_setr_epi32(0, 28, 24, 20, 0, 30, 26, 22, 0, 28, 24, 20, 0, 30, 26, 22);
+  __m512i shift3 = _mm512_srlv_epi32(shuf2, count3);
+
+  __m512i low_half = _mm512_or_si512(shift2, shift3);
+  low_half = _mm512_and_si512(low_half, _mm512_set1_epi32(0x3fffu));
+
+  __m512i both = _mm512_or_si512(low_half, high_half);
+  // zero out the slots where we want to put the 16th value of each half
+  both = _mm512_andnot_si512(_mm512_setr_epi32(0, 0, 0, 0, 0xffffu, 0, 0, 0, 0, 0, 0, 0, 0xffffu, 0, 0, 0), both);
+
+  // The 16th value of each half is in the low bits of word 6 (13)
+  __m512i shift4 = _mm512_srli_epi32(reg, 18);
+  shift4 = _mm512_and_si512(_mm512_setr_epi32(0, 0, 0, 0, 0, 0, 0x3fffu, 0, 0, 0, 0, 0, 0, 0x3fffu, 0, 0), shift4);
+  __m512i idx3 = _mm512_setr_epi32(0, 0, 0, 0, 6, 0, 0, 0, 0, 0, 0, 0, 13, 0, 0, 0);
+  __m512i shuf3 = _mm512_permutexvar_epi32(idx3, shift4);
+
+  return _mm512_or_si512(both, shuf3);
+}
+
+// Expand 14-bit ADCs to 16-bits using the WIB2 format, two AVX2
+// registers at a time. first_register and last_register are in units
+// of AVX2 registers and must be even. The output layout is the
+// AVX-512 analogue of expand_wib2_adcs: the 12 time samples of each
+// 512-bit register are adjacent in memory
+inline void
+expand_wib2_adcs_avx512(const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* __restrict__ ucs,
+                        swtpg_wib2::MessageRegisters* __restrict__ register_array,
+                        size_t first_register,
+                        size_t last_register)
+{
+  for (size_t iframe = 0; iframe < swtpg_wib2::FRAMES_PER_MSG; ++iframe) {
+    const dunedaq::detdataformats::wib2::WIB2Frame* frame =
+      reinterpret_cast<const dunedaq::detdataformats::wib2::WIB2Frame*>(ucs) + iframe; // NOLINT
+
+    for (size_t iblock = first_register; iblock < last_register; iblock += 2) {
+      register_array->set_zmm(iframe + (iblock / 2) * swtpg_wib2::FRAMES_PER_MSG,
+                              swtpg_wib2::unpack_one_register_avx512(frame->adc_words + 7 * iblock));
+    }
+  }
+}
+
+// The samples of the 512-bit register starting at AVX2 register ireg
+// at time itime of the window, from a register array filled by
+// expand_wib2_adcs_avx512
+template<size_t NREGISTERS>
+inline __m512i
+expanded_sample_avx512(const RegisterArray<NREGISTERS * FRAMES_PER_MSG>* __restrict__ input, size_t ireg, size_t itime)
+{
+  const size_t msg_index = itime / FRAMES_PER_MSG;
+  const size_t msg_time_offset = itime % FRAMES_PER_MSG;
+  return input->zmm(msg_index * (NREGISTERS / 2) * FRAMES_PER_MSG + FRAMES_PER_MSG * (ireg / 2) + msg_time_offset);
+}
+
+// The same samples, unpacked straight from the frames of the window
+// for the fused kernels, as in FrameSamplesAVX2
+class FrameSamplesAVX512
+{
+public:
+  FrameSamplesAVX512(const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs, size_t num_frames)
+    : m_frames(reinterpret_cast<const dunedaq::detdataformats::wib2::WIB2Frame*>(ucs)) // NOLINT
+    , m_num_frames(num_frames)
+  {}
+
+  inline __m512i operator()(size_t ireg, size_t itime)
+  {
+    if (itime == 0) {
+      for (size_t iframe = 0; iframe < m_num_frames; ++iframe) {
+        m_block[iframe] = unpack_one_register_avx512(m_frames[iframe].adc_words + 7 * ireg);
+      }
+    }
+    return m_block[itime];
+  }
+
+private:
+  const dunedaq::detdataformats::wib2::WIB2Frame* __restrict__ m_frames;
+  size_t m_num_frames;
+  __m512i m_block[FRAMES_PER_MSG * MAX_SUPERCHUNKS_PER_WINDOW];
+};
+
+} // namespace swtpg_wib2
+
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+
+#endif // FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_TPG_FRAMEEXPANDAVX512_HPP_
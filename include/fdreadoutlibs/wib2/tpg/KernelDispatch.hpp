@@ -0,0 +1,141 @@
+/**
+ * @file KernelDispatch.hpp Runtime selection of the WIB2 software TPG kernels
+ *
+ * The frame expansion and hit finding kernels are built once per
+ * instruction set, each in its own translation unit (KernelsScalar.cpp,
+ * KernelsAVX2.cpp, KernelsAVX512.cpp). The translation units are built
+ * for the baseline x86-64 instruction set like the rest of the library,
+ * and only the kernel headers and wrappers are built for AVX2 or
+ * AVX-512, between #pragma GCC push_options and pop_options: an inline
+ * function of a header that the whole library includes never gets a
+ * copy built for an instruction set the CPU may not have. The library
+ * calls the kernels through a table of function pointers, picked at
+ * conf() time from what the CPU supports
+ *
+ * Each table lists the hit finding algorithms by name. An algorithm is a
+ * kernel template in its own header, plus a kernel struct giving its name
+ * and the RegisterState its channel state is kept in (e.g.
+ * SWTPGKernelAVX2 in ProcessAVX2.hpp). Listing the struct in the
+ * algorithms of a Kernels*.cpp instantiates its two-pass and fused
+ * versions for that instruction set
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#ifndef FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_TPG_KERNELDISPATCH_HPP_
+#define FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_TPG_KERNELDISPATCH_HPP_
+
+#include "FrameExpand.hpp"
+#include "ProcessingInfo.hpp"
+#include "TPGConstants_wib2.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace swtpg_wib2 {
+
+enum class KernelISA
+{
+  kScalar,
+  kAVX2,
+  kAVX512
+};
+
+// Expand the registers [first_register, last_register) of the superchunk
+// into the layout the process functions of the same table expect
+typedef void (*expand_fn_t)(const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs,
+                            MessageRegisters* register_array,
+                            size_t first_register,
+                            size_t last_register);
+
+// Make the ProcessingInfo of an algorithm for the registers
+// [first_register, last_register), with the channel state its kernels
+// keep. The other parameters are set before each window
+typedef std::unique_ptr<ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>> (*make_info_fn_t)(
+  uint8_t first_register, // NOLINT(build/unsigned)
+  uint8_t last_register,  // NOLINT(build/unsigned)
+  const int16_t* taps,
+  int16_t ntaps,
+  uint8_t tap_exponent, // NOLINT(build/unsigned)
+  uint16_t threshold);  // NOLINT(build/unsigned)
+
+// The process functions below take a ProcessingInfo made by the
+// make_processing_info of the same algorithm
+
+// info.input holds a single superchunk, so info.timeWindowNumFrames
+// must be FRAMES_PER_MSG
+typedef void (*process_fn_t)(ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>& info);
+
+// Unpack the ADCs and find the hits in one pass, without going through
+// a MessageRegisters. info.input is not used. ucs points to an array of
+// info.timeWindowNumFrames / FRAMES_PER_MSG consecutive superchunks, at
+// most MAX_SUPERCHUNKS_PER_WINDOW. The end times of the hits count from
+// the first frame of the first superchunk
+typedef void (*fused_process_fn_t)(ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>& info,
+                                   const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs);
+
+// The two-pass and fused versions of one hit finding algorithm
+struct TPGAlgorithm
+{
+  const char* name;
+  make_info_fn_t make_processing_info;
+  process_fn_t process_window;
+  fused_process_fn_t process_window_fused;
+};
+
+struct TPGKernels
+{
+  KernelISA isa;
+  // Number of 16-channel registers the kernels handle at once. The
+  // register ranges given to the kernels must be multiples of it
+  size_t register_granularity;
+  // For the two-pass kernels: expand, then process the expanded registers
+  expand_fn_t expand;
+  // The hit finding algorithms. The fused kernels give the same hits as
+  // the two-pass ones
+  const TPGAlgorithm* algorithms;
+  size_t num_algorithms;
+
+  // nullptr if there is no algorithm called name
+  const TPGAlgorithm* find_algorithm(const std::string& name) const;
+};
+
+// The make_processing_info of the algorithms whose kernels keep their
+// state in a RegisterState. Instantiated in KernelDispatch.cpp for each
+// of the RegisterStates of ProcessingInfo.hpp: the ProcessingInfo is
+// used outside of the kernels, so it must not be compiled for the
+// instruction set of a Kernels*.cpp
+template<typename RegisterState>
+std::unique_ptr<ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>>
+make_processing_info(uint8_t first_register, // NOLINT(build/unsigned)
+                     uint8_t last_register,  // NOLINT(build/unsigned)
+                     const int16_t* taps,
+                     int16_t ntaps,
+                     uint8_t tap_exponent, // NOLINT(build/unsigned)
+                     uint16_t threshold);  // NOLINT(build/unsigned)
+
+// The kernels for each instruction set. The AVX-512 ones are nullptr if
+// the library was built without them
+const TPGKernels& get_scalar_kernels();
+const TPGKernels* get_avx2_kernels();
+const TPGKernels* get_avx512_kernels();
+
+// The fastest kernels that were built and that the CPU we're running on
+// supports, according to CPUID
+const TPGKernels& select_tpg_kernels();
+
+const char* kernel_isa_name(KernelISA isa);
+
+// Expand into the AVX2 register layout without any vector instructions.
+// For the code that depends on that layout (ProcessingInfo::setState,
+// the register to channel map) whichever kernels are in use
+void expand_wib2_adcs_scalar(const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs,
+                             MessageRegisters* register_array,
+                             size_t first_register,
+                             size_t last_register);
+
+} // namespace swtpg_wib2
+
+#endif // FDREADOUTLIBS_INCLUDE_FDREADOUTLIBS_WIB2_TPG_KERNELDISPATCH_HPP_
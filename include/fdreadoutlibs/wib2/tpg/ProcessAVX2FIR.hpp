@@ -1,5 +1,7 @@
 /**
- * @file ProcessAVX2.hpp Process frames with AVX2 registers and instructions
+ * @file ProcessAVX2FIR.hpp Process frames with AVX2 registers and
+ * instructions using a FIR filter, with the threshold in units of the
+ * inter-quartile range of each channel ("FIR" algorithm)
  * @author Philip Rodrigues (rodriges@fnal.gov)
  *
  * This is part of the DUNE DAQ , copyright 2020.
@@ -15,33 +17,37 @@
 #include "TPGConstants_wib2.hpp"
 
 #include <immintrin.h>
+#include <utility>
 
-namespace swtpg_wib2 {
+// Built for AVX2, see FrameExpand.hpp
+#pragma GCC push_options
+#pragma GCC target("avx2")
 
+namespace swtpg_wib2 {
 
-template<size_t NREGISTERS>
+// See process_window_avx2 for the sample sources. The filter taps are
+// info.taps, as made by firwin_int with info.multiplier. The filter
+// history of each register is kept in the prev_samp of its state, NTAPS
+// AVX2 registers per register, and info.absTimeModNTAPS says which of
+// them holds the oldest sample
+template<size_t NREGISTERS, typename SampleSource>
 inline void
-process_window_avx2(ProcessingInfo<NREGISTERS>& info)
+process_window_fir_avx2(ProcessingInfo<NREGISTERS, FIRRegisterState>& info, SampleSource&& get_sample)
 {
   // Start with taps as floats that add to 1. Multiply by some
   // power of two (2**N) and round to int. Before filtering, cap the
   // value of the input to INT16_MAX/(2**N)
-  const size_t NTAPS = 8;
-  // int16_t taps[NTAPS] = {0};
-  // for (size_t i = 0; i < std::min(NTAPS, info.tapsv.size()); ++i) {
-  //  taps[i] = info.tapsv[i];
-  //}
+  const size_t NTAPS = FIRState::NTAPS;
 
   const __m256i adcMax = _mm256_set1_epi16(info.adcMax);
-  // The maximum value that sigma can have before the threshold overflows a 16-bit signed integer
-  const __m256i sigmaMax = _mm256_set1_epi16((1 << 15) / (info.multiplier * 5));
+  const __m256i multiplier = _mm256_set1_epi16(info.multiplier);
 
   __m256i tap_256[NTAPS];
   for (size_t i = 0; i < NTAPS; ++i) {
-    tap_256[i] = _mm256_set1_epi16(info.taps[i]);
+    tap_256[i] = _mm256_set1_epi16(i < size_t(info.ntaps) ? info.taps[i] : 0);
   }
   // Pointer to keep track of where we'll write the next output hit
-  __m256i* output_loc = (__m256i*)(info.output); // NOLINT(readability/casting)
+  uint16_t* output_loc = info.output; // NOLINT(build/unsigned)
 
   const __m256i iota = _mm256_set_epi16(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
 
@@ -57,16 +63,16 @@ process_window_avx2(ProcessingInfo<NREGISTERS>& info)
     // The current estimate of the pedestal in each channel: get
     // from the previous go-around.
 
-    ChanState<NREGISTERS>& state = info.chanState;
-    __m256i median = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.pedestals) + ireg);      // NOLINT
-    __m256i quantile25 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.quantile25) + ireg); // NOLINT
-    __m256i quantile75 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.quantile75) + ireg); // NOLINT
+    FIRRegisterState& state = info.chanState[ireg];
+    __m256i median = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.pedestals));      // NOLINT
+    __m256i quantile25 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.quantile25)); // NOLINT
+    __m256i quantile75 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.quantile75)); // NOLINT
 
     // The accumulator that we increase/decrease when the current
     // sample is greater/less than the median
-    __m256i accum = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum) + ireg);     // NOLINT
-    __m256i accum25 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum25) + ireg); // NOLINT
-    __m256i accum75 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum75) + ireg); // NOLINT
+    __m256i accum = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum));     // NOLINT
+    __m256i accum25 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum25)); // NOLINT
+    __m256i accum75 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum75)); // NOLINT
 
     // ------------------------------------
     // Variables for filtering
@@ -74,34 +80,39 @@ process_window_avx2(ProcessingInfo<NREGISTERS>& info)
     // The (unfiltered) samples `n` places before the current one
     __m256i prev_samp[NTAPS];
     for (size_t j = 0; j < NTAPS; ++j) {
-      prev_samp[j] = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.prev_samp) + NTAPS * ireg + j); // NOLINT
+      prev_samp[j] = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.prev_samp) + j); // NOLINT
     }
 
     // ------------------------------------
     // Variables for hit finding
 
     // Was the previous step over threshold?
-    __m256i prev_was_over = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.prev_was_over) + ireg); // NOLINT
-    ;
+    __m256i prev_was_over = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.prev_was_over)); // NOLINT
     // The integrated charge (so far) of the current hit
-    __m256i hit_charge = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_charge) + ireg); // NOLINT
-    ;
+    __m256i hit_charge = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_charge)); // NOLINT
     // The time-over-threshold (so far) of the current hit
-    __m256i hit_tover = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_tover) + ireg); // NOLINT
-    ;
-
-    // The channel numbers in each of the slots in the register
+    __m256i hit_tover = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_tover)); // NOLINT
+    // The peak charge (so far) of the current hit, and when it came
+    __m256i hit_peak_adc = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_peak_adc));   // NOLINT
+    __m256i hit_peak_time = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_peak_time)); // NOLINT
+    // The threshold of each channel, in units of sigma scaled like the
+    // filter output, and the maximum value that sigma can have before
+    // the threshold overflows a 16-bit signed integer
+    const __m256i threshold =
+      _mm256_mullo_epi16(_mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.threshold)), multiplier); // NOLINT
+    const __m256i sigmaMax = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.sigma_max));        // NOLINT
+    // The channels that aren't masked
+    const __m256i active = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.active)); // NOLINT
+
+    // The channel numbers in each of the slots in the register. Register
+    // numbers are absolute within the frame, so these are too
     __m256i channel_base = _mm256_set1_epi16(ireg * SAMPLES_PER_REGISTER);
     __m256i channels = _mm256_add_epi16(channel_base, iota);
 
     for (size_t itime = 0; itime < info.timeWindowNumFrames; ++itime) {
-      const size_t msg_index = itime / 12;
-      const size_t msg_time_offset = itime % 12;
-      const size_t index = msg_index * NREGISTERS * FRAMES_PER_MSG + FRAMES_PER_MSG * ireg + msg_time_offset;
-      // const __m256i* rawp=reinterpret_cast<const __m256i*>(info.input)+index; // NOLINT
 
       // The current sample
-      __m256i s = info.input->ymm(index);
+      __m256i s = get_sample(ireg, itime);
 
       // First, find which channels are above/below the median,
       // since we need these as masks in the call to
@@ -130,10 +141,9 @@ process_window_avx2(ProcessingInfo<NREGISTERS>& info)
       // Find the interquartile range
       __m256i sigma = _mm256_sub_epi16(quantile75, quantile25);
       // Clamp sigma to a range where it won't overflow when
-      // multiplied by info.multiplier*5
+      // multiplied by the threshold of the channel
       sigma = _mm256_min_epi16(sigma, sigmaMax);
 
-      // __m256i sigma = _mm256_set1_epi16(2000); // 20 ADC
       // --------------------------------------------------------------
       // Filtering
       // --------------------------------------------------------------
@@ -164,55 +174,31 @@ process_window_avx2(ProcessingInfo<NREGISTERS>& info)
       __m256i filt3 = _mm256_setzero_si256();
 
       // % would be slow, but we're making sure that NTAPS is a power of two so the optimizer ought to save us
-      //#define ADDTAP0(x)
-      //  filt0 = _mm256_add_epi16(filt0, _mm256_mullo_epi16(tap_256[x], prev_samp[(x + absTimeModNTAPS) % NTAPS]));
-      //#define ADDTAP1(x)
-      //  filt1 = _mm256_add_epi16(filt1, _mm256_mullo_epi16(tap_256[x], prev_samp[(x + absTimeModNTAPS) % NTAPS]));
-      //#define ADDTAP2(x)
-      //  filt2 = _mm256_add_epi16(filt2, _mm256_mullo_epi16(tap_256[x], prev_samp[(x + absTimeModNTAPS) % NTAPS]));
-      //#define ADDTAP3(x)
-      //  filt3 = _mm256_add_epi16(filt3, _mm256_mullo_epi16(tap_256[x], prev_samp[(x + absTimeModNTAPS) % NTAPS]));
-
-      // ADDTAP0(0);
       filt0 = _mm256_add_epi16(filt0, _mm256_mullo_epi16(tap_256[0], prev_samp[(0 + absTimeModNTAPS) % NTAPS]));
-
-      // ADDTAP1(1);
       filt1 = _mm256_add_epi16(filt1, _mm256_mullo_epi16(tap_256[1], prev_samp[(1 + absTimeModNTAPS) % NTAPS]));
-
-      // ADDTAP2(2);
       filt2 = _mm256_add_epi16(filt2, _mm256_mullo_epi16(tap_256[2], prev_samp[(2 + absTimeModNTAPS) % NTAPS]));
-
-      // ADDTAP3(3);
       filt3 = _mm256_add_epi16(filt3, _mm256_mullo_epi16(tap_256[3], prev_samp[(3 + absTimeModNTAPS) % NTAPS]));
-
-      // ADDTAP0(4);
       filt0 = _mm256_add_epi16(filt0, _mm256_mullo_epi16(tap_256[4], prev_samp[(4 + absTimeModNTAPS) % NTAPS]));
-
-      // ADDTAP1(5);
       filt1 = _mm256_add_epi16(filt1, _mm256_mullo_epi16(tap_256[5], prev_samp[(5 + absTimeModNTAPS) % NTAPS]));
-
-      // ADDTAP2(6);
       filt2 = _mm256_add_epi16(filt2, _mm256_mullo_epi16(tap_256[6], prev_samp[(6 + absTimeModNTAPS) % NTAPS]));
 
       __m256i filt = _mm256_add_epi16(_mm256_add_epi16(filt0, filt1), _mm256_add_epi16(filt2, filt3));
       prev_samp[absTimeModNTAPS] = s;
-      // This is a reference to the value in the ProcessingInfo,
-      // so this line has the effect of directly modifying the
-      // `info` object
       absTimeModNTAPS = (absTimeModNTAPS + 1) % NTAPS;
 
       // --------------------------------------------------------------
       // Hit finding
       // --------------------------------------------------------------
-      // Mask for channels that are over the threshold in this step
-      // const uint16_t threshold=2000; // NOLINT(build/unsigned)
-      __m256i is_over = _mm256_cmpgt_epi16(filt, sigma * info.multiplier * info.threshold);
+      // Mask for channels that are over the threshold in this step.
+      // NB: multiply as 16-bit lanes. A plain `sigma * info.multiplier
+      // * info.threshold` is a GCC vector extension product of the four
+      // 64-bit lanes
+      __m256i is_over = _mm256_and_si256(_mm256_cmpgt_epi16(filt, _mm256_mullo_epi16(sigma, threshold)), active);
       // Mask for channels that left "over threshold" state this step
       __m256i left = _mm256_andnot_si256(is_over, prev_was_over);
 
-      //-----------------------------------------
-      // Update hit start times for the channels where a hit started
       const __m256i timenow = _mm256_set1_epi16(itime);
+
       //-----------------------------------------
       // Accumulate charge and time-over-threshold in the is_over channels
 
@@ -221,99 +207,86 @@ process_window_avx2(ProcessingInfo<NREGISTERS>& info)
       // so treating everything as epi8 works the same
       __m256i to_add_charge = _mm256_blendv_epi8(_mm256_set1_epi16(0), filt, is_over);
       // Divide by the multiplier before adding (implemented as a shift-right)
-      hit_charge = _mm256_adds_epi16(hit_charge, _mm256_srai_epi16(to_add_charge, info.tap_exponent));
-
-      // if(ireg==2){
-      //     printf("itime=%ld\n", itime);
-      //     printf("s:             "); print256_as16_dec(s);             printf("\n");
-      //     printf("median:        "); print256_as16_dec(median);        printf("\n");
-      //     printf("sigma:         "); print256_as16_dec(sigma);         printf("\n");
-      //     printf("filt:          "); print256_as16_dec(filt);          printf("\n");
-      //     printf("to_add_charge: "); print256_as16_dec(to_add_charge); printf("\n");
-      //     printf("hit_charge:    "); print256_as16_dec(hit_charge);    printf("\n");
-      //     printf("left:          "); print256_as16_dec(left);          printf("\n");
-      // }
+      const __m256i charge = _mm256_srai_epi16(to_add_charge, info.tap_exponent);
+      hit_charge = _mm256_adds_epi16(hit_charge, charge);
+      // Keep the largest filtered sample of each hit, and how many ticks
+      // into the hit it came. The filter output carries the multiplier,
+      // so the sample is the shifted one, like the charge
+      const __m256i is_peak = _mm256_and_si256(is_over, _mm256_cmpgt_epi16(charge, hit_peak_adc));
+      hit_peak_adc = _mm256_blendv_epi8(hit_peak_adc, charge, is_peak);
+      hit_peak_time = _mm256_blendv_epi8(hit_peak_time, hit_tover, is_peak);
 
       __m256i to_add_tover = _mm256_blendv_epi8(_mm256_set1_epi16(0), _mm256_set1_epi16(1), is_over);
       hit_tover = _mm256_adds_epi16(hit_tover, to_add_tover);
 
-      // Only store the values if there are >0 hits ending on
-      // this sample. We have to save the entire 16-channel
-      // register, which is inefficient, but whatever
+      // Only store the values if there are >0 hits ending on this sample
+      if (!_mm256_testz_si256(left, left)) {
+        // Write the hits that ended as packed tuples, as in
+        // process_window_avx2. Hits whose charge rounded down to zero
+        // are dropped
+        const __m256i fired = _mm256_andnot_si256(_mm256_cmpeq_epi16(hit_charge, _mm256_setzero_si256()), left);
+        nhits += swtpg_wib2::store_hits_avx2(
+          output_loc, fired, channels, timenow, hit_charge, hit_tover, hit_peak_adc, hit_peak_time);
 
-      // Testing whether a whole register is zeroes turns out to be tricky. Here's a way:
-      //
-      // https://stackoverflow.com/questions/22674205/is-there-an-or-equivalent-to-ptest-in-x64-assembly
-      //
-      // In x64 assembly, PTEST %XMM0 -> %XMM1 sets the
-      // zero-flag if none of the same bits are set in %XMM0 and
-      // %XMM1, and sets the carry-flag if everything that is
-      // set in %XMM0 is also set in %XMM1:
-      const int no_hits_to_store = _mm256_testc_si256(_mm256_setzero_si256(), left);
-
-      if (!no_hits_to_store) {
-
-        ++nhits;
-        // We have to save the whole register, including the
-        // lanes that don't have anything interesting, but
-        // we'll mask them to zero so they're easy to remove
-        // in a later processing step.
-        //
-        // (TODO: Maybe we should do that processing step in this function?)
-        //#define STORE_MASK(x) _mm256_storeu_si256(output_loc++, _mm256_blendv_epi8(_mm256_set1_epi16(0), x, left));
-
-        _mm256_storeu_si256(output_loc++, channels); // NOLINT(runtime/increment_decrement)
-        // Store the end time of the hit, not the start
-        // time. Since we also have the time-over-threshold,
-        // we can calculate the absolute 64-bit start time in
-        // the caller. This saves faffing with hits that span
-        // a message boundary, hopefully
-
-        _mm256_storeu_si256(output_loc++, timenow); // NOLINT(runtime/increment_decrement)
-        // STORE_MASK(hit_charge);
-        _mm256_storeu_si256(output_loc++, // NOLINT(runtime/increment_decrement)
-                            _mm256_blendv_epi8(_mm256_set1_epi16(0), hit_charge, left));
-        _mm256_storeu_si256(output_loc++, hit_tover); // NOLINT(runtime/increment_decrement)
-
-        // reset hit_start, hit_charge and hit_tover in the channels we saved
+        // reset the hits in the channels whose hit ended
         const __m256i zero = _mm256_setzero_si256();
         hit_charge = _mm256_blendv_epi8(hit_charge, zero, left);
         hit_tover = _mm256_blendv_epi8(hit_tover, zero, left);
-      } // end if(!no_hits_to_store)
+        hit_peak_adc = _mm256_blendv_epi8(hit_peak_adc, zero, left);
+        hit_peak_time = _mm256_blendv_epi8(hit_peak_time, zero, left);
+      }
 
       prev_was_over = is_over;
 
     } // end loop over itime (times for this register)
 
     // Store the state, ready for the next time round
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.pedestals) + ireg, median);      // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.quantile25) + ireg, quantile25); // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.quantile75) + ireg, quantile75); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.pedestals), median);      // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.quantile25), quantile25); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.quantile75), quantile75); // NOLINT
 
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum) + ireg, accum);     // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum25) + ireg, accum25); // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum75) + ireg, accum75); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum), accum);     // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum25), accum25); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum75), accum75); // NOLINT
 
     for (size_t j = 0; j < NTAPS; ++j) {
-      _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.prev_samp) + NTAPS * ireg + j, prev_samp[j]); // NOLINT
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.prev_samp) + j, prev_samp[j]); // NOLINT
     }
 
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.prev_was_over) + ireg, prev_was_over); // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_charge) + ireg, hit_charge);       // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_tover) + ireg, hit_tover);         // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.prev_was_over), prev_was_over); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_charge), hit_charge);       // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_tover), hit_tover);         // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_peak_adc), hit_peak_adc);   // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_peak_time), hit_peak_time); // NOLINT
 
-  } // end loop over ireg (the 8 registers in this frame)
+  } // end loop over ireg (the registers of this frame handler)
 
   info.absTimeModNTAPS = (info.absTimeModNTAPS + info.timeWindowNumFrames) % NTAPS;
-  // Store the output
-  for (int i = 0; i < 4; ++i) {
-    _mm256_storeu_si256(output_loc++, _mm256_set1_epi16(swtpg_wib2::MAGIC)); // NOLINT(runtime/increment_decrement)
+
+  // End the output with a tuple of MAGIC
+  for (size_t i = 0; i < HIT_TUPLE_SIZE; ++i) {
+    *output_loc++ = swtpg_wib2::MAGIC; // NOLINT(runtime/increment_decrement)
   }
 
   info.nhits = nhits;
 
 } // NOLINT(readability/fn_size)
 
+// The "FIR" algorithm, as registered in KernelsAVX2.cpp
+struct FIRKernelAVX2
+{
+  static constexpr const char* name = "FIR";
+  using RegisterState = FIRRegisterState;
+
+  template<size_t NREGISTERS, typename SampleSource>
+  static void process(ProcessingInfo<NREGISTERS, RegisterState>& info, SampleSource&& get_sample)
+  {
+    process_window_fir_avx2(info, std::forward<SampleSource>(get_sample));
+  }
+};
+
 } // namespace swtpg_wib2
 
+#pragma GCC pop_options
+
 #endif // READOUT_SRC_WIB2_TPG_PROCESSAVX2FIR_HPP_
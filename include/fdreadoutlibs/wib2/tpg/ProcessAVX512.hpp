@@ -0,0 +1,166 @@
+/**
+ * @file ProcessAVX512.hpp
+ * Simplified hit finding algorithm
+ * Process frames with AVX-512 registers and instructions, 32 channels
+ * at a time. Same algorithm as process_window_avx2: no FIR, uses a
+ * configurable fixed threshold
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#ifndef READOUT_SRC_WIB2_TPG_PROCESSAVX512_HPP_
+#define READOUT_SRC_WIB2_TPG_PROCESSAVX512_HPP_
+
+#include "FrameExpandAVX512.hpp"
+#include "UtilsAVX512.hpp"
+#include "ProcessingInfo.hpp"
+#include "TPGConstants_wib2.hpp"
+
+#include <immintrin.h>
+#include <utility>
+
+// Built for AVX-512, see FrameExpand.hpp
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+// Silenced as in UtilsAVX512.hpp
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+namespace swtpg_wib2 {
+
+// info.first_register and info.last_register are in units of AVX2
+// registers (so that the channel state layout is shared with the AVX2
+// kernels) and must be even. info.input must have been filled by
+// expand_wib2_adcs_avx512
+template<size_t NREGISTERS, typename SampleSource>
+inline void
+process_window_avx512(ProcessingInfo<NREGISTERS, SWTPGRegisterState>& info, SampleSource&& get_sample)
+{
+  const __m512i adcMax = _mm512_set1_epi16(info.adcMax);
+  const __m512i one = _mm512_set1_epi16(1);
+
+  // Pointer to keep track of where we'll write the next output hit
+  uint16_t* output_loc = info.output; // NOLINT(build/unsigned)
+
+  const __m512i iota = _mm512_setr_epi32(0x00010000, 0x00030002, 0x00050004, 0x00070006,
+                                         0x00090008, 0x000b000a, 0x000d000c, 0x000f000e,
+                                         0x00110010, 0x00130012, 0x00150014, 0x00170016,
+                                         0x00190018, 0x001b001a, 0x001d001c, 0x001f001e);
+
+  int nhits = 0;
+
+  for (uint16_t ireg = info.first_register; ireg < info.last_register; ireg += 2) { // NOLINT(build/unsigned)
+
+    // ------------------------------------
+    // Variables for pedestal subtraction
+
+    SWTPGRegisterState& state_lo = info.chanState[ireg];
+    SWTPGRegisterState& state_hi = info.chanState[ireg + 1];
+    __m512i median = load_state_pair_avx512(state_lo.pedestals, state_hi.pedestals);
+    __m512i accum = load_state_pair_avx512(state_lo.accum, state_hi.accum);
+
+    // ------------------------------------
+    // Variables for hit finding
+
+    // Was the previous step over threshold? Stored as 0/0xffff in the
+    // state, like in the AVX2 kernels
+    __mmask32 prev_was_over = _mm512_movepi16_mask(load_state_pair_avx512(state_lo.prev_was_over, state_hi.prev_was_over));
+    __m512i hit_charge = load_state_pair_avx512(state_lo.hit_charge, state_hi.hit_charge);
+    __m512i hit_tover = load_state_pair_avx512(state_lo.hit_tover, state_hi.hit_tover);
+    __m512i hit_peak_adc = load_state_pair_avx512(state_lo.hit_peak_adc, state_hi.hit_peak_adc);
+    __m512i hit_peak_time = load_state_pair_avx512(state_lo.hit_peak_time, state_hi.hit_peak_time);
+    const __m512i threshold = load_state_pair_avx512(state_lo.threshold, state_hi.threshold);
+    // The channels that aren't masked
+    const __mmask32 active = _mm512_movepi16_mask(load_state_pair_avx512(state_lo.active, state_hi.active));
+
+    // The channel numbers in each of the slots in the register
+    __m512i channels = _mm512_add_epi16(_mm512_set1_epi16(ireg * SAMPLES_PER_REGISTER), iota);
+
+    for (size_t itime = 0; itime < info.timeWindowNumFrames; ++itime) {
+
+      // The current sample
+      __m512i s = get_sample(ireg, itime);
+
+      swtpg_wib2::frugal_accum_update_avx512(median, s, accum, 10, 0xffffffffu);
+      // Actually subtract the pedestal
+      s = _mm512_sub_epi16(s, median);
+
+      // Don't let the sample exceed adcMax
+      s = _mm512_min_epi16(s, adcMax);
+
+      // --------------------------------------------------------------
+      // Hit finding
+      // --------------------------------------------------------------
+      const __mmask32 is_over = _mm512_mask_cmpgt_epi16_mask(active, s, threshold);
+      // Channels that left "over threshold" state this step
+      const __mmask32 left = _kandn_mask32(is_over, prev_was_over);
+
+      // Accumulate charge and time-over-threshold in the is_over channels
+      const __m512i charge = _mm512_srai_epi16(s, info.tap_exponent);
+      hit_charge = _mm512_mask_adds_epi16(hit_charge, is_over, hit_charge, charge);
+      // Keep the largest sample of each hit, before the shift, and how
+      // many ticks into the hit it came
+      const __mmask32 is_peak = _mm512_mask_cmpgt_epi16_mask(is_over, s, hit_peak_adc);
+      hit_peak_adc = _mm512_mask_mov_epi16(hit_peak_adc, is_peak, s);
+      hit_peak_time = _mm512_mask_mov_epi16(hit_peak_time, is_peak, hit_tover);
+      hit_tover = _mm512_mask_adds_epi16(hit_tover, is_over, hit_tover, one);
+
+      if (left) {
+        // Hits whose charge rounded down to zero are dropped, as in the AVX2 version
+        const __mmask32 fired = _mm512_mask_test_epi16_mask(left, hit_charge, hit_charge);
+        nhits += store_hits_avx512(
+          output_loc, fired, channels, _mm512_set1_epi16(itime), hit_charge, hit_tover, hit_peak_adc, hit_peak_time);
+
+        // reset the hits in the channels whose hit ended
+        hit_charge = _mm512_mask_mov_epi16(hit_charge, left, _mm512_setzero_si512());
+        hit_tover = _mm512_mask_mov_epi16(hit_tover, left, _mm512_setzero_si512());
+        hit_peak_adc = _mm512_mask_mov_epi16(hit_peak_adc, left, _mm512_setzero_si512());
+        hit_peak_time = _mm512_mask_mov_epi16(hit_peak_time, left, _mm512_setzero_si512());
+      }
+
+      prev_was_over = is_over;
+
+    } // end loop over itime (times for this register)
+
+    // Store the state, ready for the next time round
+    store_state_pair_avx512(state_lo.pedestals, state_hi.pedestals, median);
+    store_state_pair_avx512(state_lo.accum, state_hi.accum, accum);
+
+    store_state_pair_avx512(state_lo.prev_was_over, state_hi.prev_was_over, _mm512_movm_epi16(prev_was_over));
+    store_state_pair_avx512(state_lo.hit_charge, state_hi.hit_charge, hit_charge);
+    store_state_pair_avx512(state_lo.hit_tover, state_hi.hit_tover, hit_tover);
+    store_state_pair_avx512(state_lo.hit_peak_adc, state_hi.hit_peak_adc, hit_peak_adc);
+    store_state_pair_avx512(state_lo.hit_peak_time, state_hi.hit_peak_time, hit_peak_time);
+
+  } // end loop over ireg
+
+  // End the output with a tuple of MAGIC
+  for (size_t i = 0; i < HIT_TUPLE_SIZE; ++i) {
+    *output_loc++ = swtpg_wib2::MAGIC; // NOLINT(runtime/increment_decrement)
+  }
+
+  info.nhits = nhits;
+
+} // NOLINT(readability/fn_size)
+
+// The "SWTPG" algorithm, as registered in KernelsAVX512.cpp
+struct SWTPGKernelAVX512
+{
+  static constexpr const char* name = "SWTPG";
+  using RegisterState = SWTPGRegisterState;
+
+  template<size_t NREGISTERS, typename SampleSource>
+  static void process(ProcessingInfo<NREGISTERS, RegisterState>& info, SampleSource&& get_sample)
+  {
+    process_window_avx512(info, std::forward<SampleSource>(get_sample));
+  }
+};
+
+} // namespace swtpg_wib2
+
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+
+#endif // READOUT_SRC_WIB2_TPG_PROCESSAVX512_HPP_
@@ -0,0 +1,223 @@
+/**
+ * @file ProcessAVX512FIR.hpp Process frames with AVX-512 registers and
+ * instructions using a FIR filter, 32 channels at a time. Same
+ * algorithm as process_window_fir_avx2
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#ifndef READOUT_SRC_WIB2_TPG_PROCESSAVX512FIR_HPP_
+#define READOUT_SRC_WIB2_TPG_PROCESSAVX512FIR_HPP_
+
+#include "FrameExpandAVX512.hpp"
+#include "UtilsAVX512.hpp"
+#include "ProcessingInfo.hpp"
+#include "TPGConstants_wib2.hpp"
+
+#include <immintrin.h>
+#include <utility>
+
+// Built for AVX-512, see FrameExpand.hpp
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+// Silenced as in UtilsAVX512.hpp
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+namespace swtpg_wib2 {
+
+// See process_window_avx512 for the conventions on the register range
+// and on the input layout. The filter history stays in the layout of
+// process_window_fir_avx2, NTAPS AVX2 registers per register, so each
+// 512-bit history register is put together from two of them
+template<size_t NREGISTERS, typename SampleSource>
+inline void
+process_window_fir_avx512(ProcessingInfo<NREGISTERS, FIRRegisterState>& info, SampleSource&& get_sample)
+{
+  const size_t NTAPS = FIRState::NTAPS;
+
+  const __m512i adcMax = _mm512_set1_epi16(info.adcMax);
+  const __m512i multiplier = _mm512_set1_epi16(info.multiplier);
+  const __m512i one = _mm512_set1_epi16(1);
+
+  __m512i tap_512[NTAPS];
+  for (size_t i = 0; i < NTAPS; ++i) {
+    tap_512[i] = _mm512_set1_epi16(i < size_t(info.ntaps) ? info.taps[i] : 0);
+  }
+
+  // Pointer to keep track of where we'll write the next output hit
+  uint16_t* output_loc = info.output; // NOLINT(build/unsigned)
+
+  const __m512i iota = _mm512_setr_epi32(0x00010000, 0x00030002, 0x00050004, 0x00070006,
+                                         0x00090008, 0x000b000a, 0x000d000c, 0x000f000e,
+                                         0x00110010, 0x00130012, 0x00150014, 0x00170016,
+                                         0x00190018, 0x001b001a, 0x001d001c, 0x001f001e);
+
+  int nhits = 0;
+
+  for (uint16_t ireg = info.first_register; ireg < info.last_register; ireg += 2) { // NOLINT(build/unsigned)
+
+    uint16_t absTimeModNTAPS = info.absTimeModNTAPS; // NOLINT(build/unsigned)
+
+    // ------------------------------------
+    // Variables for pedestal subtraction
+
+    FIRRegisterState& state_lo = info.chanState[ireg];
+    FIRRegisterState& state_hi = info.chanState[ireg + 1];
+    __m512i median = load_state_pair_avx512(state_lo.pedestals, state_hi.pedestals);
+    __m512i quantile25 = load_state_pair_avx512(state_lo.quantile25, state_hi.quantile25);
+    __m512i quantile75 = load_state_pair_avx512(state_lo.quantile75, state_hi.quantile75);
+
+    __m512i accum = load_state_pair_avx512(state_lo.accum, state_hi.accum);
+    __m512i accum25 = load_state_pair_avx512(state_lo.accum25, state_hi.accum25);
+    __m512i accum75 = load_state_pair_avx512(state_lo.accum75, state_hi.accum75);
+
+    // ------------------------------------
+    // Variables for filtering
+    __m512i prev_samp[NTAPS];
+    for (size_t j = 0; j < NTAPS; ++j) {
+      prev_samp[j] = load_state_pair_avx512(state_lo.prev_samp + j * SAMPLES_PER_REGISTER,
+                                            state_hi.prev_samp + j * SAMPLES_PER_REGISTER);
+    }
+
+    // ------------------------------------
+    // Variables for hit finding
+    __mmask32 prev_was_over = _mm512_movepi16_mask(load_state_pair_avx512(state_lo.prev_was_over, state_hi.prev_was_over));
+    __m512i hit_charge = load_state_pair_avx512(state_lo.hit_charge, state_hi.hit_charge);
+    __m512i hit_tover = load_state_pair_avx512(state_lo.hit_tover, state_hi.hit_tover);
+    __m512i hit_peak_adc = load_state_pair_avx512(state_lo.hit_peak_adc, state_hi.hit_peak_adc);
+    __m512i hit_peak_time = load_state_pair_avx512(state_lo.hit_peak_time, state_hi.hit_peak_time);
+    // Per-channel thresholds, as in process_window_fir_avx2
+    const __m512i threshold = _mm512_mullo_epi16(load_state_pair_avx512(state_lo.threshold, state_hi.threshold), multiplier);
+    const __m512i sigmaMax = load_state_pair_avx512(state_lo.sigma_max, state_hi.sigma_max);
+    // The channels that aren't masked
+    const __mmask32 active = _mm512_movepi16_mask(load_state_pair_avx512(state_lo.active, state_hi.active));
+
+    // The channel numbers in each of the slots in the register
+    __m512i channels = _mm512_add_epi16(_mm512_set1_epi16(ireg * SAMPLES_PER_REGISTER), iota);
+
+    for (size_t itime = 0; itime < info.timeWindowNumFrames; ++itime) {
+
+      // The current sample
+      __m512i s = get_sample(ireg, itime);
+
+      const __mmask32 is_gt = _mm512_cmpgt_epi16_mask(s, median);
+      const __mmask32 is_lt = _mm512_cmplt_epi16_mask(s, median);
+      // Update the 25th percentile in the channels that are below the median
+      swtpg_wib2::frugal_accum_update_avx512(quantile25, s, accum25, 10, is_lt);
+      // Update the 75th percentile in the channels that are above the median
+      swtpg_wib2::frugal_accum_update_avx512(quantile75, s, accum75, 10, is_gt);
+      // Update the median itself in all channels
+      swtpg_wib2::frugal_accum_update_avx512(median, s, accum, 10, 0xffffffffu);
+      // Actually subtract the pedestal
+      s = _mm512_sub_epi16(s, median);
+
+      // Find the interquartile range
+      __m512i sigma = _mm512_sub_epi16(quantile75, quantile25);
+      sigma = _mm512_min_epi16(sigma, sigmaMax);
+
+      // --------------------------------------------------------------
+      // Filtering, as in process_window_fir_avx2
+      // --------------------------------------------------------------
+      s = _mm512_min_epi16(s, adcMax);
+
+      __m512i filt0 = _mm512_mullo_epi16(tap_512[0], prev_samp[(0 + absTimeModNTAPS) % NTAPS]);
+      __m512i filt1 = _mm512_mullo_epi16(tap_512[1], prev_samp[(1 + absTimeModNTAPS) % NTAPS]);
+      __m512i filt2 = _mm512_mullo_epi16(tap_512[2], prev_samp[(2 + absTimeModNTAPS) % NTAPS]);
+      __m512i filt3 = _mm512_mullo_epi16(tap_512[3], prev_samp[(3 + absTimeModNTAPS) % NTAPS]);
+      filt0 = _mm512_add_epi16(filt0, _mm512_mullo_epi16(tap_512[4], prev_samp[(4 + absTimeModNTAPS) % NTAPS]));
+      filt1 = _mm512_add_epi16(filt1, _mm512_mullo_epi16(tap_512[5], prev_samp[(5 + absTimeModNTAPS) % NTAPS]));
+      filt2 = _mm512_add_epi16(filt2, _mm512_mullo_epi16(tap_512[6], prev_samp[(6 + absTimeModNTAPS) % NTAPS]));
+
+      __m512i filt = _mm512_add_epi16(_mm512_add_epi16(filt0, filt1), _mm512_add_epi16(filt2, filt3));
+      prev_samp[absTimeModNTAPS] = s;
+      absTimeModNTAPS = (absTimeModNTAPS + 1) % NTAPS;
+
+      // --------------------------------------------------------------
+      // Hit finding
+      // --------------------------------------------------------------
+      const __mmask32 is_over = _mm512_mask_cmpgt_epi16_mask(active, filt, _mm512_mullo_epi16(sigma, threshold));
+      const __mmask32 left = _kandn_mask32(is_over, prev_was_over);
+
+      // Accumulate charge and time-over-threshold in the is_over channels
+      const __m512i charge = _mm512_srai_epi16(filt, info.tap_exponent);
+      hit_charge = _mm512_mask_adds_epi16(hit_charge, is_over, hit_charge, charge);
+      // Keep the largest filtered sample of each hit, and how many ticks
+      // into the hit it came. The filter output carries the multiplier,
+      // so the sample is the shifted one, like the charge
+      const __mmask32 is_peak = _mm512_mask_cmpgt_epi16_mask(is_over, charge, hit_peak_adc);
+      hit_peak_adc = _mm512_mask_mov_epi16(hit_peak_adc, is_peak, charge);
+      hit_peak_time = _mm512_mask_mov_epi16(hit_peak_time, is_peak, hit_tover);
+      hit_tover = _mm512_mask_adds_epi16(hit_tover, is_over, hit_tover, one);
+
+      if (left) {
+        // Hits whose charge rounded down to zero are dropped, as in the AVX2 version
+        const __mmask32 fired = _mm512_mask_test_epi16_mask(left, hit_charge, hit_charge);
+        nhits += store_hits_avx512(
+          output_loc, fired, channels, _mm512_set1_epi16(itime), hit_charge, hit_tover, hit_peak_adc, hit_peak_time);
+
+        // reset the hits in the channels whose hit ended
+        hit_charge = _mm512_mask_mov_epi16(hit_charge, left, _mm512_setzero_si512());
+        hit_tover = _mm512_mask_mov_epi16(hit_tover, left, _mm512_setzero_si512());
+        hit_peak_adc = _mm512_mask_mov_epi16(hit_peak_adc, left, _mm512_setzero_si512());
+        hit_peak_time = _mm512_mask_mov_epi16(hit_peak_time, left, _mm512_setzero_si512());
+      }
+
+      prev_was_over = is_over;
+
+    } // end loop over itime (times for this register)
+
+    // Store the state, ready for the next time round
+    store_state_pair_avx512(state_lo.pedestals, state_hi.pedestals, median);
+    store_state_pair_avx512(state_lo.quantile25, state_hi.quantile25, quantile25);
+    store_state_pair_avx512(state_lo.quantile75, state_hi.quantile75, quantile75);
+
+    store_state_pair_avx512(state_lo.accum, state_hi.accum, accum);
+    store_state_pair_avx512(state_lo.accum25, state_hi.accum25, accum25);
+    store_state_pair_avx512(state_lo.accum75, state_hi.accum75, accum75);
+
+    for (size_t j = 0; j < NTAPS; ++j) {
+      store_state_pair_avx512(
+        state_lo.prev_samp + j * SAMPLES_PER_REGISTER, state_hi.prev_samp + j * SAMPLES_PER_REGISTER, prev_samp[j]);
+    }
+
+    store_state_pair_avx512(state_lo.prev_was_over, state_hi.prev_was_over, _mm512_movm_epi16(prev_was_over));
+    store_state_pair_avx512(state_lo.hit_charge, state_hi.hit_charge, hit_charge);
+    store_state_pair_avx512(state_lo.hit_tover, state_hi.hit_tover, hit_tover);
+    store_state_pair_avx512(state_lo.hit_peak_adc, state_hi.hit_peak_adc, hit_peak_adc);
+    store_state_pair_avx512(state_lo.hit_peak_time, state_hi.hit_peak_time, hit_peak_time);
+
+  } // end loop over ireg
+
+  info.absTimeModNTAPS = (info.absTimeModNTAPS + info.timeWindowNumFrames) % NTAPS;
+
+  // End the output with a tuple of MAGIC
+  for (size_t i = 0; i < HIT_TUPLE_SIZE; ++i) {
+    *output_loc++ = swtpg_wib2::MAGIC; // NOLINT(runtime/increment_decrement)
+  }
+
+  info.nhits = nhits;
+
+} // NOLINT(readability/fn_size)
+
+// The "FIR" algorithm, as registered in KernelsAVX512.cpp
+struct FIRKernelAVX512
+{
+  static constexpr const char* name = "FIR";
+  using RegisterState = FIRRegisterState;
+
+  template<size_t NREGISTERS, typename SampleSource>
+  static void process(ProcessingInfo<NREGISTERS, RegisterState>& info, SampleSource&& get_sample)
+  {
+    process_window_fir_avx512(info, std::forward<SampleSource>(get_sample));
+  }
+};
+
+} // namespace swtpg_wib2
+
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+
+#endif // READOUT_SRC_WIB2_TPG_PROCESSAVX512FIR_HPP_
@@ -19,7 +19,7 @@
 
 namespace swtpg_wib2 {
 
-void
+inline void
 frugal_accum_update(int16_t& m, const int16_t s, int16_t& acc, const int16_t acclimit)
 {
   if (s > m)
@@ -40,7 +40,7 @@ frugal_accum_update(int16_t& m, const int16_t s, int16_t& acc, const int16_t acc
 
 template<size_t NREGISTERS>
 void
-process_window_naive(ProcessingInfo<NREGISTERS>& info)
+process_window_naive(ProcessingInfo<NREGISTERS, FIRRegisterState>& info)
 {
   // Start with taps as floats that add to 1. Multiply by some
   // power of two (2**N) and round to int. Before filtering, cap the
@@ -61,21 +61,21 @@ process_window_naive(ProcessingInfo<NREGISTERS>& info)
     const size_t register_t0_start = register_index * SAMPLES_PER_REGISTER * FRAMES_PER_MSG;
 
     // Get all the state variables by reference so they "automatically" get saved for the next go-round
-    ChanState<NREGISTERS>& state = info.chanState;
-    int16_t& median = state.pedestals[ichan];
-    int16_t& quantile25 = state.quantile25[ichan];
-    int16_t& quantile75 = state.quantile75[ichan];
-    int16_t& accum = state.accum[ichan];
-    int16_t& accum25 = state.accum25[ichan];
-    int16_t& accum75 = state.accum75[ichan];
+    FIRRegisterState& state = info.chanState[register_index];
+    int16_t& median = state.pedestals[register_offset];
+    int16_t& quantile25 = state.quantile25[register_offset];
+    int16_t& quantile75 = state.quantile75[register_offset];
+    int16_t& accum = state.accum[register_offset];
+    int16_t& accum25 = state.accum25[register_offset];
+    int16_t& accum75 = state.accum75[register_offset];
 
-    // Variables for filtering
-    int16_t* prev_samp = state.prev_samp + NTAPS * ichan;
+    // Variables for filtering, in the layout of process_window_fir_avx2
+    int16_t* prev_samp = state.prev_samp + register_offset;
 
     // Variables for hit finding
-    int16_t& prev_was_over = state.prev_was_over[ichan]; // was the previous sample over threshold?
-    int16_t& hit_charge = state.hit_charge[ichan];
-    int16_t& hit_tover = state.hit_tover[ichan]; // time over threshold
+    int16_t& prev_was_over = state.prev_was_over[register_offset]; // was the previous sample over threshold?
+    int16_t& hit_charge = state.hit_charge[register_offset];
+    int16_t& hit_tover = state.hit_tover[register_offset]; // time over threshold
 
     uint16_t absTimeModNTAPS = info.absTimeModNTAPS; // NOLINT
 
@@ -111,9 +111,9 @@ process_window_naive(ProcessingInfo<NREGISTERS>& info)
       sample = std::min(sample, adcMax);
       int16_t filt_tmp = 0;
       for (size_t j = 0; j < NTAPS; ++j) {
-        filt_tmp += info.taps[j] * prev_samp[(j + absTimeModNTAPS) % NTAPS];
+        filt_tmp += info.taps[j] * prev_samp[((j + absTimeModNTAPS) % NTAPS) * SAMPLES_PER_REGISTER];
       }
-      prev_samp[absTimeModNTAPS % NTAPS] = sample;
+      prev_samp[(absTimeModNTAPS % NTAPS) * SAMPLES_PER_REGISTER] = sample;
 
       absTimeModNTAPS = (absTimeModNTAPS + 1) % NTAPS;
       int16_t filt = filt_tmp;
@@ -121,7 +121,7 @@ process_window_naive(ProcessingInfo<NREGISTERS>& info)
       // --------------------------------------------------------------
       // Hit finding
       // --------------------------------------------------------------
-      bool is_over = filt > 5 * sigma * info.multiplier;
+      bool is_over = state.active[register_offset] && filt > 5 * sigma * info.multiplier;
       if (is_over) {
         // Simulate saturated add
         int32_t tmp_charge = hit_charge;
@@ -136,11 +136,15 @@ process_window_naive(ProcessingInfo<NREGISTERS>& info)
         //     printf("% 5d % 5d % 5d % 5d\n", (uint16_t)ichan, (uint16_t)itime, hit_charge, hit_tover); // NOLINT
         // }
 
-        // We reached the end of the hit: write it out
+        // We reached the end of the hit: write it out, in the tuples
+        // of the other kernels but without the peak
         (*output_loc++) = (uint16_t)ichan; // NOLINT
         (*output_loc++) = itime;           // NOLINT
         (*output_loc++) = hit_charge;      // NOLINT
         (*output_loc++) = hit_tover;       // NOLINT
+        for (size_t i = 4; i < HIT_TUPLE_SIZE; ++i) {
+          (*output_loc++) = 0; // NOLINT
+        }
 
         hit_charge = 0;
         hit_tover = 0;
@@ -154,11 +158,11 @@ process_window_naive(ProcessingInfo<NREGISTERS>& info)
   }   // end loop over channels
 
   // printf("Found %d hits\n", nhits);
-  info.nhits += nhits;
+  info.nhits = nhits;
   info.absTimeModNTAPS = (info.absTimeModNTAPS + info.timeWindowNumFrames) % NTAPS;
 
   // Write a magic "end-of-hits" value into the list of hits
-  for (int i = 0; i < 4; ++i) {
+  for (size_t i = 0; i < HIT_TUPLE_SIZE; ++i) {
     (*output_loc++) = MAGIC; // NOLINT
   }
 }
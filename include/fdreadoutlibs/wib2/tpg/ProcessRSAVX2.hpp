@@ -17,12 +17,18 @@
 #include "TPGConstants_wib2.hpp"
 
 #include <immintrin.h>
+#include <utility>
+
+// Built for AVX2, see FrameExpand.hpp
+#pragma GCC push_options
+#pragma GCC target("avx2")
 
 namespace swtpg_wib2 {
 
-template<size_t NREGISTERS>
+// See process_window_avx2 for the sample sources
+template<size_t NREGISTERS, typename SampleSource>
 inline void
-process_window_rs_avx2(ProcessingInfo<NREGISTERS>& info, size_t channel_offset)
+process_window_rs_avx2(ProcessingInfo<NREGISTERS, AbsRSRegisterState>& info, SampleSource&& get_sample)
 {
 
   // Running sum scaling factor
@@ -32,11 +38,8 @@ process_window_rs_avx2(ProcessingInfo<NREGISTERS>& info, size_t channel_offset)
   // (may not needs this, depends on magnitude of FIR output) 
   const __m256i scale_factor = _mm256_set1_epi16(5);
 
-  // The maximum value that sigma can have before the threshold overflows a 16-bit signed integer
-  const __m256i sigmaMax = _mm256_set1_epi16((1 << 15) / (info.multiplier * info.threshold));
-
   // Pointer to keep track of where we'll write the next output hit
-  __m256i* output_loc = (__m256i*)(info.output); // NOLINT(readability/casting)
+  uint16_t* output_loc = info.output; // NOLINT(build/unsigned)
 
   const __m256i iota = _mm256_set_epi16(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
 
@@ -53,46 +56,53 @@ process_window_rs_avx2(ProcessingInfo<NREGISTERS>& info, size_t channel_offset)
     // The current estimate of the pedestal in each channel: get
     // from the previous go-around.
 
-    ChanState<NREGISTERS>& state = info.chanState;
-    __m256i median = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.pedestals) + ireg);      // NOLINT
-    __m256i quantile25 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.quantile25) + ireg); // NOLINT
-    __m256i quantile75 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.quantile75) + ireg); // NOLINT
+    AbsRSRegisterState& state = info.chanState[ireg];
+    __m256i median = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.pedestals));      // NOLINT
+    __m256i quantile25 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.quantile25)); // NOLINT
+    __m256i quantile75 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.quantile75)); // NOLINT
 
     // The accumulator that we increase/decrease when the current
     // sample is greater/less than the median
-    __m256i accum = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum) + ireg);     // NOLINT
-    __m256i accum25 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum25) + ireg); // NOLINT
-    __m256i accum75 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum75) + ireg); // NOLINT
+    __m256i accum = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum));     // NOLINT
+    __m256i accum25 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum25)); // NOLINT
+    __m256i accum75 = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accum75)); // NOLINT
 
     // Runnin Sum variables
 
-    __m256i RS = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.RS) + ireg);     // NOLINT
-    __m256i medianRS = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.pedestalsRS) + ireg);     // NOLINT
-    __m256i accumRS = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accumRS) + ireg);     // NOLINT
+    __m256i RS = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.RS));     // NOLINT
+    __m256i medianRS = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.pedestalsRS));     // NOLINT
+    __m256i accumRS = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.accumRS));     // NOLINT
 
     // ------------------------------------
     // Variables for hit finding
 
     // Was the previous step over threshold?
-    __m256i prev_was_over = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.prev_was_over) + ireg); // NOLINT
+    __m256i prev_was_over = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.prev_was_over)); // NOLINT
     ;
     // The integrated charge (so far) of the current hit
-    __m256i hit_charge = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_charge) + ireg); // NOLINT
+    __m256i hit_charge = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_charge)); // NOLINT
     ;
     // The time-over-threshold (so far) of the current hit
-    __m256i hit_tover = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_tover) + ireg); // NOLINT
+    __m256i hit_tover = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_tover)); // NOLINT
     ;
-
-    // The channel numbers in each of the slots in the register
-    __m256i channel_base = _mm256_set1_epi16(ireg * SAMPLES_PER_REGISTER + channel_offset);
+    // The peak charge (so far) of the current hit, and when it came
+    __m256i hit_peak_adc = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_peak_adc));   // NOLINT
+    __m256i hit_peak_time = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.hit_peak_time)); // NOLINT
+    // The threshold of each channel, in units of sigma, and the maximum
+    // value that sigma can have before the threshold overflows a 16-bit
+    // signed integer
+    const __m256i threshold = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.threshold)); // NOLINT
+    const __m256i sigmaMax = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.sigma_max));  // NOLINT
+    // The channels that aren't masked
+    const __m256i active = _mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.active)); // NOLINT
+
+    // The channel numbers in each of the slots in the register. Register
+    // numbers are absolute within the frame, so these are too
+    __m256i channel_base = _mm256_set1_epi16(ireg * SAMPLES_PER_REGISTER);
     __m256i channels = _mm256_add_epi16(channel_base, iota);
 
     for (size_t itime = 0; itime < info.timeWindowNumFrames; ++itime) {
       //printf("itime=%ld\n", itime);
-      const size_t msg_index = itime / info.timeWindowNumFrames;
-      const size_t msg_time_offset = itime % info.timeWindowNumFrames;
-      const size_t index = msg_index * NREGISTERS * FRAMES_PER_MSG + FRAMES_PER_MSG * ireg + msg_time_offset;
-      // const __m256i* rawp=reinterpret_cast<const __m256i*>(info.input)+index; // NOLINT
 
 
       // --------------------------------------------------------------
@@ -101,7 +111,7 @@ process_window_rs_avx2(ProcessingInfo<NREGISTERS>& info, size_t channel_offset)
 
 
       // The current sample
-      __m256i s = info.input->ymm(index);
+      __m256i s = get_sample(ireg, itime);
       //printf("Input ADC value:\t\t\t\t"); print256_as16_dec(s);         printf("\n");
       //short *input_adc_values_ptr = (short*)&s;
       //for (short i = 0; i < 16; ++i)
@@ -193,7 +203,9 @@ process_window_rs_avx2(ProcessingInfo<NREGISTERS>& info, size_t channel_offset)
       // Mask for channels that are over the threshold in this step
       // const uint16_t threshold=2000; // NOLINT(build/unsigned)
       //__m256i is_over = _mm256_cmpgt_epi16(RS, sigma * info.multiplier * info.threshold);
-      __m256i is_over = _mm256_cmpgt_epi16(RS, sigma * info.threshold);
+      // NB: multiply as 16-bit lanes. A plain `sigma * info.threshold`
+      // is a GCC vector extension product of the four 64-bit lanes
+      __m256i is_over = _mm256_and_si256(_mm256_cmpgt_epi16(RS, _mm256_mullo_epi16(sigma, threshold)), active);
       // Mask for channels that left "over threshold" state this step
       __m256i left = _mm256_andnot_si256(is_over, prev_was_over);
 
@@ -209,7 +221,13 @@ process_window_rs_avx2(ProcessingInfo<NREGISTERS>& info, size_t channel_offset)
       __m256i temp_charge = _mm256_adds_epi16(RS, medianRS);
       __m256i to_add_charge = _mm256_blendv_epi8(_mm256_set1_epi16(0), temp_charge, is_over);
       // Divide by the multiplier before adding (implemented as a shift-right)
-      hit_charge = _mm256_adds_epi16(hit_charge, _mm256_srai_epi16(to_add_charge, info.tap_exponent));
+      const __m256i charge = _mm256_srai_epi16(to_add_charge, info.tap_exponent);
+      hit_charge = _mm256_adds_epi16(hit_charge, charge);
+      // Keep the largest sample of each hit, before the shift, and how
+      // many ticks into the hit it came
+      const __m256i is_peak = _mm256_and_si256(is_over, _mm256_cmpgt_epi16(temp_charge, hit_peak_adc));
+      hit_peak_adc = _mm256_blendv_epi8(hit_peak_adc, temp_charge, is_peak);
+      hit_peak_time = _mm256_blendv_epi8(hit_peak_time, hit_tover, is_peak);
 
       //if(ireg==0){
       //     printf("itime=%ld\n", itime);
@@ -228,62 +246,25 @@ process_window_rs_avx2(ProcessingInfo<NREGISTERS>& info, size_t channel_offset)
       __m256i to_add_tover = _mm256_blendv_epi8(_mm256_set1_epi16(0), _mm256_set1_epi16(1), is_over);
       hit_tover = _mm256_adds_epi16(hit_tover, to_add_tover);
 
-      // Only store the values if there are >0 hits ending on
-      // this sample. We have to save the entire 16-channel
-      // register, which is inefficient, but whatever
-
-      // Testing whether a whole register is zeroes turns out to be tricky. Here's a way:
-      //
-      // https://stackoverflow.com/questions/22674205/is-there-an-or-equivalent-to-ptest-in-x64-assembly
-      //
-      // In x64 assembly, PTEST %XMM0 -> %XMM1 sets the
-      // zero-flag if none of the same bits are set in %XMM0 and
-      // %XMM1, and sets the carry-flag if everything that is
-      // set in %XMM0 is also set in %XMM1:
-      const int no_hits_to_store = _mm256_testc_si256(_mm256_setzero_si256(), left);
-      //printf("left:          "); print256_as16_dec(left);          printf("\n");
-
-
-      if (!no_hits_to_store) {
-
-
-        ++nhits;
-        // We have to save the whole register, including the
-        // lanes that don't have anything interesting, but
-        // we'll mask them to zero so they're easy to remove
-        // in a later processing step.
-        //
-        // (TODO: Maybe we should do that processing step in this function?)
-        //#define STORE_MASK(x) _mm256_storeu_si256(output_loc++, _mm256_blendv_epi8(_mm256_set1_epi16(0), x, left));
-
-        _mm256_storeu_si256(output_loc++, channels); // NOLINT(runtime/increment_decrement)
-        //printf("channels:          "); print256_as16_dec(channels);          printf("\n");
-        //printf("to_add_charge:    "); print256_as16_dec(to_add_charge);    printf("\n");
-        //printf("hit_charge:    "); print256_as16_dec(hit_charge);    printf("\n");
-        //printf("to_add_tover:    "); print256_as16_dec(to_add_tover);    printf("\n");      
-        //printf("hit_tover:    "); print256_as16_dec(hit_tover);    printf("\n");      
-
-        // AAA: to be removed, just for debugging
-        //hit_charge = _mm256_set1_epi16(666);
-
-
-        // Store the end time of the hit, not the start
-        // time. Since we also have the time-over-threshold,
-        // we can calculate the absolute 64-bit start time in
-        // the caller. This saves faffing with hits that span
-        // a message boundary, hopefully
-
-        _mm256_storeu_si256(output_loc++, timenow); // NOLINT(runtime/increment_decrement)
-        // STORE_MASK(hit_charge);
-        _mm256_storeu_si256(output_loc++, // NOLINT(runtime/increment_decrement)
-                            _mm256_blendv_epi8(_mm256_set1_epi16(0), hit_charge, left));
-        _mm256_storeu_si256(output_loc++, hit_tover); // NOLINT(runtime/increment_decrement)
-
-        // reset hit_start, hit_charge and hit_tover in the channels we saved
+      // Only store the values if there are >0 hits ending on this sample
+      if (!_mm256_testz_si256(left, left)) {
+        // Write the hits that ended as packed (channel, end time,
+        // charge, time over threshold, peak ADC, peak time) tuples.
+        // Storing the end time of the hit, not the start time: since we
+        // also have the time-over-threshold, we can calculate the
+        // absolute 64-bit start time in the caller. Hits whose charge
+        // rounded down to zero are dropped
+        const __m256i fired = _mm256_andnot_si256(_mm256_cmpeq_epi16(hit_charge, _mm256_setzero_si256()), left);
+        nhits += swtpg_wib2::store_hits_avx2(
+          output_loc, fired, channels, timenow, hit_charge, hit_tover, hit_peak_adc, hit_peak_time);
+
+        // reset the hits in the channels whose hit ended
         const __m256i zero = _mm256_setzero_si256();
         hit_charge = _mm256_blendv_epi8(hit_charge, zero, left);
         hit_tover = _mm256_blendv_epi8(hit_tover, zero, left);
-      } // end if(!no_hits_to_store)
+        hit_peak_adc = _mm256_blendv_epi8(hit_peak_adc, zero, left);
+        hit_peak_time = _mm256_blendv_epi8(hit_peak_time, zero, left);
+      }
       //printf("nhits:          "); std::cout << (nhits) << std::endl;
 
 
@@ -293,30 +274,32 @@ process_window_rs_avx2(ProcessingInfo<NREGISTERS>& info, size_t channel_offset)
 
 
     // Store the state, ready for the next time round
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.pedestals) + ireg, median);      // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.quantile25) + ireg, quantile25); // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.quantile75) + ireg, quantile75); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.pedestals), median);      // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.quantile25), quantile25); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.quantile75), quantile75); // NOLINT
 
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum) + ireg, accum);     // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum25) + ireg, accum25); // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum75) + ireg, accum75); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum), accum);     // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum25), accum25); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum75), accum75); // NOLINT
 
 
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.RS) + ireg, RS);     // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.pedestalsRS) + ireg, medianRS); // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accumRS) + ireg, accumRS); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.RS), RS);     // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.pedestalsRS), medianRS); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accumRS), accumRS); // NOLINT
     
 
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.prev_was_over) + ireg, prev_was_over); // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_charge) + ireg, hit_charge);       // NOLINT
-    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_tover) + ireg, hit_tover);         // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.prev_was_over), prev_was_over); // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_charge), hit_charge);       // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_tover), hit_tover);         // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_peak_adc), hit_peak_adc);   // NOLINT
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_peak_time), hit_peak_time); // NOLINT
 
   } // end loop over ireg (the 8 registers in this frame)
 
 
-  // Store the output
-  for (int i = 0; i < 4; ++i) {
-    _mm256_storeu_si256(output_loc++, _mm256_set1_epi16(swtpg_wib2::MAGIC)); // NOLINT(runtime/increment_decrement)
+  // End the output with a tuple of MAGIC
+  for (size_t i = 0; i < HIT_TUPLE_SIZE; ++i) {
+    *output_loc++ = swtpg_wib2::MAGIC; // NOLINT(runtime/increment_decrement)
   }
 
   info.nhits = nhits;
@@ -325,7 +308,22 @@ process_window_rs_avx2(ProcessingInfo<NREGISTERS>& info, size_t channel_offset)
 
 } // NOLINT(readability/fn_size)
 
+// The "AbsRS" algorithm, as registered in KernelsAVX2.cpp
+struct AbsRSKernelAVX2
+{
+  static constexpr const char* name = "AbsRS";
+  using RegisterState = AbsRSRegisterState;
+
+  template<size_t NREGISTERS, typename SampleSource>
+  static void process(ProcessingInfo<NREGISTERS, RegisterState>& info, SampleSource&& get_sample)
+  {
+    process_window_rs_avx2(info, std::forward<SampleSource>(get_sample));
+  }
+};
+
 } // namespace swtpg_wib2
 
+#pragma GCC pop_options
+
 #endif // READOUT_SRC_WIB2_TPG_PROCESSRSAVX2_HPP_
 
@@ -0,0 +1,463 @@
+/**
+ * @file ProcessScalar.hpp
+ * Plain C++ versions of the SWTPG, AbsRS and FIR hit finding kernels,
+ * used on hosts without AVX2. They work one channel at a time, but
+ * reproduce the 16-bit arithmetic of process_window_avx2,
+ * process_window_rs_avx2 and process_window_fir_avx2 (wrap-around,
+ * saturation and rounding) exactly, and write the same
+ * hits, so the output doesn't depend on the instruction set the kernels
+ * were picked for
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#ifndef READOUT_SRC_WIB2_TPG_PROCESSSCALAR_HPP_
+#define READOUT_SRC_WIB2_TPG_PROCESSSCALAR_HPP_
+
+#include "FrameExpand.hpp"
+#include "ProcessingInfo.hpp"
+#include "TPGConstants_wib2.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+namespace swtpg_wib2 {
+
+// 16-bit arithmetic with the semantics of the corresponding AVX2 instructions
+inline int16_t
+wrap_epi16(int32_t x)
+{
+  return static_cast<int16_t>(static_cast<uint16_t>(x)); // NOLINT(build/unsigned)
+}
+
+inline int16_t
+adds_epi16(int16_t a, int16_t b)
+{
+  return static_cast<int16_t>(std::clamp<int32_t>(int32_t(a) + int32_t(b), INT16_MIN, INT16_MAX));
+}
+
+// _mm256_mulhrs_epi16
+inline int16_t
+mulhrs_epi16(int16_t a, int16_t b)
+{
+  return wrap_epi16(((int32_t(a) * int32_t(b) >> 14) + 1) >> 1);
+}
+
+// Scalar version of frugal_accum_update_avx2, for one channel. The
+// update only happens if `mask` is set
+inline void
+frugal_accum_update_scalar(int16_t& median, const int16_t s, int16_t& accum, const int16_t acclimit, const bool mask)
+{
+  if (!mask) {
+    return;
+  }
+  accum = wrap_epi16(accum + (s > median) - (s < median));
+  if (accum > acclimit) {
+    median = adds_epi16(median, 1);
+    accum = 0;
+  } else if (accum < -acclimit) {
+    median = adds_epi16(median, -1);
+    accum = 0;
+  }
+}
+
+// Write the hits ending at `itime` in register `ireg` as packed
+// (channel, end time, charge, time over threshold, peak ADC, peak time,
+// 0, 0) tuples, like store_hits_avx2. Returns the number of tuples
+// written
+inline int
+store_hits_scalar(uint16_t*& output_loc, // NOLINT(build/unsigned)
+                  size_t ireg,
+                  size_t itime,
+                  const bool* left,
+                  const int16_t* hit_charge,
+                  const int16_t* hit_tover,
+                  const int16_t* hit_peak_adc,
+                  const int16_t* hit_peak_time)
+{
+  int nhits = 0;
+  for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+    // Hits whose charge rounded down to zero are dropped
+    if (left[j] && hit_charge[j] != 0) {
+      output_loc[0] = ireg * SAMPLES_PER_REGISTER + j;
+      output_loc[1] = itime;
+      output_loc[2] = hit_charge[j];
+      output_loc[3] = hit_tover[j];
+      output_loc[4] = hit_peak_adc[j];
+      output_loc[5] = hit_peak_time[j];
+      output_loc[6] = 0;
+      output_loc[7] = 0;
+      output_loc += HIT_TUPLE_SIZE;
+      ++nhits;
+    }
+  }
+  return nhits;
+}
+
+// Add a tick over threshold, contributing `charge`, to the current hit
+// of a channel, keeping track of its peak `adc` like the SIMD kernels do
+inline void
+add_to_hit_scalar(int16_t& hit_charge,
+                  int16_t& hit_tover,
+                  int16_t& hit_peak_adc,
+                  int16_t& hit_peak_time,
+                  int16_t charge,
+                  int16_t adc)
+{
+  hit_charge = adds_epi16(hit_charge, charge);
+  if (adc > hit_peak_adc) {
+    hit_peak_adc = adc;
+    hit_peak_time = hit_tover;
+  }
+  hit_tover = adds_epi16(hit_tover, 1);
+}
+
+inline void
+store_magic_scalar(uint16_t* output_loc) // NOLINT(build/unsigned)
+{
+  std::fill_n(output_loc, HIT_TUPLE_SIZE, swtpg_wib2::MAGIC);
+}
+
+// The 16 samples of register ireg at time itime of the window, from a
+// register array filled by expand_wib2_adcs_scalar
+template<size_t NREGISTERS>
+inline const uint16_t* // NOLINT(build/unsigned)
+expanded_samples_scalar(const RegisterArray<NREGISTERS * FRAMES_PER_MSG>* input, size_t ireg, size_t itime)
+{
+  const size_t msg_index = itime / FRAMES_PER_MSG;
+  const size_t msg_time_offset = itime % FRAMES_PER_MSG;
+  const size_t index = msg_index * NREGISTERS * FRAMES_PER_MSG + FRAMES_PER_MSG * ireg + msg_time_offset;
+  return input->data() + index * SAMPLES_PER_REGISTER;
+}
+
+// The same samples, read straight from the frames of the window for
+// the fused kernels, like FrameSamplesAVX2
+class FrameSamplesScalar
+{
+public:
+  FrameSamplesScalar(const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs, size_t num_frames)
+    : m_frames(reinterpret_cast<const dunedaq::detdataformats::wib2::WIB2Frame*>(ucs)) // NOLINT
+    , m_num_frames(num_frames)
+  {}
+
+  inline const uint16_t* operator()(size_t ireg, size_t itime) // NOLINT(build/unsigned)
+  {
+    if (itime == 0) {
+      for (size_t iframe = 0; iframe < m_num_frames; ++iframe) {
+        for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+          m_block[iframe][j] = m_frames[iframe].get_adc(ireg * SAMPLES_PER_REGISTER + REGISTER_LANE_CHANNEL[j]);
+        }
+      }
+    }
+    return m_block[itime];
+  }
+
+private:
+  const dunedaq::detdataformats::wib2::WIB2Frame* m_frames;
+  size_t m_num_frames;
+  uint16_t m_block[FRAMES_PER_MSG * MAX_SUPERCHUNKS_PER_WINDOW][SAMPLES_PER_REGISTER]; // NOLINT(build/unsigned)
+};
+
+// Same conventions as process_window_avx2: get_samples(ireg, itime)
+// returns the 16 samples of register ireg at time itime, in the lane
+// order of unpack_one_register
+template<size_t NREGISTERS, typename SampleSource>
+inline void
+process_window_scalar(ProcessingInfo<NREGISTERS, SWTPGRegisterState>& info, SampleSource&& get_samples)
+{
+  const int16_t adcMax = info.adcMax;
+
+  uint16_t* output_loc = info.output; // NOLINT(build/unsigned)
+  int nhits = 0;
+
+  for (size_t ireg = info.first_register; ireg < info.last_register; ++ireg) {
+
+    SWTPGRegisterState& state = info.chanState[ireg];
+    int16_t* median = state.pedestals;
+    int16_t* accum = state.accum;
+    int16_t* hit_charge = state.hit_charge;
+    int16_t* hit_tover = state.hit_tover;
+    int16_t* hit_peak_adc = state.hit_peak_adc;
+    int16_t* hit_peak_time = state.hit_peak_time;
+    int16_t* prev_was_over = state.prev_was_over;
+    const int16_t* threshold = state.threshold;
+    const int16_t* active = state.active;
+
+    for (size_t itime = 0; itime < info.timeWindowNumFrames; ++itime) {
+      const uint16_t* samples = get_samples(ireg, itime); // NOLINT(build/unsigned)
+
+      bool left[SAMPLES_PER_REGISTER];
+      bool any_left = false;
+
+      for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+        int16_t s = samples[j];
+        frugal_accum_update_scalar(median[j], s, accum[j], 10, true);
+        s = std::min(wrap_epi16(s - median[j]), adcMax);
+
+        const bool is_over = active[j] && s > threshold[j];
+        left[j] = !is_over && prev_was_over[j];
+        any_left |= left[j];
+
+        if (is_over) {
+          add_to_hit_scalar(hit_charge[j], hit_tover[j], hit_peak_adc[j], hit_peak_time[j], s >> info.tap_exponent, s);
+        }
+        prev_was_over[j] = is_over ? -1 : 0;
+      }
+
+      if (any_left) {
+        nhits += store_hits_scalar(output_loc, ireg, itime, left, hit_charge, hit_tover, hit_peak_adc, hit_peak_time);
+        for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+          if (left[j]) {
+            hit_charge[j] = 0;
+            hit_tover[j] = 0;
+            hit_peak_adc[j] = 0;
+            hit_peak_time[j] = 0;
+          }
+        }
+      }
+    } // end loop over itime
+  }   // end loop over ireg
+
+  store_magic_scalar(output_loc);
+  info.nhits = nhits;
+}
+
+// Same conventions as process_window_rs_avx2
+template<size_t NREGISTERS, typename SampleSource>
+inline void
+process_window_rs_scalar(ProcessingInfo<NREGISTERS, AbsRSRegisterState>& info, SampleSource&& get_samples)
+{
+  // Running sum scaling factors, as in the AVX2 version
+  const int16_t R_factor = 8;
+  const int16_t scale_factor = 5;
+  const int16_t div_factor = 32768 / 10;
+
+  uint16_t* output_loc = info.output; // NOLINT(build/unsigned)
+  int nhits = 0;
+
+  for (size_t ireg = info.first_register; ireg < info.last_register; ++ireg) {
+
+    AbsRSRegisterState& state = info.chanState[ireg];
+    int16_t* median = state.pedestals;
+    int16_t* quantile25 = state.quantile25;
+    int16_t* quantile75 = state.quantile75;
+    int16_t* accum = state.accum;
+    int16_t* accum25 = state.accum25;
+    int16_t* accum75 = state.accum75;
+    int16_t* RS = state.RS;
+    int16_t* medianRS = state.pedestalsRS;
+    int16_t* accumRS = state.accumRS;
+    int16_t* hit_charge = state.hit_charge;
+    int16_t* hit_tover = state.hit_tover;
+    int16_t* hit_peak_adc = state.hit_peak_adc;
+    int16_t* hit_peak_time = state.hit_peak_time;
+    int16_t* prev_was_over = state.prev_was_over;
+    const int16_t* threshold = state.threshold;
+    const int16_t* active = state.active;
+    const int16_t* sigmaMax = state.sigma_max;
+
+    for (size_t itime = 0; itime < info.timeWindowNumFrames; ++itime) {
+      const uint16_t* samples = get_samples(ireg, itime); // NOLINT(build/unsigned)
+
+      bool left[SAMPLES_PER_REGISTER];
+      bool any_left = false;
+
+      for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+        int16_t s = samples[j];
+
+        // Pedestal finding/coherent noise removal and quantiles calculation
+        const bool is_gt = s > median[j];
+        const bool is_lt = s < median[j];
+        frugal_accum_update_scalar(quantile25[j], s, accum25[j], 10, is_lt);
+        frugal_accum_update_scalar(quantile75[j], s, accum75[j], 10, is_gt);
+        frugal_accum_update_scalar(median[j], s, accum[j], 10, true);
+        s = wrap_epi16(s - median[j]);
+
+        // Absolute running sum
+        const int16_t abs_s = wrap_epi16(std::abs(int32_t(s)));
+        RS[j] = mulhrs_epi16(wrap_epi16(wrap_epi16(RS[j] * R_factor) + wrap_epi16(abs_s * scale_factor)), div_factor);
+        frugal_accum_update_scalar(medianRS[j], RS[j], accumRS[j], 10, true);
+        RS[j] = wrap_epi16(RS[j] - medianRS[j]);
+
+        // Inter-quantile range
+        const int16_t sigma = std::min(wrap_epi16(quantile75[j] - quantile25[j]), sigmaMax[j]);
+
+        // Hit finding
+        const bool is_over = active[j] && RS[j] > wrap_epi16(sigma * threshold[j]);
+        left[j] = !is_over && prev_was_over[j];
+        any_left |= left[j];
+
+        if (is_over) {
+          const int16_t temp_charge = adds_epi16(RS[j], medianRS[j]);
+          add_to_hit_scalar(hit_charge[j],
+                            hit_tover[j],
+                            hit_peak_adc[j],
+                            hit_peak_time[j],
+                            temp_charge >> info.tap_exponent,
+                            temp_charge);
+        }
+        prev_was_over[j] = is_over ? -1 : 0;
+      }
+
+      if (any_left) {
+        nhits += store_hits_scalar(output_loc, ireg, itime, left, hit_charge, hit_tover, hit_peak_adc, hit_peak_time);
+        for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+          if (left[j]) {
+            hit_charge[j] = 0;
+            hit_tover[j] = 0;
+            hit_peak_adc[j] = 0;
+            hit_peak_time[j] = 0;
+          }
+        }
+      }
+    } // end loop over itime
+  }   // end loop over ireg
+
+  store_magic_scalar(output_loc);
+  info.nhits = nhits;
+}
+
+// Same conventions as process_window_fir_avx2, including the layout of
+// the filter history in prev_samp
+template<size_t NREGISTERS, typename SampleSource>
+inline void
+process_window_fir_scalar(ProcessingInfo<NREGISTERS, FIRRegisterState>& info, SampleSource&& get_samples)
+{
+  const size_t NTAPS = FIRState::NTAPS;
+
+  const int16_t adcMax = info.adcMax;
+
+  int16_t taps[NTAPS];
+  for (size_t i = 0; i < NTAPS; ++i) {
+    taps[i] = i < size_t(info.ntaps) ? info.taps[i] : 0;
+  }
+
+  uint16_t* output_loc = info.output; // NOLINT(build/unsigned)
+  int nhits = 0;
+
+  for (size_t ireg = info.first_register; ireg < info.last_register; ++ireg) {
+
+    uint16_t absTimeModNTAPS = info.absTimeModNTAPS; // NOLINT(build/unsigned)
+
+    FIRRegisterState& state = info.chanState[ireg];
+    int16_t* median = state.pedestals;
+    int16_t* quantile25 = state.quantile25;
+    int16_t* quantile75 = state.quantile75;
+    int16_t* accum = state.accum;
+    int16_t* accum25 = state.accum25;
+    int16_t* accum75 = state.accum75;
+    int16_t* hit_charge = state.hit_charge;
+    int16_t* hit_tover = state.hit_tover;
+    int16_t* hit_peak_adc = state.hit_peak_adc;
+    int16_t* hit_peak_time = state.hit_peak_time;
+    int16_t* prev_was_over = state.prev_was_over;
+    const int16_t* threshold = state.threshold;
+    const int16_t* active = state.active;
+    const int16_t* sigmaMax = state.sigma_max;
+    // prev_samp[k * SAMPLES_PER_REGISTER + j] is history slot k of lane j
+    int16_t* prev_samp = state.prev_samp;
+
+    for (size_t itime = 0; itime < info.timeWindowNumFrames; ++itime) {
+      const uint16_t* samples = get_samples(ireg, itime); // NOLINT(build/unsigned)
+
+      bool left[SAMPLES_PER_REGISTER];
+      bool any_left = false;
+
+      for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+        int16_t s = samples[j];
+
+        const bool is_gt = s > median[j];
+        const bool is_lt = s < median[j];
+        frugal_accum_update_scalar(quantile25[j], s, accum25[j], 10, is_lt);
+        frugal_accum_update_scalar(quantile75[j], s, accum75[j], 10, is_gt);
+        frugal_accum_update_scalar(median[j], s, accum[j], 10, true);
+        s = std::min(wrap_epi16(s - median[j]), adcMax);
+
+        const int16_t sigma = std::min(wrap_epi16(quantile75[j] - quantile25[j]), sigmaMax[j]);
+
+        // The AVX2 version adds up the products in a different order,
+        // which doesn't matter with wrap-around arithmetic
+        int16_t filt = 0;
+        for (size_t k = 0; k < NTAPS - 1; ++k) {
+          const int16_t prev = prev_samp[((k + absTimeModNTAPS) % NTAPS) * SAMPLES_PER_REGISTER + j];
+          filt = wrap_epi16(filt + wrap_epi16(taps[k] * prev));
+        }
+        prev_samp[absTimeModNTAPS * SAMPLES_PER_REGISTER + j] = s;
+
+        const bool is_over = active[j] && filt > wrap_epi16(sigma * wrap_epi16(info.multiplier * threshold[j]));
+        left[j] = !is_over && prev_was_over[j];
+        any_left |= left[j];
+
+        if (is_over) {
+          // filt is the filtered sample times the multiplier
+          const int16_t filt_adc = filt >> info.tap_exponent;
+          add_to_hit_scalar(hit_charge[j], hit_tover[j], hit_peak_adc[j], hit_peak_time[j], filt_adc, filt_adc);
+        }
+        prev_was_over[j] = is_over ? -1 : 0;
+      }
+      absTimeModNTAPS = (absTimeModNTAPS + 1) % NTAPS;
+
+      if (any_left) {
+        nhits += store_hits_scalar(output_loc, ireg, itime, left, hit_charge, hit_tover, hit_peak_adc, hit_peak_time);
+        for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+          if (left[j]) {
+            hit_charge[j] = 0;
+            hit_tover[j] = 0;
+            hit_peak_adc[j] = 0;
+            hit_peak_time[j] = 0;
+          }
+        }
+      }
+    } // end loop over itime
+  }   // end loop over ireg
+
+  info.absTimeModNTAPS = (info.absTimeModNTAPS + info.timeWindowNumFrames) % NTAPS;
+
+  store_magic_scalar(output_loc);
+  info.nhits = nhits;
+}
+
+// The "SWTPG" algorithm, as registered in KernelsScalar.cpp
+struct SWTPGKernelScalar
+{
+  static constexpr const char* name = "SWTPG";
+  using RegisterState = SWTPGRegisterState;
+
+  template<size_t NREGISTERS, typename SampleSource>
+  static void process(ProcessingInfo<NREGISTERS, RegisterState>& info, SampleSource&& get_sample)
+  {
+    process_window_scalar(info, std::forward<SampleSource>(get_sample));
+  }
+};
+
+// The "AbsRS" algorithm, as registered in KernelsScalar.cpp
+struct AbsRSKernelScalar
+{
+  static constexpr const char* name = "AbsRS";
+  using RegisterState = AbsRSRegisterState;
+
+  template<size_t NREGISTERS, typename SampleSource>
+  static void process(ProcessingInfo<NREGISTERS, RegisterState>& info, SampleSource&& get_sample)
+  {
+    process_window_rs_scalar(info, std::forward<SampleSource>(get_sample));
+  }
+};
+
+// The "FIR" algorithm, as registered in KernelsScalar.cpp
+struct FIRKernelScalar
+{
+  static constexpr const char* name = "FIR";
+  using RegisterState = FIRRegisterState;
+
+  template<size_t NREGISTERS, typename SampleSource>
+  static void process(ProcessingInfo<NREGISTERS, RegisterState>& info, SampleSource&& get_sample)
+  {
+    process_window_fir_scalar(info, std::forward<SampleSource>(get_sample));
+  }
+};
+
+} // namespace swtpg_wib2
+
+#endif // READOUT_SRC_WIB2_TPG_PROCESSSCALAR_HPP_
@@ -14,73 +14,121 @@
 #define BOOST_THREAD_PROVIDES_FUTURE_CONTINUATION
 #include <boost/thread/future.hpp>
 
+#include <algorithm>
+#include <array>
+#include <type_traits>
+
 namespace swtpg_wib2 {
 
-// The state variables for each channel in the link, saved from the last time
-template<size_t NREGISTERS>
-struct ChanState
+// The state of the 16 channels of one register, saved from the last
+// window. Each algorithm keeps only the fields its kernels use, put
+// together from the groups below (see SWTPGRegisterState and friends),
+// and the fields of a register are next to each other: its state is a
+// few contiguous cache lines instead of a line in each of a dozen arrays
+// spanning the whole link. Every field is one AVX2 register, with the
+// channels in the lane order of unpack_one_register
+
+// Pedestal subtraction
+struct PedestalState
 {
-  ChanState()
-  {
-    for (size_t i = 0; i < NREGISTERS * SAMPLES_PER_REGISTER; ++i) {
-      pedestals[i] = 0;
-      accum[i] = 0;
-      RS[i] = 0; 
-      pedestalsRS[i] = 0;
-      accumRS[i] = 0;
-      accum25[i] = 0;
-      accum75[i] = 0;
-      prev_was_over[i] = 0;
-      hit_charge[i] = 0;
-      hit_tover[i] = 0;
-      for (size_t j = 0; j < NTAPS; ++j) {
-        prev_samp[i * NTAPS + j] = 0;
-      }
-    }
-  }
+  alignas(32) int16_t pedestals[SAMPLES_PER_REGISTER];
+  alignas(32) int16_t accum[SAMPLES_PER_REGISTER];
+};
+
+// Inter-quartile range, for the algorithms whose threshold is in units of it
+struct IQRState
+{
+  alignas(32) int16_t accum25[SAMPLES_PER_REGISTER];
+  alignas(32) int16_t accum75[SAMPLES_PER_REGISTER];
+  alignas(32) int16_t quantile25[SAMPLES_PER_REGISTER];
+  alignas(32) int16_t quantile75[SAMPLES_PER_REGISTER];
+  // The largest sigma that the threshold can be multiplied by without
+  // overflowing. See ProcessingInfo::setChannelThreshold
+  alignas(32) int16_t sigma_max[SAMPLES_PER_REGISTER];
+};
 
+// Absolute running sum
+struct RSState
+{
+  alignas(32) int16_t RS[SAMPLES_PER_REGISTER];
+  alignas(32) int16_t pedestalsRS[SAMPLES_PER_REGISTER];
+  alignas(32) int16_t accumRS[SAMPLES_PER_REGISTER];
+};
+
+// Filtering
+struct FIRState
+{
   // TODO: DRY July-22-2021 Philip Rodrigues (rodriges@fnal.gov)
   static const int NTAPS = 8;
 
-  alignas(32) int16_t __restrict__ pedestals[NREGISTERS * SAMPLES_PER_REGISTER];
-  alignas(32) int16_t __restrict__ accum[NREGISTERS * SAMPLES_PER_REGISTER];
-  
-  //Variables for running sum
-  alignas(32) int16_t __restrict__ RS[NREGISTERS * SAMPLES_PER_REGISTER];
-  alignas(32) int16_t __restrict__ pedestalsRS[NREGISTERS * SAMPLES_PER_REGISTER];
-  alignas(32) int16_t __restrict__ accumRS[NREGISTERS * SAMPLES_PER_REGISTER];
-
-  //Variables for IQR
-  alignas(32) int16_t __restrict__ accum25[NREGISTERS * SAMPLES_PER_REGISTER];
-  alignas(32) int16_t __restrict__ accum75[NREGISTERS * SAMPLES_PER_REGISTER];
-  
-  alignas(32) int16_t __restrict__ quantile25[NREGISTERS * SAMPLES_PER_REGISTER];
-  alignas(32) int16_t __restrict__ quantile75[NREGISTERS * SAMPLES_PER_REGISTER];
-
-  // Variables for filtering
-  alignas(32) int16_t __restrict__ prev_samp[NREGISTERS * SAMPLES_PER_REGISTER * NTAPS];
-
-  // Variables for hit finding
-  alignas(32) int16_t
-    __restrict__ prev_was_over[NREGISTERS * SAMPLES_PER_REGISTER]; // was the previous sample over threshold?
-  alignas(32) int16_t __restrict__ hit_charge[NREGISTERS * SAMPLES_PER_REGISTER];
-  alignas(32) int16_t __restrict__ hit_tover[NREGISTERS * SAMPLES_PER_REGISTER]; // time over threshold
+  // prev_samp[k * SAMPLES_PER_REGISTER + j] is history slot k of lane j
+  alignas(32) int16_t prev_samp[NTAPS * SAMPLES_PER_REGISTER];
+};
+
+// Hit finding
+struct HitState
+{
+  alignas(32) int16_t prev_was_over[SAMPLES_PER_REGISTER]; // was the previous sample over threshold?
+  alignas(32) int16_t hit_charge[SAMPLES_PER_REGISTER];
+  alignas(32) int16_t hit_tover[SAMPLES_PER_REGISTER]; // time over threshold
+  // The largest contribution to the charge of the current hit, and when
+  // it came, in ticks from the start of the hit
+  alignas(32) int16_t hit_peak_adc[SAMPLES_PER_REGISTER];
+  alignas(32) int16_t hit_peak_time[SAMPLES_PER_REGISTER];
+  // Per-channel thresholds, in the units of ProcessingInfo::threshold
+  alignas(32) int16_t threshold[SAMPLES_PER_REGISTER];
+  // -1 (all bits set) in the channels that may have hits, 0 in the
+  // masked ones. The kernels AND it into their is_over mask
+  alignas(32) int16_t active[SAMPLES_PER_REGISTER];
 };
 
+struct alignas(64) SWTPGRegisterState
+  : PedestalState
+  , HitState
+{};
+
+struct alignas(64) AbsRSRegisterState
+  : PedestalState
+  , IQRState
+  , RSState
+  , HitState
+{};
+
+struct alignas(64) FIRRegisterState
+  : PedestalState
+  , IQRState
+  , FIRState
+  , HitState
+{};
+
+// The pedestal and quartiles of every channel of the registers, indexed
+// by position in the registers as in ProcessingInfo::setChannelThreshold
 template<size_t NREGISTERS>
-struct ProcessingInfo
+struct ChannelPedestals
 {
-  ProcessingInfo(const RegisterArray<NREGISTERS * FRAMES_PER_MSG>* __restrict__ input_,
-                 size_t timeWindowNumFrames_,
-                 uint8_t first_register_,           // NOLINT
-                 uint8_t last_register_,            // NOLINT
-                 uint16_t* __restrict__ output_,    // NOLINT
-                 const int16_t* __restrict__ taps_, // NOLINT
-                 int16_t ntaps_,
-                 const uint8_t tap_exponent_, // NOLINT
-                 uint16_t threshold_,         // NOLINT
-                 size_t nhits_,
-                 uint16_t absTimeModNTAPS_) // NOLINT
+  std::array<int16_t, NREGISTERS * SAMPLES_PER_REGISTER> median;
+  std::array<int16_t, NREGISTERS * SAMPLES_PER_REGISTER> quantile25;
+  std::array<int16_t, NREGISTERS * SAMPLES_PER_REGISTER> quantile75;
+};
+
+// The parameters of the hit finding, common to all the algorithms, and
+// the set up of the channel state, which depends on the algorithm. Made
+// by TPGAlgorithm::make_processing_info, and given to the kernels of the
+// same algorithm, which see it as the ProcessingInfo below
+template<size_t NREGISTERS>
+struct ProcessingInfoBase
+{
+  ProcessingInfoBase(const RegisterArray<NREGISTERS * FRAMES_PER_MSG>* __restrict__ input_,
+                     size_t timeWindowNumFrames_,
+                     uint8_t first_register_,           // NOLINT
+                     uint8_t last_register_,            // NOLINT
+                     uint16_t* __restrict__ output_,    // NOLINT
+                     const int16_t* __restrict__ taps_, // NOLINT
+                     int16_t ntaps_,
+                     const uint8_t tap_exponent_, // NOLINT
+                     uint16_t threshold_,         // NOLINT
+                     size_t nhits_,
+                     uint16_t absTimeModNTAPS_) // NOLINT
     : input(input_)
     , timeWindowNumFrames(timeWindowNumFrames_)
     , first_register(first_register_)
@@ -96,49 +144,31 @@ struct ProcessingInfo
     , absTimeModNTAPS(absTimeModNTAPS_)
   {}
 
+  virtual ~ProcessingInfoBase() = default;
 
-  // Set the initial state from the window starting at first_msg_p
-  template<size_t N>
-  void setState(const RegisterArray<N>& first_tick_registers)
-  {
-    static_assert(N >= NREGISTERS, "Wrong array size");
-
-    // AAA: Loop through all the registers, loop through all the channels, look at the 
-    // first message of the superchunk and read the ADC value. This will be used as the 
-    // pedestal for the channel state
-    for (size_t j = 0; j < NREGISTERS * SAMPLES_PER_REGISTER; ++j) {
-      const size_t register_offset = j % SAMPLES_PER_REGISTER; 
-      const size_t register_index = j / SAMPLES_PER_REGISTER;
-      const size_t register_t0_start = register_index * SAMPLES_PER_REGISTER * FRAMES_PER_MSG;
-
-      int16_t ped=0;
-      for (size_t itime = 0; itime < timeWindowNumFrames; ++itime) {
-        const size_t msg_index = itime / 12;
-        const size_t msg_time_offset = itime % 12;
-        // The index in uint16_t of the start of the message we want.         
-        const size_t msg_start_index = msg_index * swtpg_wib2::ADCS_SIZE / sizeof(uint16_t); // NOLINT
-        const size_t offset_within_msg = register_t0_start + SAMPLES_PER_REGISTER * msg_time_offset + register_offset;
-        const size_t index = msg_start_index + offset_within_msg;
+  // Set the initial state from the first tick of the expanded registers
+  virtual void setState(const RegisterArray<NREGISTERS * FRAMES_PER_MSG>& first_tick_registers) = 0;
 
-        const uint16_t* input16 = first_tick_registers.data(); // NOLINT
+  // Set the threshold of the channel at position j of the registers,
+  // replacing the default one given to the constructor. The kernels load
+  // the thresholds with the rest of the channel state
+  virtual void setChannelThreshold(size_t j, uint16_t channel_threshold) = 0; // NOLINT(build/unsigned)
 
-        ped = input16[index];
+  // Mask, or unmask, the channel at position j of the registers. The
+  // kernels never find hits in masked channels. All the channels start
+  // unmasked
+  virtual void setChannelMasked(size_t j, bool masked) = 0;
 
-        break; // breaking in order to select only the first entry
-      }
+  // Replace the pedestals and quartiles of the registers handled by this
+  // ProcessingInfo, eg with ones measured over many ticks, or kept from
+  // the previous run. The quartiles are ignored by the algorithms that
+  // don't use them
+  virtual void setPedestals(const ChannelPedestals<NREGISTERS>& pedestals) = 0;
 
-      // Set the pedestals and the 25/75-percentiles
-      chanState.pedestals[j] = ped;
-      chanState.pedestalsRS[j] = 0;
-      chanState.RS[j] = 0;
-      // AAA: Quantiles are set to the pedestal value +/- 20 so that the IQR 
-      // becomes above the RMS value of the input ADCs. We use the frugal 
-      // streaming on the 25th/75th quantiles so that the IQR becomes
-      // a good estimate of the RMS of the input. 
-      chanState.quantile25[j] = ped-20;
-      chanState.quantile75[j] = ped+20;
-    }
-  }  
+  // The current pedestals and quartiles of the registers handled by this
+  // ProcessingInfo. The quartiles are those of setState for the
+  // algorithms that don't use them
+  virtual void getPedestals(ChannelPedestals<NREGISTERS>& pedestals) const = 0;
 
   const RegisterArray<NREGISTERS * FRAMES_PER_MSG>* __restrict__ input;
   size_t timeWindowNumFrames;
@@ -153,7 +183,120 @@ struct ProcessingInfo
   int16_t adcMax;
   size_t nhits;
   uint16_t absTimeModNTAPS; // NOLINT
-  ChanState<NREGISTERS> chanState;
+};
+
+// The ProcessingInfo of the algorithms whose kernels keep the state of
+// each register in a RegisterState
+template<size_t NREGISTERS, typename RegisterState>
+struct ProcessingInfo : public ProcessingInfoBase<NREGISTERS>
+{
+  ProcessingInfo(const RegisterArray<NREGISTERS * FRAMES_PER_MSG>* __restrict__ input_,
+                 size_t timeWindowNumFrames_,
+                 uint8_t first_register_,           // NOLINT
+                 uint8_t last_register_,            // NOLINT
+                 uint16_t* __restrict__ output_,    // NOLINT
+                 const int16_t* __restrict__ taps_, // NOLINT
+                 int16_t ntaps_,
+                 const uint8_t tap_exponent_, // NOLINT
+                 uint16_t threshold_,         // NOLINT
+                 size_t nhits_,
+                 uint16_t absTimeModNTAPS_) // NOLINT
+    : ProcessingInfoBase<NREGISTERS>(input_,
+                                     timeWindowNumFrames_,
+                                     first_register_,
+                                     last_register_,
+                                     output_,
+                                     taps_,
+                                     ntaps_,
+                                     tap_exponent_,
+                                     threshold_,
+                                     nhits_,
+                                     absTimeModNTAPS_)
+  {
+    for (size_t j = 0; j < NREGISTERS * SAMPLES_PER_REGISTER; ++j) {
+      setChannelThreshold(j, this->threshold);
+      setChannelMasked(j, false);
+    }
+  }
+
+  void setChannelMasked(size_t j, bool masked) override
+  {
+    chanState[j / SAMPLES_PER_REGISTER].active[j % SAMPLES_PER_REGISTER] = masked ? 0 : -1;
+  }
+
+  void setChannelThreshold(size_t j, uint16_t channel_threshold) override // NOLINT(build/unsigned)
+  {
+    RegisterState& state = chanState[j / SAMPLES_PER_REGISTER];
+    state.threshold[j % SAMPLES_PER_REGISTER] = channel_threshold;
+    if constexpr (std::is_base_of_v<IQRState, RegisterState>) {
+      // At least 1, or a threshold over 512 would pin sigma, and the cut,
+      // to 0
+      state.sigma_max[j % SAMPLES_PER_REGISTER] =
+        channel_threshold > 0 ? std::max((1 << 15) / (this->multiplier * channel_threshold), 1) : INT16_MAX;
+    }
+  }
+
+  void setState(const RegisterArray<NREGISTERS * FRAMES_PER_MSG>& first_tick_registers) override
+  {
+    // AAA: Loop through all the registers, loop through all the channels, look at the 
+    // first message of the superchunk and read the ADC value. This will be used as the 
+    // pedestal for the channel state. Only the registers handled by this
+    // ProcessingInfo are touched: the others may not have been expanded
+    for (size_t j = this->first_register * SAMPLES_PER_REGISTER; j < this->last_register * SAMPLES_PER_REGISTER; ++j) {
+      const size_t register_offset = j % SAMPLES_PER_REGISTER; 
+      const size_t register_index = j / SAMPLES_PER_REGISTER;
+      const size_t register_t0_start = register_index * SAMPLES_PER_REGISTER * FRAMES_PER_MSG;
+
+      // The first tick of the superchunk
+      const uint16_t* input16 = first_tick_registers.data(); // NOLINT
+      const int16_t ped = input16[register_t0_start + register_offset];
+
+      // Set the pedestals and the 25/75-percentiles
+      RegisterState& state = chanState[register_index];
+      state.pedestals[register_offset] = ped;
+      if constexpr (std::is_base_of_v<RSState, RegisterState>) {
+        state.pedestalsRS[register_offset] = 0;
+        state.RS[register_offset] = 0;
+      }
+      if constexpr (std::is_base_of_v<IQRState, RegisterState>) {
+        // AAA: Quantiles are set to the pedestal value +/- 20 so that the IQR 
+        // becomes above the RMS value of the input ADCs. We use the frugal 
+        // streaming on the 25th/75th quantiles so that the IQR becomes
+        // a good estimate of the RMS of the input. 
+        state.quantile25[register_offset] = ped - 20;
+        state.quantile75[register_offset] = ped + 20;
+      }
+    }
+  }
+
+  void setPedestals(const ChannelPedestals<NREGISTERS>& pedestals) override
+  {
+    for (size_t j = this->first_register * SAMPLES_PER_REGISTER; j < this->last_register * SAMPLES_PER_REGISTER; ++j) {
+      RegisterState& state = chanState[j / SAMPLES_PER_REGISTER];
+      state.pedestals[j % SAMPLES_PER_REGISTER] = pedestals.median[j];
+      if constexpr (std::is_base_of_v<IQRState, RegisterState>) {
+        state.quantile25[j % SAMPLES_PER_REGISTER] = pedestals.quantile25[j];
+        state.quantile75[j % SAMPLES_PER_REGISTER] = pedestals.quantile75[j];
+      }
+    }
+  }
+
+  void getPedestals(ChannelPedestals<NREGISTERS>& pedestals) const override
+  {
+    for (size_t j = this->first_register * SAMPLES_PER_REGISTER; j < this->last_register * SAMPLES_PER_REGISTER; ++j) {
+      const RegisterState& state = chanState[j / SAMPLES_PER_REGISTER];
+      pedestals.median[j] = state.pedestals[j % SAMPLES_PER_REGISTER];
+      if constexpr (std::is_base_of_v<IQRState, RegisterState>) {
+        pedestals.quantile25[j] = state.quantile25[j % SAMPLES_PER_REGISTER];
+        pedestals.quantile75[j] = state.quantile75[j % SAMPLES_PER_REGISTER];
+      } else {
+        pedestals.quantile25[j] = state.pedestals[j % SAMPLES_PER_REGISTER] - 20;
+        pedestals.quantile75[j] = state.pedestals[j % SAMPLES_PER_REGISTER] + 20;
+      }
+    }
+  }
+
+  std::array<RegisterState, NREGISTERS> chanState{};
 };
 
 } // namespace swtpg_wib2
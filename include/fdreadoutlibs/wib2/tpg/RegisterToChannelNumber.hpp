@@ -12,7 +12,7 @@
 #include "detchannelmaps/TPCChannelMap.hpp"
 #include "detdataformats/wib2/WIB2Frame.hpp"
 #include "readoutlibs/ReadoutTypes.hpp"
-#include "FrameExpand.hpp"
+#include "KernelDispatch.hpp"
 #include "TPGConstants_wib2.hpp"
 
 #include <boost/chrono/duration.hpp>
@@ -33,26 +33,25 @@ struct RegisterChannelMap
  * registers in some order that is convenient for the expansion code,
  * but doesn't have any particular pattern to it. So we need to map
  * from position-in-register to offline channel number. This function
- * creates that map
+ * creates that map for the frames of the given crate, slot and link
  */
-RegisterChannelMap
-get_register_to_offline_channel_map_wib2(const dunedaq::detdataformats::wib2::WIB2Frame* frame,
-                                    std::shared_ptr<dunedaq::detchannelmaps::TPCChannelMap>& ch_map,
-                                    int registers_selection
-                                    )
+inline RegisterChannelMap
+get_register_to_offline_channel_map_wib2(uint crate,
+                                         uint slot,
+                                         uint link,
+                                         std::shared_ptr<dunedaq::detchannelmaps::TPCChannelMap>& ch_map)
 {
   auto start_time = std::chrono::steady_clock::now();
 
-  // Find the lowest offline channel number of all the channels in the input frame
+  // Find the lowest offline channel number of all the channels of the link
   uint min_ch = UINT_MAX;
   for (size_t ich = 0; ich < dunedaq::detdataformats::wib2::WIB2Frame::s_num_ch_per_frame; ++ich) {
-    auto offline_ch = ch_map->get_offline_channel_from_crate_slot_fiber_chan(
-      frame->header.crate, frame->header.slot, frame->header.link, ich);
+    auto offline_ch = ch_map->get_offline_channel_from_crate_slot_fiber_chan(crate, slot, link, ich);
     TLOG_DEBUG(TLVL_BOOKKEEPING) << " offline_ch " << offline_ch; 
     min_ch = std::min(min_ch, offline_ch);
   }
-  TLOG() << "get_register_to_offline_channel_map_wib2 for crate " << frame->header.crate << " slot "
-                << frame->header.slot << " link " << frame->header.link << ". min_ch is "
+  TLOG() << "get_register_to_offline_channel_map_wib2 for crate " << crate << " slot "
+                << slot << " link " << link << ". min_ch is "
                 << min_ch;
   // Now set each of the channels in our test frame to their
   // corresponding offline channel number, minus the minimum channel
@@ -64,14 +63,15 @@ get_register_to_offline_channel_map_wib2(const dunedaq::detdataformats::wib2::WI
   dunedaq::detdataformats::wib2::WIB2Frame* test_frame =
     reinterpret_cast<dunedaq::detdataformats::wib2::WIB2Frame*>(&superchunk);
   for (size_t ich = 0; ich < dunedaq::detdataformats::wib2::WIB2Frame::s_num_ch_per_frame; ++ich) {
-    auto offline_ch = ch_map->get_offline_channel_from_crate_slot_fiber_chan(
-      frame->header.crate, frame->header.slot, frame->header.link, ich);
+    auto offline_ch = ch_map->get_offline_channel_from_crate_slot_fiber_chan(crate, slot, link, ich);
       test_frame->set_adc(ich, offline_ch - min_ch);
   }
 
-  // Expand the test frame, so the offline channel numbers are now in the relevant places in the output registers
+  // Expand the test frame, so the offline channel numbers are now in the relevant places in the output registers.
+  // The whole frame is expanded, so the map covers all the channels, whichever frame handler processes them.
+  // The lanes are numbered in the same way by the kernels of all the instruction sets
   swtpg_wib2::MessageRegisters register_array;
-  expand_wib2_adcs(&superchunk, &register_array, registers_selection); 
+  expand_wib2_adcs_scalar(&superchunk, &register_array, 0, swtpg_wib2::NUM_REGISTERS_PER_FRAME);
 
 
   RegisterChannelMap ret;
@@ -90,11 +90,19 @@ get_register_to_offline_channel_map_wib2(const dunedaq::detdataformats::wib2::WI
   return ret;
 }
 
-RegisterChannelMap
-get_register_to_offline_channel_map_wib2(const dunedaq::detdataformats::wib2::WIB2Frame* frame, std::string channel_map_name, int registers_selection)
+// The map for the crate, slot and link of the given frame
+inline RegisterChannelMap
+get_register_to_offline_channel_map_wib2(const dunedaq::detdataformats::wib2::WIB2Frame* frame,
+                                         std::shared_ptr<dunedaq::detchannelmaps::TPCChannelMap>& ch_map)
+{
+  return get_register_to_offline_channel_map_wib2(frame->header.crate, frame->header.slot, frame->header.link, ch_map);
+}
+
+inline RegisterChannelMap
+get_register_to_offline_channel_map_wib2(const dunedaq::detdataformats::wib2::WIB2Frame* frame, std::string channel_map_name)
 {
   auto ch_map = dunedaq::detchannelmaps::make_map(channel_map_name);
-  return get_register_to_offline_channel_map_wib2(frame, ch_map, registers_selection);
+  return get_register_to_offline_channel_map_wib2(frame, ch_map);
 }
 
 
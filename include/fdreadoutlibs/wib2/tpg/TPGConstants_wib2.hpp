@@ -25,12 +25,22 @@ const constexpr std::uint16_t MAGIC = std::numeric_limits<std::uint16_t>::max();
 
 const constexpr std::int16_t THRESHOLD = 2000;
 
+// The hit finding kernels write one tuple of 8 uint16_t per hit:
+// channel (position in the expanded registers), end time, charge, time
+// over threshold, peak ADC, time of the peak counted from the start of
+// the hit, and two unused slots, always 0. The output ends with a tuple
+// of MAGIC
+const constexpr std::size_t HIT_TUPLE_SIZE = 8;
+
 // How many frames are concatenated in one netio message
 const constexpr std::size_t FRAMES_PER_MSG = 12;
 
-// How many AVX2 registers are returned per frame.
-// Maximum is 16
-const constexpr std::size_t NUM_REGISTERS_PER_FRAME = 8;
+// Most superchunks the fused kernels can process in one time window
+const constexpr std::size_t MAX_SUPERCHUNKS_PER_WINDOW = 16;
+
+// How many AVX2 registers are needed to hold all the channels of a frame.
+// Frame handlers process a contiguous range of these registers
+const constexpr std::size_t NUM_REGISTERS_PER_FRAME = 16;
 
 // How many bytes are in an AVX2 register
 const constexpr std::size_t BYTES_PER_REGISTER = 32;
@@ -38,8 +48,30 @@ const constexpr std::size_t BYTES_PER_REGISTER = 32;
 // How many samples are in a register
 const constexpr std::size_t SAMPLES_PER_REGISTER = 16;
 
+// The channel of each 16-channel block of the frame that ends up in
+// each lane of the register expanded by unpack_one_register: the 16th
+// ADC of the block is in lane 8
+const constexpr std::size_t REGISTER_LANE_CHANNEL[SAMPLES_PER_REGISTER] = { 0, 1, 2,  3,  4,  5,  6,  7,
+                                                                            15, 8, 9, 10, 11, 12, 13, 14 };
+
+// How many AVX-512 registers are needed to hold all the channels of a
+// frame. Each one covers two adjacent AVX2 registers
+const constexpr std::size_t NUM_REGISTERS_PER_FRAME_AVX512 = 8;
+
+// How many samples are in an AVX-512 register
+const constexpr std::size_t SAMPLES_PER_REGISTER_AVX512 = 32;
+
+// Most hits the kernels can write for a time window of num_frames
+// ticks. A hit ends on a tick under threshold that follows one over it,
+// so no channel has hits ending on two consecutive ticks
+constexpr std::size_t
+max_hits_per_window(std::size_t num_frames)
+{
+  return NUM_REGISTERS_PER_FRAME * SAMPLES_PER_REGISTER * (num_frames / 2 + 1);
+}
+
 // One netio message's worth of channel ADCs after
-// expansion: 12 frames per message times 8 registers per frame times
+// expansion: 12 frames per message times 16 registers per frame times
 // 32 bytes (256 bits) per register
 const constexpr std::size_t ADCS_SIZE = BYTES_PER_REGISTER * NUM_REGISTERS_PER_FRAME * FRAMES_PER_MSG;
 
@@ -10,9 +10,15 @@
 #ifndef READOUT_SRC_WIB2_TPG_UTILSAVX2_HPP_
 #define READOUT_SRC_WIB2_TPG_UTILSAVX2_HPP_
 
+#include "TPGConstants_wib2.hpp"
 
+#include <cstdint>
 #include <immintrin.h>
 
+// Built for AVX2, see FrameExpand.hpp
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
 namespace swtpg_wib2 {
 
 inline void
@@ -74,6 +80,59 @@ frugal_accum_update_avx2(__m256i& __restrict__ median,
   accum = _mm256_blendv_epi8(accum, _mm256_setzero_si256(), need_reset);
 }
 
+// Store the channels set in `fired` as packed (channel, end time,
+// charge, time over threshold, peak ADC, peak time, 0, 0) tuples, and
+// advance output_loc past them, in channel order like
+// store_hits_scalar. Returns the number of tuples written
+inline int
+store_hits_avx2(uint16_t*& output_loc, // NOLINT(build/unsigned)
+                const __m256i fired,
+                const __m256i channels,
+                const __m256i timenow,
+                const __m256i hit_charge,
+                const __m256i hit_tover,
+                const __m256i hit_peak_adc,
+                const __m256i hit_peak_time)
+{
+  // Interleave into 64-bit half tuples. The unpacks work within each
+  // 128-bit lane, so halves[i] holds the channels 2i, 2i+1, 2i+8 and 2i+9
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i chan_time_lo = _mm256_unpacklo_epi16(channels, timenow);
+  const __m256i chan_time_hi = _mm256_unpackhi_epi16(channels, timenow);
+  const __m256i charge_tover_lo = _mm256_unpacklo_epi16(hit_charge, hit_tover);
+  const __m256i charge_tover_hi = _mm256_unpackhi_epi16(hit_charge, hit_tover);
+  const __m256i peak_lo = _mm256_unpacklo_epi16(hit_peak_adc, hit_peak_time);
+  const __m256i peak_hi = _mm256_unpackhi_epi16(hit_peak_adc, hit_peak_time);
+  const __m256i halves[4] = { _mm256_unpacklo_epi32(chan_time_lo, charge_tover_lo),
+                              _mm256_unpackhi_epi32(chan_time_lo, charge_tover_lo),
+                              _mm256_unpacklo_epi32(chan_time_hi, charge_tover_hi),
+                              _mm256_unpackhi_epi32(chan_time_hi, charge_tover_hi) };
+  const __m256i peak_halves[4] = { _mm256_unpacklo_epi32(peak_lo, zero),
+                                   _mm256_unpackhi_epi32(peak_lo, zero),
+                                   _mm256_unpacklo_epi32(peak_hi, zero),
+                                   _mm256_unpackhi_epi32(peak_hi, zero) };
+
+  // One bit per channel. The pack works within 128-bit lanes too:
+  // channels 0-7 end up in bits 0-7 of the movemask, 8-15 in bits 16-23
+  const uint32_t bytes = _mm256_movemask_epi8(_mm256_packs_epi16(fired, fired)); // NOLINT(build/unsigned)
+  const uint32_t lanes = (bytes & 0xffu) | ((bytes >> 8) & 0xff00u);            // NOLINT(build/unsigned)
+
+  // Whole tuples: tuples[c][k] is the one of the channel c + 8k
+  alignas(32) uint16_t tuples[8][2][HIT_TUPLE_SIZE]; // NOLINT(build/unsigned)
+  for (int c = 0; c < 8; ++c) {
+    const __m256i pair = (c % 2 == 0) ? _mm256_unpacklo_epi64(halves[c / 2], peak_halves[c / 2])
+                                      : _mm256_unpackhi_epi64(halves[c / 2], peak_halves[c / 2]);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(tuples[c]), pair); // NOLINT
+  }
+  for (uint32_t bits = lanes; bits != 0; bits &= bits - 1) { // NOLINT(build/unsigned)
+    const int j = __builtin_ctz(bits);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output_loc), // NOLINT
+                     _mm_load_si128(reinterpret_cast<const __m128i*>(tuples[j % 8][j / 8]))); // NOLINT
+    output_loc += HIT_TUPLE_SIZE;
+  }
+  return __builtin_popcount(lanes);
+}
+
 // Perform the division of __m256i with a const int
 inline __m256i _mm256_div_epi16 (const __m256i va, const int b)
 {
@@ -83,4 +142,7 @@ inline __m256i _mm256_div_epi16 (const __m256i va, const int b)
 
 
 }
+
+#pragma GCC pop_options
+
 #endif // READOUT_SRC_WIB2_TPG_UTILSAVX2_HPP_
@@ -0,0 +1,148 @@
+/**
+ * @file UtilsAVX512.hpp
+ * Utility methods based on AVX-512
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#ifndef READOUT_SRC_WIB2_TPG_UTILSAVX512_HPP_
+#define READOUT_SRC_WIB2_TPG_UTILSAVX512_HPP_
+
+#include "TPGConstants_wib2.hpp"
+
+#include <cstdint>
+#include <immintrin.h>
+
+// Built for AVX-512, see FrameExpand.hpp
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+// The AVX-512 intrinsics of GCC start from _mm512_undefined_epi32(),
+// which -Wmaybe-uninitialized reports once they are inlined
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+namespace swtpg_wib2 {
+
+inline void
+frugal_accum_update_avx512(__m512i& __restrict__ median,
+                           const __m512i s,
+                           __m512i& __restrict__ accum,
+                           const int16_t acclimit,
+                           const __mmask32 mask) __attribute__((always_inline));
+
+// AVX-512 version of frugal_accum_update_avx2. The comparisons produce
+// mask registers directly, so there is no blending against all-ones
+// vectors: the updates are just masked adds
+inline void
+frugal_accum_update_avx512(__m512i& __restrict__ median,
+                           const __m512i s,
+                           __m512i& __restrict__ accum,
+                           const int16_t acclimit,
+                           const __mmask32 mask)
+{
+  const __m512i one = _mm512_set1_epi16(1);
+
+  // if the sample is greater than the median, add one to the accumulator
+  // if the sample is less than the median, subtract one from the accumulator.
+  __mmask32 is_gt = _mm512_cmpgt_epi16_mask(s, median);
+  __mmask32 is_lt = _mm512_cmplt_epi16_mask(s, median);
+
+  accum = _mm512_mask_add_epi16(accum, is_gt & mask, accum, one);
+  accum = _mm512_mask_sub_epi16(accum, is_lt & mask, accum, one);
+
+  // if the accumulator is >acclimit, add one to the median and
+  // set the accumulator to zero. if the accumulator is
+  // <-acclimit, subtract one from the median and set the
+  // accumulator to zero
+  is_gt = _mm512_cmpgt_epi16_mask(accum, _mm512_set1_epi16(acclimit)) & mask;
+  is_lt = _mm512_cmplt_epi16_mask(accum, _mm512_set1_epi16(-1 * acclimit)) & mask;
+
+  median = _mm512_mask_adds_epi16(median, is_gt, median, one);
+  median = _mm512_mask_subs_epi16(median, is_lt, median, one);
+
+  accum = _mm512_mask_mov_epi16(accum, is_gt | is_lt, _mm512_setzero_si512());
+}
+
+// AVX-512 version of store_hits_avx2: store the channels set in
+// `fired` as packed (channel, end time, charge, time over threshold,
+// peak ADC, peak time, 0, 0) tuples and advance output_loc past them,
+// in channel order. Returns the number of tuples written
+inline int
+store_hits_avx512(uint16_t*& output_loc, // NOLINT(build/unsigned)
+                  const __mmask32 fired,
+                  const __m512i channels,
+                  const __m512i timenow,
+                  const __m512i hit_charge,
+                  const __m512i hit_tover,
+                  const __m512i hit_peak_adc,
+                  const __m512i hit_peak_time)
+{
+  // Interleave into 64-bit half tuples. The unpacks work within each
+  // 128-bit lane, so halves[i] holds the channels 2i+8k and 2i+8k+1,
+  // k=0..3
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i chan_time_lo = _mm512_unpacklo_epi16(channels, timenow);
+  const __m512i chan_time_hi = _mm512_unpackhi_epi16(channels, timenow);
+  const __m512i charge_tover_lo = _mm512_unpacklo_epi16(hit_charge, hit_tover);
+  const __m512i charge_tover_hi = _mm512_unpackhi_epi16(hit_charge, hit_tover);
+  const __m512i peak_lo = _mm512_unpacklo_epi16(hit_peak_adc, hit_peak_time);
+  const __m512i peak_hi = _mm512_unpackhi_epi16(hit_peak_adc, hit_peak_time);
+  const __m512i halves[4] = { _mm512_unpacklo_epi32(chan_time_lo, charge_tover_lo),
+                              _mm512_unpackhi_epi32(chan_time_lo, charge_tover_lo),
+                              _mm512_unpacklo_epi32(chan_time_hi, charge_tover_hi),
+                              _mm512_unpackhi_epi32(chan_time_hi, charge_tover_hi) };
+  const __m512i peak_halves[4] = { _mm512_unpacklo_epi32(peak_lo, zero),
+                                   _mm512_unpackhi_epi32(peak_lo, zero),
+                                   _mm512_unpacklo_epi32(peak_hi, zero),
+                                   _mm512_unpackhi_epi32(peak_hi, zero) };
+
+  // Whole tuples: tuples[c][k] is the one of the channel c + 8k
+  alignas(64) uint16_t tuples[8][4][HIT_TUPLE_SIZE]; // NOLINT(build/unsigned)
+  for (int c = 0; c < 8; ++c) {
+    const __m512i quad = (c % 2 == 0) ? _mm512_unpacklo_epi64(halves[c / 2], peak_halves[c / 2])
+                                      : _mm512_unpackhi_epi64(halves[c / 2], peak_halves[c / 2]);
+    _mm512_store_si512(tuples[c], quad);
+  }
+  for (uint32_t bits = fired; bits != 0; bits &= bits - 1) { // NOLINT(build/unsigned)
+    const int j = __builtin_ctz(bits);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output_loc), // NOLINT
+                     _mm_load_si128(reinterpret_cast<const __m128i*>(tuples[j % 8][j / 8]))); // NOLINT
+    output_loc += HIT_TUPLE_SIZE;
+  }
+  return __builtin_popcount(fired);
+}
+
+// Load one field of the state of the registers ireg and ireg + 1,
+// which an AVX-512 register covers. Each AVX2 register keeps its own
+// state (see ProcessingInfo.hpp), so the two halves come from two places
+inline __m512i
+load_state_pair_avx512(const int16_t* state_lo, const int16_t* state_hi)
+{
+  return _mm512_inserti64x4(_mm512_zextsi256_si512(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(state_lo))), // NOLINT
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state_hi)),                         // NOLINT
+                            1);
+}
+
+inline void
+store_state_pair_avx512(int16_t* state_lo, int16_t* state_hi, __m512i v)
+{
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(state_lo), _mm512_castsi512_si256(v));         // NOLINT
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(state_hi), _mm512_extracti64x4_epi64(v, 1)); // NOLINT
+}
+
+// Perform the division of __m512i with a const int
+inline __m512i
+_mm512_div_epi16(const __m512i va, const int b)
+{
+  __m512i vb = _mm512_set1_epi16(32768 / b);
+  return _mm512_mulhrs_epi16(va, vb);
+}
+
+} // namespace swtpg_wib2
+
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+
+#endif // READOUT_SRC_WIB2_TPG_UTILSAVX512_HPP_
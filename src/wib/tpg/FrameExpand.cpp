@@ -9,6 +9,10 @@
 
 #include "fdreadoutlibs/wib/tpg/FrameExpand.hpp"
 
+// Built for AVX2, see fdreadoutlibs/wib/tpg/FrameExpand.hpp
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
 namespace swtpg {
 
 //==============================================================================
@@ -297,3 +301,5 @@ induction_index_to_channel(int index)
 }
 
 } // namespace swtpg
+
+#pragma GCC pop_options
@@ -9,6 +9,10 @@
 
 #include "fdreadoutlibs/wib2/tpg/FrameExpand.hpp"
 
+// Built for AVX2, see fdreadoutlibs/wib2/tpg/FrameExpand.hpp
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
 namespace swtpg_wib2 {
 
 //==============================================================================
@@ -53,3 +57,5 @@ print256_as16_dec(__m256i var)
 
 
 } // namespace swtpg_wib2
+
+#pragma GCC pop_options
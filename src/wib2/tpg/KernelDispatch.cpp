@@ -0,0 +1,78 @@
+/**
+ * @file KernelDispatch.cpp Runtime selection of the WIB2 software TPG kernels
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#include "fdreadoutlibs/wib2/tpg/KernelDispatch.hpp"
+
+#include <memory>
+#include <string>
+
+namespace swtpg_wib2 {
+
+template<typename RegisterState>
+std::unique_ptr<ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>>
+make_processing_info(uint8_t first_register, // NOLINT(build/unsigned)
+                     uint8_t last_register,  // NOLINT(build/unsigned)
+                     const int16_t* taps,
+                     int16_t ntaps,
+                     uint8_t tap_exponent, // NOLINT(build/unsigned)
+                     uint16_t threshold)   // NOLINT(build/unsigned)
+{
+  return std::make_unique<ProcessingInfo<NUM_REGISTERS_PER_FRAME, RegisterState>>(
+    nullptr, FRAMES_PER_MSG, first_register, last_register, nullptr, taps, ntaps, tap_exponent, threshold, 0, 0);
+}
+
+template std::unique_ptr<ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>>
+make_processing_info<SWTPGRegisterState>(uint8_t, uint8_t, const int16_t*, int16_t, uint8_t, uint16_t); // NOLINT
+template std::unique_ptr<ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>>
+make_processing_info<AbsRSRegisterState>(uint8_t, uint8_t, const int16_t*, int16_t, uint8_t, uint16_t); // NOLINT
+template std::unique_ptr<ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>>
+make_processing_info<FIRRegisterState>(uint8_t, uint8_t, const int16_t*, int16_t, uint8_t, uint16_t); // NOLINT
+
+const TPGAlgorithm*
+TPGKernels::find_algorithm(const std::string& name) const
+{
+  for (size_t i = 0; i < num_algorithms; ++i) {
+    if (name == algorithms[i].name) {
+      return &algorithms[i];
+    }
+  }
+  return nullptr;
+}
+
+const TPGKernels&
+select_tpg_kernels()
+{
+  __builtin_cpu_init();
+
+  const TPGKernels* avx512 = get_avx512_kernels();
+  if (avx512 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    return *avx512;
+  }
+
+  const TPGKernels* avx2 = get_avx2_kernels();
+  if (avx2 && __builtin_cpu_supports("avx2")) {
+    return *avx2;
+  }
+
+  return get_scalar_kernels();
+}
+
+const char*
+kernel_isa_name(KernelISA isa)
+{
+  switch (isa) {
+    case KernelISA::kScalar:
+      return "scalar";
+    case KernelISA::kAVX2:
+      return "AVX2";
+    case KernelISA::kAVX512:
+      return "AVX-512";
+  }
+  return "unknown";
+}
+
+} // namespace swtpg_wib2
@@ -0,0 +1,93 @@
+/**
+ * @file KernelsAVX2.cpp WIB2 software TPG kernels using AVX2, 16 channels
+ * per register. The kernels and their wrappers are built for AVX2 with
+ * #pragma GCC target: none of them may be called before checking that
+ * the CPU supports it (see select_tpg_kernels)
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#include "fdreadoutlibs/wib2/tpg/KernelDispatch.hpp"
+
+#include <iterator>
+
+#include "fdreadoutlibs/wib2/tpg/FrameExpand.hpp"
+#include "fdreadoutlibs/wib2/tpg/ProcessAVX2.hpp"
+#include "fdreadoutlibs/wib2/tpg/ProcessAVX2FIR.hpp"
+#include "fdreadoutlibs/wib2/tpg/ProcessRSAVX2.hpp"
+
+namespace swtpg_wib2 {
+
+namespace {
+
+// Built for AVX2 like the kernels, so that the kernels are inlined into
+// them
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+void
+expand_wib2_adcs_avx2(const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs,
+                      MessageRegisters* register_array,
+                      size_t first_register,
+                      size_t last_register)
+{
+  expand_wib2_adcs(ucs, register_array, first_register, last_register);
+}
+
+// Two-pass version: info.input has been filled by the expand function
+// of the same table
+template<typename Kernel>
+void
+process_window_avx2_frame(ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>& base_info)
+{
+  auto& info = static_cast<ProcessingInfo<NUM_REGISTERS_PER_FRAME, typename Kernel::RegisterState>&>(base_info);
+  Kernel::process(info, [&info](size_t ireg, size_t itime) {
+    return expanded_sample_avx2<NUM_REGISTERS_PER_FRAME>(info.input, ireg, itime);
+  });
+}
+
+// Fused version: the ADCs of each register are unpacked straight from
+// the frames into a small block that stays in L1, instead of going
+// through info.input, which is not used
+template<typename Kernel>
+void
+process_window_fused_avx2_frame(ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>& base_info,
+                                const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs)
+{
+  auto& info = static_cast<ProcessingInfo<NUM_REGISTERS_PER_FRAME, typename Kernel::RegisterState>&>(base_info);
+  Kernel::process(info, FrameSamplesAVX2(ucs, info.timeWindowNumFrames));
+}
+
+#pragma GCC pop_options
+
+template<typename Kernel>
+constexpr TPGAlgorithm
+avx2_algorithm()
+{
+  return { Kernel::name,
+           &make_processing_info<typename Kernel::RegisterState>,
+           &process_window_avx2_frame<Kernel>,
+           &process_window_fused_avx2_frame<Kernel> };
+}
+
+// The algorithms the "tpg_algorithm" configuration can pick
+const TPGAlgorithm avx2_algorithms[] = { avx2_algorithm<SWTPGKernelAVX2>(),
+                                         avx2_algorithm<AbsRSKernelAVX2>(),
+                                         avx2_algorithm<FIRKernelAVX2>() };
+
+const TPGKernels avx2_kernels = { KernelISA::kAVX2,
+                                  1,
+                                  &expand_wib2_adcs_avx2,
+                                  avx2_algorithms,
+                                  std::size(avx2_algorithms) };
+
+} // namespace
+
+const TPGKernels*
+get_avx2_kernels()
+{
+  return &avx2_kernels;
+}
+
+} // namespace swtpg_wib2
@@ -0,0 +1,108 @@
+/**
+ * @file KernelsAVX512.cpp WIB2 software TPG kernels using AVX-512, 32
+ * channels per register. The kernels and their wrappers are built for
+ * AVX-512F and AVX-512BW with #pragma GCC target: none of them may be
+ * called before checking that the CPU supports them (see
+ * select_tpg_kernels)
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#include "fdreadoutlibs/wib2/tpg/KernelDispatch.hpp"
+
+#include <iterator>
+
+#ifdef FDREADOUTLIBS_USE_AVX512
+#include "fdreadoutlibs/wib2/tpg/FrameExpandAVX512.hpp"
+#include "fdreadoutlibs/wib2/tpg/ProcessAVX512.hpp"
+#include "fdreadoutlibs/wib2/tpg/ProcessAVX512FIR.hpp"
+#include "fdreadoutlibs/wib2/tpg/ProcessRSAVX512.hpp"
+#endif
+
+namespace swtpg_wib2 {
+
+#ifdef FDREADOUTLIBS_USE_AVX512
+
+namespace {
+
+// Built for AVX-512 like the kernels, so that the kernels are inlined
+// into them
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+
+void
+expand_wib2_adcs_avx512_frame(const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs,
+                              MessageRegisters* register_array,
+                              size_t first_register,
+                              size_t last_register)
+{
+  expand_wib2_adcs_avx512(ucs, register_array, first_register, last_register);
+}
+
+// Two-pass version: info.input has been filled by the expand function
+// of the same table
+template<typename Kernel>
+void
+process_window_avx512_frame(ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>& base_info)
+{
+  auto& info = static_cast<ProcessingInfo<NUM_REGISTERS_PER_FRAME, typename Kernel::RegisterState>&>(base_info);
+  Kernel::process(info, [&info](size_t ireg, size_t itime) {
+    return expanded_sample_avx512<NUM_REGISTERS_PER_FRAME>(info.input, ireg, itime);
+  });
+}
+
+// Fused version: the ADCs of each register are unpacked straight from
+// the frames into a small block that stays in L1, instead of going
+// through info.input, which is not used
+template<typename Kernel>
+void
+process_window_fused_avx512_frame(ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>& base_info,
+                                  const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs)
+{
+  auto& info = static_cast<ProcessingInfo<NUM_REGISTERS_PER_FRAME, typename Kernel::RegisterState>&>(base_info);
+  Kernel::process(info, FrameSamplesAVX512(ucs, info.timeWindowNumFrames));
+}
+
+#pragma GCC pop_options
+
+template<typename Kernel>
+constexpr TPGAlgorithm
+avx512_algorithm()
+{
+  return { Kernel::name,
+           &make_processing_info<typename Kernel::RegisterState>,
+           &process_window_avx512_frame<Kernel>,
+           &process_window_fused_avx512_frame<Kernel> };
+}
+
+// The algorithms the "tpg_algorithm" configuration can pick
+const TPGAlgorithm avx512_algorithms[] = { avx512_algorithm<SWTPGKernelAVX512>(),
+                                           avx512_algorithm<AbsRSKernelAVX512>(),
+                                           avx512_algorithm<FIRKernelAVX512>() };
+
+const TPGKernels avx512_kernels = { KernelISA::kAVX512,
+                                    2,
+                                    &expand_wib2_adcs_avx512_frame,
+                                    avx512_algorithms,
+                                    std::size(avx512_algorithms) };
+
+} // namespace
+
+const TPGKernels*
+get_avx512_kernels()
+{
+  return &avx512_kernels;
+}
+
+#else
+
+const TPGKernels*
+get_avx512_kernels()
+{
+  return nullptr;
+}
+
+#endif // FDREADOUTLIBS_USE_AVX512
+
+} // namespace swtpg_wib2
@@ -0,0 +1,90 @@
+/**
+ * @file KernelsScalar.cpp WIB2 software TPG kernels for CPUs without AVX2
+ *
+ * This is part of the DUNE DAQ , copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+#include "fdreadoutlibs/wib2/tpg/KernelDispatch.hpp"
+#include "fdreadoutlibs/wib2/tpg/ProcessScalar.hpp"
+
+#include <iterator>
+
+namespace swtpg_wib2 {
+
+void
+expand_wib2_adcs_scalar(const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs,
+                        MessageRegisters* register_array,
+                        size_t first_register,
+                        size_t last_register)
+{
+  for (size_t iframe = 0; iframe < FRAMES_PER_MSG; ++iframe) {
+    const dunedaq::detdataformats::wib2::WIB2Frame* frame =
+      reinterpret_cast<const dunedaq::detdataformats::wib2::WIB2Frame*>(ucs) + iframe; // NOLINT
+
+    for (size_t iblock = first_register; iblock < last_register; ++iblock) {
+      for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+        register_array->set_uint16(iframe + iblock * FRAMES_PER_MSG,
+                                   j,
+                                   frame->get_adc(iblock * SAMPLES_PER_REGISTER + REGISTER_LANE_CHANNEL[j]));
+      }
+    }
+  }
+}
+
+namespace {
+
+// Two-pass version: info.input has been filled by the expand function
+// of the same table
+template<typename Kernel>
+void
+process_window_scalar_frame(ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>& base_info)
+{
+  auto& info = static_cast<ProcessingInfo<NUM_REGISTERS_PER_FRAME, typename Kernel::RegisterState>&>(base_info);
+  Kernel::process(info, [&info](size_t ireg, size_t itime) {
+    return expanded_samples_scalar<NUM_REGISTERS_PER_FRAME>(info.input, ireg, itime);
+  });
+}
+
+// Fused version: the ADCs of each register are unpacked straight from
+// the frames into a small block that stays in L1, instead of going
+// through info.input, which is not used
+template<typename Kernel>
+void
+process_window_fused_scalar_frame(ProcessingInfoBase<NUM_REGISTERS_PER_FRAME>& base_info,
+                                  const dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter* ucs)
+{
+  auto& info = static_cast<ProcessingInfo<NUM_REGISTERS_PER_FRAME, typename Kernel::RegisterState>&>(base_info);
+  Kernel::process(info, FrameSamplesScalar(ucs, info.timeWindowNumFrames));
+}
+
+template<typename Kernel>
+constexpr TPGAlgorithm
+scalar_algorithm()
+{
+  return { Kernel::name,
+           &make_processing_info<typename Kernel::RegisterState>,
+           &process_window_scalar_frame<Kernel>,
+           &process_window_fused_scalar_frame<Kernel> };
+}
+
+// The algorithms the "tpg_algorithm" configuration can pick
+const TPGAlgorithm scalar_algorithms[] = { scalar_algorithm<SWTPGKernelScalar>(),
+                                           scalar_algorithm<AbsRSKernelScalar>(),
+                                           scalar_algorithm<FIRKernelScalar>() };
+
+const TPGKernels scalar_kernels = { KernelISA::kScalar,
+                                    1,
+                                    &expand_wib2_adcs_scalar,
+                                    scalar_algorithms,
+                                    std::size(scalar_algorithms) };
+
+} // namespace
+
+const TPGKernels&
+get_scalar_kernels()
+{
+  return scalar_kernels;
+}
+
+} // namespace swtpg_wib2
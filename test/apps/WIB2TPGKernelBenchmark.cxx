@@ -0,0 +1,418 @@
+/**
+ * @file WIB2TPGKernelBenchmark.cxx Compare the two-pass (expand, then
+ * find hits) and the fused WIB2 software TPG kernels, for every
+ * instruction set the CPU supports, on synthetic superchunks or on the
+ * WIB2 frames of a binary file. The fused kernels are also run on
+ * windows of several superchunks. All three algorithms are run: SWTPG,
+ * AbsRS and FIR. The expansion of the frames on its own and the naive
+ * FIR kernel are timed too
+ *
+ * Usage: WIB2TPGKernelBenchmark [-f frames_file] [-o results.csv] [num_superchunks] [num_passes]
+ *                               [swtpg_threshold] [absrs_threshold] [superchunks_per_window] [fir_threshold]
+ *
+ * With -f, at most num_superchunks superchunks are read from the file.
+ * With -o, every measurement is also written to results.csv, one line
+ * each, to compare the kernels between releases
+ *
+ * This is part of the DUNE DAQ Application Framework, copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+
+#include "fdreadoutlibs/DUNEWIBSuperChunkTypeAdapter.hpp"
+#include "fdreadoutlibs/wib2/tpg/DesignFIR.hpp"
+#include "fdreadoutlibs/wib2/tpg/KernelDispatch.hpp"
+#include "fdreadoutlibs/wib2/tpg/ProcessNaive.hpp"
+#include "fdreadoutlibs/wib2/tpg/ProcessingInfo.hpp"
+#include "fdreadoutlibs/wib2/tpg/TPGConstants_wib2.hpp"
+
+#include "detdataformats/wib2/WIB2Frame.hpp"
+#include "logging/Logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using dunedaq::detdataformats::wib2::WIB2Frame;
+using dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter;
+
+namespace {
+
+// Pedestals around 900 ADC with gaussian noise, and a triangular pulse
+// on about 1% of the channels of each superchunk
+std::vector<DUNEWIBSuperChunkTypeAdapter>
+make_superchunks(size_t num_superchunks)
+{
+  std::mt19937 rng(12345);
+  std::normal_distribution<float> noise(0., 4.);
+  std::uniform_int_distribution<int> pedestal(850, 950);
+  std::uniform_real_distribution<float> pulse(0., 1.);
+
+  std::vector<int> pedestals(WIB2Frame::s_num_channels);
+  for (auto& ped : pedestals) {
+    ped = pedestal(rng);
+  }
+
+  std::vector<DUNEWIBSuperChunkTypeAdapter> superchunks(num_superchunks);
+  for (auto& superchunk : superchunks) {
+    std::memset(&superchunk, 0, sizeof(superchunk));
+    WIB2Frame* frames = reinterpret_cast<WIB2Frame*>(&superchunk); // NOLINT
+
+    for (int ichan = 0; ichan < WIB2Frame::s_num_channels; ++ichan) {
+      const bool has_pulse = pulse(rng) < 0.01;
+      for (size_t iframe = 0; iframe < swtpg_wib2::FRAMES_PER_MSG; ++iframe) {
+        float adc = pedestals[ichan] + noise(rng);
+        if (has_pulse && iframe >= 2 && iframe < 8) {
+          adc += 100 * (3 - std::abs(int(iframe) - 5));
+        }
+        frames[iframe].set_adc(ichan, static_cast<uint16_t>(adc)); // NOLINT(build/unsigned)
+      }
+    }
+  }
+  return superchunks;
+}
+
+// The frames of a binary file of consecutive WIB2 frames, as recorded
+// by the readout, in superchunks of FRAMES_PER_MSG frames. Incomplete
+// superchunks at the end of the file are left out
+std::vector<DUNEWIBSuperChunkTypeAdapter>
+read_superchunks(const std::string& filename, size_t max_superchunks)
+{
+  std::vector<DUNEWIBSuperChunkTypeAdapter> superchunks;
+
+  std::ifstream file(filename, std::ifstream::binary);
+  if (!file.is_open()) {
+    TLOG() << "Cannot open " << filename;
+    return superchunks;
+  }
+
+  DUNEWIBSuperChunkTypeAdapter superchunk;
+  while (superchunks.size() < max_superchunks &&
+         file.read(reinterpret_cast<char*>(&superchunk), sizeof(superchunk))) { // NOLINT
+    superchunks.push_back(superchunk);
+  }
+  return superchunks;
+}
+
+double
+num_channel_ticks(const std::vector<DUNEWIBSuperChunkTypeAdapter>& superchunks)
+{
+  return double(superchunks.size()) * swtpg_wib2::FRAMES_PER_MSG * WIB2Frame::s_num_channels;
+}
+
+// The fastest of num_passes calls to run_pass, in ns per channel-tick
+template<typename RunPass>
+double
+time_passes(size_t num_passes, double channel_ticks, RunPass&& run_pass)
+{
+  double best = 0.;
+  for (size_t ipass = 0; ipass < num_passes; ++ipass) {
+    auto start = std::chrono::steady_clock::now();
+    run_pass();
+    auto end = std::chrono::steady_clock::now();
+
+    const double ns_per_channel_tick = std::chrono::duration<double, std::nano>(end - start).count() / channel_ticks;
+    if (ipass == 0 || ns_per_channel_tick < best) {
+      best = ns_per_channel_tick;
+    }
+  }
+  return best;
+}
+
+struct BenchmarkResult
+{
+  double ns_per_channel_tick;
+  size_t nhits;
+  uint64_t checksum; // NOLINT(build/unsigned)
+};
+
+BenchmarkResult
+run_kernels(const swtpg_wib2::TPGKernels& kernels,
+            const std::string& algorithm,
+            bool fused,
+            size_t superchunks_per_window,
+            uint16_t threshold, // NOLINT(build/unsigned)
+            const std::vector<DUNEWIBSuperChunkTypeAdapter>& superchunks,
+            size_t num_passes)
+{
+  using namespace swtpg_wib2;
+
+  // The same filter as WIB2FrameHandler
+  const uint8_t tap_exponent = 6; // NOLINT(build/unsigned)
+  std::vector<int16_t> taps = firwin_int(7, 0.1, 1 << tap_exponent);
+  taps.push_back(0);
+
+  const TPGAlgorithm* kernel = kernels.find_algorithm(algorithm);
+  auto info = kernel->make_processing_info(0, NUM_REGISTERS_PER_FRAME, taps.data(), taps.size(), tap_exponent, threshold);
+
+  auto registers = std::make_unique<MessageRegisters>();
+  expand_wib2_adcs_scalar(&superchunks[0], registers.get(), 0, NUM_REGISTERS_PER_FRAME);
+  info->setState(*registers);
+  // Double the threshold of every third channel, for the kernels to
+  // be checked against each other with per-channel thresholds too
+  for (size_t j = 0; j < NUM_REGISTERS_PER_FRAME * SAMPLES_PER_REGISTER; j += 3) {
+    info->setChannelThreshold(j, 2 * threshold);
+  }
+  // and mask every seventh one, which must not have any hits
+  for (size_t j = 0; j < NUM_REGISTERS_PER_FRAME * SAMPLES_PER_REGISTER; j += 7) {
+    info->setChannelMasked(j, true);
+  }
+  info->input = registers.get();
+
+  // The two-pass kernels take one superchunk at a time
+  if (!fused) {
+    superchunks_per_window = 1;
+  }
+  const size_t num_windows = (superchunks.size() + superchunks_per_window - 1) / superchunks_per_window;
+
+  // Room for as many hits as a window can have and the MAGIC tuple
+  const size_t output_size = (max_hits_per_window(FRAMES_PER_MSG * superchunks_per_window) + 1) * HIT_TUPLE_SIZE;
+  std::vector<std::vector<uint16_t>> outputs(num_windows, std::vector<uint16_t>(output_size)); // NOLINT
+
+  BenchmarkResult result{ 0., 0, 0 };
+
+  // Keep the fastest of a few passes over the superchunks. The channel
+  // state carries over from one pass to the next, so only the hits of
+  // the last pass are kept
+  result.ns_per_channel_tick = time_passes(num_passes, num_channel_ticks(superchunks), [&]() {
+    result.nhits = 0;
+    for (size_t i = 0; i < num_windows; ++i) {
+      const size_t first_superchunk = i * superchunks_per_window;
+      const size_t num_superchunks = std::min(superchunks_per_window, superchunks.size() - first_superchunk);
+      info->output = outputs[i].data();
+      info->timeWindowNumFrames = num_superchunks * FRAMES_PER_MSG;
+      if (fused) {
+        kernel->process_window_fused(*info, &superchunks[first_superchunk]);
+      } else {
+        kernels.expand(&superchunks[first_superchunk], registers.get(), 0, NUM_REGISTERS_PER_FRAME);
+        kernel->process_window(*info);
+      }
+      result.nhits += info->nhits;
+    }
+  });
+
+  // Sum of the FNV-1a hashes of the hits of each superchunk, to check
+  // that all the kernels agree. The kernels write the hits ending on
+  // the same tick in different orders, so the sum must not depend on it.
+  // The end times are made relative to the superchunk the hit ends in,
+  // for the sums not to depend on the window size either
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    for (const uint16_t* hit = outputs[i].data(); *hit != MAGIC; hit += HIT_TUPLE_SIZE) { // NOLINT(build/unsigned)
+      uint16_t tuple[HIT_TUPLE_SIZE]; // NOLINT(build/unsigned)
+      std::copy_n(hit, HIT_TUPLE_SIZE, tuple);
+      tuple[1] = hit[1] % FRAMES_PER_MSG;
+      uint64_t hash = 14695981039346656037ull ^ (i * superchunks_per_window + hit[1] / FRAMES_PER_MSG); // NOLINT
+      for (size_t j = 0; j < HIT_TUPLE_SIZE; ++j) {
+        hash = (hash ^ tuple[j]) * 1099511628211ull;
+      }
+      result.checksum += hash;
+    }
+  }
+  return result;
+}
+
+// The expansion of the superchunks into a MessageRegisters on its own,
+// which is the first pass of the two-pass kernels
+double
+run_expand(const swtpg_wib2::TPGKernels& kernels,
+           const std::vector<DUNEWIBSuperChunkTypeAdapter>& superchunks,
+           size_t num_passes)
+{
+  auto registers = std::make_unique<swtpg_wib2::MessageRegisters>();
+  return time_passes(num_passes, num_channel_ticks(superchunks), [&]() {
+    for (const auto& superchunk : superchunks) {
+      kernels.expand(&superchunk, registers.get(), 0, swtpg_wib2::NUM_REGISTERS_PER_FRAME);
+    }
+  });
+}
+
+// The naive FIR kernel of ProcessNaive.hpp, one channel at a time, as a
+// baseline for the others. Its threshold is fixed at 5 sigma and it
+// doesn't find the peaks, so its hits aren't compared with theirs
+BenchmarkResult
+run_naive(const std::vector<DUNEWIBSuperChunkTypeAdapter>& superchunks, size_t num_passes)
+{
+  using namespace swtpg_wib2;
+
+  const uint8_t tap_exponent = 6; // NOLINT(build/unsigned)
+  std::vector<int16_t> taps = firwin_int(7, 0.1, 1 << tap_exponent);
+  taps.push_back(0);
+
+  auto base_info = make_processing_info<FIRRegisterState>(
+    0, NUM_REGISTERS_PER_FRAME, taps.data(), taps.size(), tap_exponent, 5);
+  auto& info = static_cast<ProcessingInfo<NUM_REGISTERS_PER_FRAME, FIRRegisterState>&>(*base_info);
+
+  auto registers = std::make_unique<MessageRegisters>();
+  expand_wib2_adcs_scalar(&superchunks[0], registers.get(), 0, NUM_REGISTERS_PER_FRAME);
+  info.setState(*registers);
+  info.input = registers.get();
+
+  std::vector<uint16_t> output((max_hits_per_window(FRAMES_PER_MSG) + 1) * HIT_TUPLE_SIZE); // NOLINT
+  info.output = output.data();
+
+  BenchmarkResult result{ 0., 0, 0 };
+  result.ns_per_channel_tick = time_passes(num_passes, num_channel_ticks(superchunks), [&]() {
+    result.nhits = 0;
+    for (const auto& superchunk : superchunks) {
+      expand_wib2_adcs_scalar(&superchunk, registers.get(), 0, NUM_REGISTERS_PER_FRAME);
+      process_window_naive(info);
+      result.nhits += info.nhits;
+    }
+  });
+  return result;
+}
+
+// One line of the results
+struct Measurement
+{
+  std::string kernel;
+  std::string isa;
+  std::string mode;
+  size_t superchunks_per_window;
+  double ns_per_channel_tick;
+  size_t nhits;
+};
+
+void
+write_measurements(const std::string& filename,
+                   const std::string& input,
+                   double channel_ticks,
+                   const std::vector<Measurement>& measurements)
+{
+  std::ofstream file(filename);
+  file << "input,kernel,isa,mode,superchunks_per_window,ns_per_channel_tick,hits,hits_per_channel_tick\n";
+  for (const auto& m : measurements) {
+    file << input << "," << m.kernel << "," << m.isa << "," << m.mode << "," << m.superchunks_per_window << ","
+         << m.ns_per_channel_tick << "," << m.nhits << "," << m.nhits / channel_ticks << "\n";
+  }
+}
+
+} // namespace
+
+int
+main(int argc, char** argv)
+{
+  std::string frames_file;
+  std::string results_file;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:o:")) != -1) {
+    switch (opt) {
+      case 'f':
+        frames_file = optarg;
+        break;
+      case 'o':
+        results_file = optarg;
+        break;
+      default:
+        TLOG() << "Usage: WIB2TPGKernelBenchmark [-f frames_file] [-o results.csv] [num_superchunks] [num_passes] "
+                  "[swtpg_threshold] [absrs_threshold] [superchunks_per_window] [fir_threshold]";
+        return 1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  const size_t num_superchunks = argc > 1 ? std::atoi(argv[1]) : 10000;
+  const size_t num_passes = argc > 2 ? std::atoi(argv[2]) : 5;
+  const uint16_t swtpg_threshold = argc > 3 ? std::atoi(argv[3]) : 100; // NOLINT(build/unsigned)
+  const uint16_t absrs_threshold = argc > 4 ? std::atoi(argv[4]) : 5;   // NOLINT(build/unsigned)
+  const size_t superchunks_per_window = argc > 5 ? std::atoi(argv[5]) : 8;
+  const uint16_t fir_threshold = argc > 6 ? std::atoi(argv[6]) : 5; // NOLINT(build/unsigned)
+
+  if (superchunks_per_window < 1 || superchunks_per_window > swtpg_wib2::MAX_SUPERCHUNKS_PER_WINDOW) {
+    TLOG() << "The number of superchunks per window must be between 1 and "
+           << swtpg_wib2::MAX_SUPERCHUNKS_PER_WINDOW;
+    return 1;
+  }
+
+  std::vector<DUNEWIBSuperChunkTypeAdapter> superchunks;
+  if (frames_file.empty()) {
+    TLOG() << "Generating " << num_superchunks << " superchunks";
+    superchunks = make_superchunks(num_superchunks);
+  } else {
+    superchunks = read_superchunks(frames_file, num_superchunks);
+    TLOG() << "Read " << superchunks.size() << " superchunks from " << frames_file;
+  }
+  if (superchunks.empty()) {
+    TLOG() << "No superchunks to process";
+    return 1;
+  }
+  const double channel_ticks = num_channel_ticks(superchunks);
+
+  __builtin_cpu_init();
+  std::vector<const swtpg_wib2::TPGKernels*> kernel_sets = { &swtpg_wib2::get_scalar_kernels() };
+  if (swtpg_wib2::get_avx2_kernels() && __builtin_cpu_supports("avx2")) {
+    kernel_sets.push_back(swtpg_wib2::get_avx2_kernels());
+  }
+  if (swtpg_wib2::get_avx512_kernels() && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    kernel_sets.push_back(swtpg_wib2::get_avx512_kernels());
+  }
+
+  std::vector<Measurement> measurements;
+  auto report = [&](const Measurement& m) {
+    std::ostringstream hits;
+    if (m.kernel != "expand") {
+      hits << ", " << m.nhits << " hits (" << m.nhits / channel_ticks << " per channel-tick)";
+    }
+    TLOG() << m.kernel << " " << m.isa << " " << m.mode << " x" << m.superchunks_per_window << ": "
+           << m.ns_per_channel_tick << " ns/channel-tick" << hits.str();
+    measurements.push_back(m);
+  };
+
+  for (const swtpg_wib2::TPGKernels* kernels : kernel_sets) {
+    const double ns_per_channel_tick = run_expand(*kernels, superchunks, num_passes);
+    report({ "expand", swtpg_wib2::kernel_isa_name(kernels->isa), "two-pass", 1, ns_per_channel_tick, 0 });
+  }
+  const BenchmarkResult naive = run_naive(superchunks, num_passes);
+  report({ "FIR-naive", "scalar", "two-pass", 1, naive.ns_per_channel_tick, naive.nhits });
+
+  bool all_agree = true;
+  const std::vector<std::pair<std::string, uint16_t>> algorithms = { // NOLINT(build/unsigned)
+    { "SWTPG", swtpg_threshold },
+    { "AbsRS", absrs_threshold },
+    { "FIR", fir_threshold }
+  };
+  for (const auto& [algorithm, threshold] : algorithms) {
+    uint64_t reference_checksum = 0; // NOLINT(build/unsigned)
+    bool first = true;
+
+    for (const swtpg_wib2::TPGKernels* kernels : kernel_sets) {
+      // Two-pass, fused, and fused on windows of several superchunks
+      const std::vector<std::pair<bool, size_t>> modes = { { false, 1 }, { true, 1 }, { true, superchunks_per_window } };
+      for (const auto& [fused, window] : modes) {
+        BenchmarkResult result = run_kernels(*kernels, algorithm, fused, window, threshold, superchunks, num_passes);
+        report({ algorithm,
+                 swtpg_wib2::kernel_isa_name(kernels->isa),
+                 fused ? "fused" : "two-pass",
+                 window,
+                 result.ns_per_channel_tick,
+                 result.nhits });
+
+        if (first) {
+          reference_checksum = result.checksum;
+          first = false;
+        } else if (result.checksum != reference_checksum) {
+          TLOG() << "  hits differ from the scalar two-pass kernel";
+          all_agree = false;
+        }
+      }
+    }
+  }
+
+  if (!results_file.empty()) {
+    write_measurements(results_file, frames_file.empty() ? "synthetic" : frames_file, channel_ticks, measurements);
+    TLOG() << "Wrote the results to " << results_file;
+  }
+
+  return all_agree ? 0 : 1;
+}
@@ -0,0 +1,382 @@
+/**
+ * @file WIB2TPGReplay.cxx Replay the WIB2 frames of a binary or HDF5 file
+ * through the full software TPG pipeline of WIB2FrameProcessor, as fast
+ * as it can take them: the preprocess stage, the frame handlers of the
+ * postprocess stage, process_swtpg_hits and WIB2TPHandler. The TPs and
+ * TPSets go to in-process senders that only count them. Reports the
+ * sustained rates of superchunks, TPs and TPSets, and the high-water
+ * marks of the queues between the stages, for 1 to num_links links and
+ * 1 to num_cpus CPUs
+ *
+ * Usage: WIB2TPGReplay [-l num_links] [-c num_cpus] [-a algorithm] [-t threshold] [-w superchunks_per_window]
+ *                      [-n num_frame_handlers] [-m channel_map] [-p num_passes] [-s max_superchunks] input_file
+ *
+ * Files ending in .hdf5 or .h5 are read with hdf5libs, taking the WIB
+ * fragments of all the records, others as consecutive WIB2 frames.
+ * Every link replays the same superchunks num_passes times, with the
+ * timestamps rewritten as in emulator mode. With -c, the frame handlers
+ * of all the links are pinned round-robin to CPUs 0 to num_cpus-1
+ *
+ * This is part of the DUNE DAQ Application Framework, copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+
+#include "fdreadoutlibs/DUNEWIBSuperChunkTypeAdapter.hpp"
+#include "fdreadoutlibs/TriggerPrimitiveTypeAdapter.hpp"
+#include "fdreadoutlibs/wib2/WIB2FrameProcessor.hpp"
+#include "fdreadoutlibs/wib2/tpg/KernelDispatch.hpp"
+#include "fdreadoutlibs/wib2/tpg/TPGConstants_wib2.hpp"
+#include "fdreadoutlibs/wib2tpgconfig/Nljs.hpp"
+
+#include "detdataformats/wib2/WIB2Frame.hpp"
+#include "hdf5libs/HDF5RawDataFile.hpp"
+#include "iomanager/Sender.hpp"
+#include "logging/Logging.hpp"
+#include "rcif/cmd/Nljs.hpp"
+#include "readoutlibs/FrameErrorRegistry.hpp"
+#include "readoutlibs/readoutconfig/Nljs.hpp"
+#include "trigger/TPSet.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using dunedaq::detdataformats::wib2::WIB2Frame;
+using dunedaq::fdreadoutlibs::WIB2FrameProcessor;
+using dunedaq::fdreadoutlibs::types::DUNEWIBSuperChunkTypeAdapter;
+using dunedaq::fdreadoutlibs::types::TriggerPrimitiveTypeAdapter;
+
+namespace {
+
+// Stands in for the iomanager sender of a connection: counts what is
+// sent to it, and throws it away
+template<typename Datatype>
+class CountingSender : public dunedaq::iomanager::SenderConcept<Datatype>
+{
+public:
+  using timeout_t = dunedaq::iomanager::Sender::timeout_t;
+
+  explicit CountingSender(const std::string& uid)
+    : dunedaq::iomanager::SenderConcept<Datatype>(connection_id(uid))
+  {}
+
+  void send(Datatype&& /*data*/, timeout_t /*timeout*/) override { ++m_count; }
+  bool try_send(Datatype&& /*data*/, timeout_t /*timeout*/) override
+  {
+    ++m_count;
+    return true;
+  }
+  void send_with_topic(Datatype&& /*data*/, timeout_t /*timeout*/, std::string /*topic*/) override { ++m_count; }
+  bool is_ready_for_sending(timeout_t /*timeout*/) { return true; }
+
+  size_t get_count() const { return m_count.load(); }
+
+private:
+  static dunedaq::iomanager::ConnectionId connection_id(const std::string& uid)
+  {
+    dunedaq::iomanager::ConnectionId id;
+    id.uid = uid;
+    return id;
+  }
+
+  std::atomic<size_t> m_count{ 0 };
+};
+
+bool
+is_hdf5_file(const std::string& filename)
+{
+  for (const std::string extension : { ".hdf5", ".h5" }) {
+    if (filename.size() > extension.size() &&
+        filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The WIB2 frames of the WIB fragments of all the records of an HDF5
+// file, in superchunks of FRAMES_PER_MSG frames. The incomplete
+// superchunk at the end of each fragment is left out
+std::vector<DUNEWIBSuperChunkTypeAdapter>
+read_hdf5_superchunks(const std::string& filename, size_t max_superchunks)
+{
+  std::vector<DUNEWIBSuperChunkTypeAdapter> superchunks;
+
+  dunedaq::hdf5libs::HDF5RawDataFile file(filename);
+  for (const auto& path : file.get_all_fragment_dataset_paths()) {
+    auto fragment = file.get_frag_ptr(path);
+    if (fragment->get_fragment_type() != DUNEWIBSuperChunkTypeAdapter::fragment_type) {
+      continue;
+    }
+    const size_t num_frames =
+      (fragment->get_size() - sizeof(dunedaq::daqdataformats::FragmentHeader)) / sizeof(WIB2Frame);
+    const WIB2Frame* frames = reinterpret_cast<const WIB2Frame*>(fragment->get_data()); // NOLINT
+
+    DUNEWIBSuperChunkTypeAdapter superchunk;
+    for (size_t i = 0; i + swtpg_wib2::FRAMES_PER_MSG <= num_frames; i += swtpg_wib2::FRAMES_PER_MSG) {
+      if (superchunks.size() == max_superchunks) {
+        return superchunks;
+      }
+      std::memcpy(&superchunk, frames + i, sizeof(superchunk));
+      superchunks.push_back(superchunk);
+    }
+  }
+  return superchunks;
+}
+
+// The frames of a binary file of consecutive WIB2 frames, as recorded
+// by the readout, in superchunks of FRAMES_PER_MSG frames
+std::vector<DUNEWIBSuperChunkTypeAdapter>
+read_binary_superchunks(const std::string& filename, size_t max_superchunks)
+{
+  std::vector<DUNEWIBSuperChunkTypeAdapter> superchunks;
+
+  std::ifstream file(filename, std::ifstream::binary);
+  if (!file.is_open()) {
+    TLOG() << "Cannot open " << filename;
+    return superchunks;
+  }
+
+  DUNEWIBSuperChunkTypeAdapter superchunk;
+  while (superchunks.size() < max_superchunks &&
+         file.read(reinterpret_cast<char*>(&superchunk), sizeof(superchunk))) { // NOLINT
+    superchunks.push_back(superchunk);
+  }
+  return superchunks;
+}
+
+struct ReplayConf
+{
+  std::string algorithm = "SWTPG";
+  uint16_t threshold = 100; // NOLINT(build/unsigned)
+  size_t superchunks_per_window = 1;
+  size_t num_frame_handlers = 0;
+  std::string channel_map = "HDColdboxChannelMap";
+  size_t num_passes = 10;
+};
+
+// One link: a WIB2FrameProcessor with its counting senders, fed by
+// its own thread, and the high-water marks of its queues
+struct Link
+{
+  std::unique_ptr<dunedaq::readoutlibs::FrameErrorRegistry> error_registry;
+  std::unique_ptr<WIB2FrameProcessor> processor;
+  std::shared_ptr<CountingSender<TriggerPrimitiveTypeAdapter>> tp_sink;
+  std::shared_ptr<CountingSender<dunedaq::trigger::TPSet>> tpset_sink;
+
+  std::thread feeder;
+  std::atomic<bool> feeding{ false };
+  size_t postprocess_queue_hwm = 0;
+  size_t tphandler_queue_hwm = 0;
+};
+
+// The frames of all the links come from the same input, so they all
+// get the crate, slot and link of first_frame, and their channel maps
+// are built at conf, outside the timed replay
+nlohmann::json
+make_conf(const ReplayConf& conf, const WIB2Frame& first_frame, size_t ilink, size_t num_frame_handlers, size_t num_cpus)
+{
+  dunedaq::readoutlibs::readoutconfig::RawDataProcessorConf processor_conf;
+  processor_conf.source_id = ilink;
+  processor_conf.tpset_sourceid = ilink;
+  processor_conf.enable_software_tpg = true;
+  processor_conf.software_tpg_algorithm = conf.algorithm;
+  processor_conf.software_tpg_threshold = conf.threshold;
+  processor_conf.channel_map_name = conf.channel_map;
+  processor_conf.emulator_mode = true;
+  processor_conf.tp_timeout = 100000;
+  processor_conf.tpset_window_size = 10000;
+
+  dunedaq::fdreadoutlibs::wib2tpgconfig::Conf tpg_conf;
+  tpg_conf.superchunks_per_window = conf.superchunks_per_window;
+  tpg_conf.num_frame_handlers = num_frame_handlers;
+  tpg_conf.crate = first_frame.header.crate;
+  tpg_conf.slot = first_frame.header.slot;
+  tpg_conf.link = first_frame.header.link;
+  for (size_t i = 0; num_cpus > 0 && i < num_frame_handlers; ++i) {
+    tpg_conf.frame_handler_cpus.push_back((ilink * num_frame_handlers + i) % num_cpus);
+  }
+
+  nlohmann::json cfg;
+  cfg["rawdataprocessorconf"] = processor_conf;
+  cfg["wib2tpgconf"] = tpg_conf;
+  return cfg;
+}
+
+// Push the superchunks through the preprocess and postprocess stages
+// of the link, as fast as the postprocess queues take them. The items
+// are copied first, as preprocess rewrites the timestamps
+void
+feed_link(Link& link, const std::vector<DUNEWIBSuperChunkTypeAdapter>& superchunks, size_t num_passes)
+{
+  const size_t capacity = link.processor->get_postprocess_queue_capacity();
+  DUNEWIBSuperChunkTypeAdapter superchunk;
+  for (size_t ipass = 0; ipass < num_passes; ++ipass) {
+    for (const auto& input : superchunks) {
+      while (link.processor->get_postprocess_queue_occupancy() >= capacity) {
+        std::this_thread::yield();
+      }
+      superchunk = input;
+      link.processor->preprocess_item(&superchunk);
+      link.processor->postprocess_item(&superchunk);
+    }
+  }
+  link.feeding.store(false);
+}
+
+bool
+update_high_water_marks(std::vector<std::unique_ptr<Link>>& links)
+{
+  bool busy = false;
+  for (auto& link : links) {
+    const size_t postprocess_occupancy = link->processor->get_postprocess_queue_occupancy();
+    const size_t tphandler_occupancy = link->processor->get_tphandler_queue_occupancy();
+    link->postprocess_queue_hwm = std::max(link->postprocess_queue_hwm, postprocess_occupancy);
+    link->tphandler_queue_hwm = std::max(link->tphandler_queue_hwm, tphandler_occupancy);
+    busy = busy || link->feeding.load() || postprocess_occupancy > 0 || tphandler_occupancy > 0;
+  }
+  return busy;
+}
+
+void
+run_replay(const ReplayConf& conf,
+           const std::vector<DUNEWIBSuperChunkTypeAdapter>& superchunks,
+           size_t num_links,
+           size_t num_cpus)
+{
+  // Without pinning the processor picks the number of frame handlers
+  // itself, but the CPUs have to be listed one per frame handler
+  size_t num_frame_handlers = conf.num_frame_handlers;
+  if (num_frame_handlers == 0 && num_cpus > 0) {
+    num_frame_handlers = (swtpg_wib2::select_tpg_kernels().isa == swtpg_wib2::KernelISA::kAVX512) ? 1 : 2;
+  }
+
+  std::vector<std::unique_ptr<Link>> links;
+  for (size_t ilink = 0; ilink < num_links; ++ilink) {
+    auto link = std::make_unique<Link>();
+    link->error_registry = std::make_unique<dunedaq::readoutlibs::FrameErrorRegistry>();
+    link->processor = std::make_unique<WIB2FrameProcessor>(link->error_registry);
+    link->tp_sink = std::make_shared<CountingSender<TriggerPrimitiveTypeAdapter>>("tp_out_" + std::to_string(ilink));
+    link->tpset_sink = std::make_shared<CountingSender<dunedaq::trigger::TPSet>>("tpset_out_" + std::to_string(ilink));
+    link->processor->set_tp_sinks(link->tp_sink, link->tpset_sink);
+    link->processor->conf(make_conf(
+      conf, *reinterpret_cast<const WIB2Frame*>(&superchunks.front()), ilink, num_frame_handlers, num_cpus)); // NOLINT
+    links.push_back(std::move(link));
+  }
+
+  dunedaq::rcif::cmd::StartParams start_params;
+  start_params.run = 1;
+  const nlohmann::json start_args = start_params;
+  for (auto& link : links) {
+    link->processor->start(start_args);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (auto& link : links) {
+    link->feeding.store(true);
+    link->feeder = std::thread(feed_link, std::ref(*link), std::cref(superchunks), conf.num_passes);
+  }
+  // Sample the queues until every link has been fed and has drained
+  while (update_high_water_marks(links)) {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  for (auto& link : links) {
+    link->feeder.join();
+    link->processor->stop(nlohmann::json{});
+    link->processor->scrap(nlohmann::json{});
+  }
+
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  const double superchunks_per_link = double(superchunks.size()) * conf.num_passes;
+  size_t num_tps = 0;
+  size_t num_tpsets = 0;
+  size_t postprocess_queue_hwm = 0;
+  size_t tphandler_queue_hwm = 0;
+  for (auto& link : links) {
+    num_tps += link->tp_sink->get_count();
+    num_tpsets += link->tpset_sink->get_count();
+    postprocess_queue_hwm = std::max(postprocess_queue_hwm, link->postprocess_queue_hwm);
+    tphandler_queue_hwm = std::max(tphandler_queue_hwm, link->tphandler_queue_hwm);
+  }
+
+  TLOG() << "links " << num_links << ", CPUs " << (num_cpus > 0 ? std::to_string(num_cpus) : "any") << ": "
+         << superchunks_per_link * num_links / seconds << " superchunks/s (" << superchunks_per_link / seconds
+         << " per link), " << num_tps / seconds << " TPs/s, " << num_tpsets / seconds
+         << " TPSets/s, queue high-water marks: postprocess " << postprocess_queue_hwm << ", TP handler "
+         << tphandler_queue_hwm;
+}
+
+} // namespace
+
+int
+main(int argc, char** argv)
+{
+  ReplayConf conf;
+  size_t num_links = 1;
+  size_t num_cpus = 0;
+  size_t max_superchunks = 10000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:c:a:t:w:n:m:p:s:")) != -1) {
+    switch (opt) {
+      case 'l': num_links = std::atoi(optarg); break;
+      case 'c': num_cpus = std::atoi(optarg); break;
+      case 'a': conf.algorithm = optarg; break;
+      case 't': conf.threshold = std::atoi(optarg); break;
+      case 'w': conf.superchunks_per_window = std::atoi(optarg); break;
+      case 'n': conf.num_frame_handlers = std::atoi(optarg); break;
+      case 'm': conf.channel_map = optarg; break;
+      case 'p': conf.num_passes = std::atoi(optarg); break;
+      case 's': max_superchunks = std::atoi(optarg); break;
+      default:
+        TLOG() << "Usage: WIB2TPGReplay [-l num_links] [-c num_cpus] [-a algorithm] [-t threshold] "
+               << "[-w superchunks_per_window] [-n num_frame_handlers] [-m channel_map] [-p num_passes] "
+               << "[-s max_superchunks] input_file";
+        return 1;
+    }
+  }
+  if (optind != argc - 1 || num_links == 0) {
+    TLOG() << "Usage: WIB2TPGReplay [-l num_links] [-c num_cpus] [-a algorithm] [-t threshold] "
+           << "[-w superchunks_per_window] [-n num_frame_handlers] [-m channel_map] [-p num_passes] "
+           << "[-s max_superchunks] input_file";
+    return 1;
+  }
+  const std::string filename = argv[optind];
+
+  const std::vector<DUNEWIBSuperChunkTypeAdapter> superchunks = is_hdf5_file(filename)
+                                                                  ? read_hdf5_superchunks(filename, max_superchunks)
+                                                                  : read_binary_superchunks(filename, max_superchunks);
+  if (superchunks.empty()) {
+    TLOG() << "No superchunks to replay";
+    return 1;
+  }
+
+  TLOG() << "Replaying " << superchunks.size() << " superchunks " << conf.num_passes << " times per link with "
+         << conf.algorithm << ", threshold " << conf.threshold << ", " << conf.superchunks_per_window
+         << " superchunks per window, kernels "
+         << swtpg_wib2::kernel_isa_name(swtpg_wib2::select_tpg_kernels().isa);
+
+  for (size_t ilinks = 1; ilinks <= num_links; ++ilinks) {
+    if (num_cpus == 0) {
+      run_replay(conf, superchunks, ilinks, 0);
+      continue;
+    }
+    for (size_t icpus = 1; icpus <= num_cpus; ++icpus) {
+      run_replay(conf, superchunks, ilinks, icpus);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * @file WIB2EventCount_test.cxx WIB2EventCount class Unit Tests
+ *
+ * This is part of the DUNE DAQ Application Framework, copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+
+#include "fdreadoutlibs/wib2/WIB2EventCount.hpp"
+
+#define BOOST_TEST_MODULE WIB2EventCount_test // NOLINT
+
+#include "boost/test/unit_test.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace dunedaq::fdreadoutlibs;
+
+namespace {
+
+// Long enough that a lost wake-up shows up in the test times
+constexpr std::chrono::seconds s_long_timeout(10);
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(WIB2EventCount_test)
+
+BOOST_AUTO_TEST_CASE(ReadyDoesNotSleep)
+{
+  WIB2EventCount event;
+  const auto start = std::chrono::steady_clock::now();
+  event.await([] { return true; }, s_long_timeout);
+  BOOST_REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+}
+
+BOOST_AUTO_TEST_CASE(TimesOut)
+{
+  WIB2EventCount event;
+  const auto start = std::chrono::steady_clock::now();
+  event.await([] { return false; }, std::chrono::milliseconds(50));
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  BOOST_REQUIRE(elapsed >= std::chrono::milliseconds(40));
+  BOOST_REQUIRE(elapsed < s_long_timeout);
+}
+
+BOOST_AUTO_TEST_CASE(NotifyWakesUp)
+{
+  WIB2EventCount event;
+  std::atomic<bool> ready{ false };
+  std::thread producer([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ready.store(true);
+    event.notify();
+  });
+
+  const auto start = std::chrono::steady_clock::now();
+  while (!ready.load()) {
+    event.await([&ready] { return ready.load(); }, s_long_timeout);
+  }
+  producer.join();
+  BOOST_REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+}
+
+// Two threads hand a token back and forth, each sleeping until the
+// other notifies it, as the frame handlers and the TP handler thread do.
+// A notify lost between the check of a waiter and its sleep would stall
+// the exchange for s_long_timeout
+BOOST_AUTO_TEST_CASE(PingPong)
+{
+  constexpr int num_exchanges = 10000;
+  WIB2EventCount ping_event;
+  WIB2EventCount pong_event;
+  std::atomic<int> token{ 0 };
+
+  auto player = [&token](int parity, WIB2EventCount& my_event, WIB2EventCount& other_event) {
+    for (int i = parity; i < 2 * num_exchanges; i += 2) {
+      auto my_turn = [&token, i] { return token.load() == i; };
+      while (!my_turn()) {
+        my_event.await(my_turn, s_long_timeout);
+      }
+      token.store(i + 1);
+      other_event.notify();
+    }
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  std::thread pong(player, 1, std::ref(pong_event), std::ref(ping_event));
+  player(0, ping_event, pong_event);
+  pong.join();
+  BOOST_REQUIRE_EQUAL(token.load(), 2 * num_exchanges);
+  BOOST_REQUIRE(std::chrono::steady_clock::now() - start < s_long_timeout);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,123 @@
+/**
+ * @file WIB2LatencyHistogram_test.cxx WIB2LatencyHistogram class Unit Tests
+ *
+ * This is part of the DUNE DAQ Application Framework, copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+
+#include "fdreadoutlibs/wib2/WIB2LatencyHistogram.hpp"
+
+#define BOOST_TEST_MODULE WIB2LatencyHistogram_test // NOLINT
+
+#include "boost/test/unit_test.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <vector>
+
+using namespace dunedaq::fdreadoutlibs;
+
+namespace {
+
+// The latencies around every power of 2, where the buckets change width
+std::vector<int64_t>
+test_latencies()
+{
+  std::vector<int64_t> latencies;
+  for (int64_t ns = 0; ns < 4096; ++ns) {
+    latencies.push_back(ns);
+  }
+  for (int exponent = 12; exponent < 63; ++exponent) {
+    for (int64_t offset = -3; offset <= 3; ++offset) {
+      latencies.push_back((int64_t(1) << exponent) + offset);
+    }
+    latencies.push_back((int64_t(3) << (exponent - 1)) + 1);
+  }
+  latencies.push_back(std::numeric_limits<int64_t>::max());
+  return latencies;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(WIB2LatencyHistogram_test)
+
+BOOST_AUTO_TEST_CASE(Empty)
+{
+  WIB2LatencyHistogram histogram;
+  const auto summary = histogram.take();
+  BOOST_REQUIRE_EQUAL(summary.count, 0);
+  BOOST_REQUIRE_EQUAL(summary.p50, 0);
+  BOOST_REQUIRE_EQUAL(summary.p99, 0);
+  BOOST_REQUIRE_EQUAL(summary.max, 0);
+}
+
+// A single latency is reported by the upper bound of its bucket, which
+// is at most 25% above it
+BOOST_AUTO_TEST_CASE(BucketBounds)
+{
+  WIB2LatencyHistogram histogram;
+  for (const int64_t ns : test_latencies()) {
+    histogram.add(std::chrono::nanoseconds(ns));
+    const auto summary = histogram.take();
+    const uint64_t latency = ns; // NOLINT(build/unsigned)
+    BOOST_REQUIRE_EQUAL(summary.count, 1);
+    BOOST_REQUIRE_EQUAL(summary.max, latency);
+    BOOST_REQUIRE_EQUAL(summary.p50, summary.p99);
+    BOOST_REQUIRE_GE(summary.p50, latency);
+    BOOST_REQUIRE_LE(summary.p50 - latency, latency / 4);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(NegativeLatency)
+{
+  WIB2LatencyHistogram histogram;
+  histogram.add(std::chrono::nanoseconds(-5));
+  const auto summary = histogram.take();
+  BOOST_REQUIRE_EQUAL(summary.count, 1);
+  BOOST_REQUIRE_EQUAL(summary.p50, 0);
+  BOOST_REQUIRE_EQUAL(summary.max, 0);
+}
+
+BOOST_AUTO_TEST_CASE(Percentiles)
+{
+  WIB2LatencyHistogram histogram;
+  for (int64_t ns = 1; ns <= 1000; ++ns) {
+    histogram.add(std::chrono::nanoseconds(ns));
+  }
+  const auto summary = histogram.take();
+  BOOST_REQUIRE_EQUAL(summary.count, 1000);
+  BOOST_REQUIRE_EQUAL(summary.max, 1000);
+  BOOST_REQUIRE_GE(summary.p50, 500);
+  BOOST_REQUIRE_LE(summary.p50, 500 + 500 / 4);
+  BOOST_REQUIRE_GE(summary.p99, 990);
+  BOOST_REQUIRE_LE(summary.p99, 990 + 990 / 4);
+
+  // take() empties the histogram
+  BOOST_REQUIRE_EQUAL(histogram.take().count, 0);
+}
+
+BOOST_AUTO_TEST_CASE(ConcurrentAdds)
+{
+  constexpr int num_threads = 4;
+  constexpr int num_adds = 100000;
+  WIB2LatencyHistogram histogram;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&histogram, i] {
+      for (int j = 0; j < num_adds; ++j) {
+        histogram.add(std::chrono::nanoseconds(i * num_adds + j));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const auto summary = histogram.take();
+  BOOST_REQUIRE_EQUAL(summary.count, num_threads * num_adds);
+  BOOST_REQUIRE_EQUAL(summary.max, num_threads * num_adds - 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
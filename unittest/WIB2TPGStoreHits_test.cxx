@@ -0,0 +1,196 @@
+/**
+ * @file WIB2TPGStoreHits_test.cxx Unit Tests of the functions that write
+ * the hits of the WIB2 software TPG kernels
+ *
+ * This is part of the DUNE DAQ Application Framework, copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+
+#include "fdreadoutlibs/wib2/tpg/ProcessScalar.hpp"
+#include "fdreadoutlibs/wib2/tpg/UtilsAVX2.hpp"
+#include "fdreadoutlibs/wib2/tpg/UtilsAVX512.hpp"
+
+#define BOOST_TEST_MODULE WIB2TPGStoreHits_test // NOLINT
+
+#include "boost/test/unit_test.hpp"
+
+#include <array>
+#include <cstdint>
+
+using namespace swtpg_wib2;
+
+namespace {
+
+constexpr size_t s_register = 4;
+constexpr size_t s_time = 123;
+
+// Room for the hits of two registers, which an AVX-512 register covers
+constexpr size_t s_num_channels = 2 * SAMPLES_PER_REGISTER;
+constexpr size_t s_output_size = s_num_channels * HIT_TUPLE_SIZE;
+using Output = std::array<uint16_t, s_output_size>; // NOLINT(build/unsigned)
+
+// The hits of the registers s_register and s_register + 1, with values
+// that differ in every channel and every field
+struct Hits
+{
+  Hits()
+  {
+    for (size_t j = 0; j < s_num_channels; ++j) {
+      channels[j] = s_register * SAMPLES_PER_REGISTER + j;
+      charge[j] = 1000 + j;
+      tover[j] = 2000 + j;
+      peak_adc[j] = 3000 + j;
+      peak_time[j] = 4000 + j;
+    }
+  }
+
+  alignas(64) int16_t channels[s_num_channels];
+  alignas(64) int16_t charge[s_num_channels];
+  alignas(64) int16_t tover[s_num_channels];
+  alignas(64) int16_t peak_adc[s_num_channels];
+  alignas(64) int16_t peak_time[s_num_channels];
+};
+
+// The channels of `fired` are those of the register s_register, then
+// of the next one
+int
+store_scalar(const Hits& hits, uint32_t fired, uint16_t* output) // NOLINT(build/unsigned)
+{
+  uint16_t* output_loc = output; // NOLINT(build/unsigned)
+  int nhits = 0;
+  for (size_t ireg = 0; ireg < 2; ++ireg) {
+    const size_t first = ireg * SAMPLES_PER_REGISTER;
+    bool left[SAMPLES_PER_REGISTER];
+    for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+      left[j] = (fired >> (first + j)) & 1;
+    }
+    nhits += store_hits_scalar(output_loc,
+                               s_register + ireg,
+                               s_time,
+                               left,
+                               hits.charge + first,
+                               hits.tover + first,
+                               hits.peak_adc + first,
+                               hits.peak_time + first);
+  }
+  BOOST_REQUIRE_EQUAL(output_loc - output, nhits * HIT_TUPLE_SIZE);
+  return nhits;
+}
+
+// Built for AVX2 like the kernels, so that store_hits_avx2 is inlined
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+__m256i
+load_avx2(const int16_t* lanes)
+{
+  return _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes)); // NOLINT
+}
+
+int
+store_avx2(const Hits& hits, uint32_t fired, uint16_t* output) // NOLINT(build/unsigned)
+{
+  alignas(32) int16_t fired_lanes[SAMPLES_PER_REGISTER];
+  for (size_t j = 0; j < SAMPLES_PER_REGISTER; ++j) {
+    fired_lanes[j] = ((fired >> j) & 1) ? -1 : 0;
+  }
+  uint16_t* output_loc = output; // NOLINT(build/unsigned)
+  const int nhits = store_hits_avx2(output_loc,
+                                    load_avx2(fired_lanes),
+                                    load_avx2(hits.channels),
+                                    _mm256_set1_epi16(s_time),
+                                    load_avx2(hits.charge),
+                                    load_avx2(hits.tover),
+                                    load_avx2(hits.peak_adc),
+                                    load_avx2(hits.peak_time));
+  BOOST_REQUIRE_EQUAL(output_loc - output, nhits * HIT_TUPLE_SIZE);
+  return nhits;
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+
+__m512i
+load_avx512(const int16_t* lanes)
+{
+  return _mm512_load_si512(lanes);
+}
+
+int
+store_avx512(const Hits& hits, uint32_t fired, uint16_t* output) // NOLINT(build/unsigned)
+{
+  uint16_t* output_loc = output; // NOLINT(build/unsigned)
+  const int nhits = store_hits_avx512(output_loc,
+                                      fired,
+                                      load_avx512(hits.channels),
+                                      _mm512_set1_epi16(s_time),
+                                      load_avx512(hits.charge),
+                                      load_avx512(hits.tover),
+                                      load_avx512(hits.peak_adc),
+                                      load_avx512(hits.peak_time));
+  BOOST_REQUIRE_EQUAL(output_loc - output, nhits * HIT_TUPLE_SIZE);
+  return nhits;
+}
+
+#pragma GCC pop_options
+
+void
+require_same_hits(const Output& output, int nhits, const Output& expected, int expected_nhits, uint32_t fired) // NOLINT
+{
+  BOOST_REQUIRE_EQUAL(nhits, expected_nhits);
+  for (int i = 0; i < nhits * static_cast<int>(HIT_TUPLE_SIZE); ++i) {
+    if (output[i] != expected[i]) {
+      BOOST_FAIL("Fired channels " << std::hex << fired << std::dec << ": word " << i << " is " << output[i]
+                                   << " instead of " << expected[i]);
+    }
+  }
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(WIB2TPGStoreHits_test)
+
+// store_hits_avx2 writes the same tuples as store_hits_scalar, in the
+// same channel order, whichever channels of the register fired
+BOOST_AUTO_TEST_CASE(AVX2MatchesScalar)
+{
+  if (!__builtin_cpu_supports("avx2")) {
+    BOOST_TEST_MESSAGE("The CPU doesn't support AVX2, skipping");
+    return;
+  }
+
+  const Hits hits;
+  for (uint32_t fired = 0; fired < (1u << SAMPLES_PER_REGISTER); ++fired) { // NOLINT(build/unsigned)
+    Output scalar_output{};
+    Output avx2_output{};
+    const int scalar_nhits = store_scalar(hits, fired, scalar_output.data());
+    BOOST_REQUIRE_EQUAL(scalar_nhits, __builtin_popcount(fired));
+    const int avx2_nhits = store_avx2(hits, fired, avx2_output.data());
+    require_same_hits(avx2_output, avx2_nhits, scalar_output, scalar_nhits, fired);
+  }
+}
+
+// Same for store_hits_avx512, over two registers: every combination of
+// the channels of the first one, with a different one of the second
+BOOST_AUTO_TEST_CASE(AVX512MatchesScalar)
+{
+  if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512bw")) {
+    BOOST_TEST_MESSAGE("The CPU doesn't support AVX-512, skipping");
+    return;
+  }
+
+  const Hits hits;
+  for (uint32_t low = 0; low < (1u << SAMPLES_PER_REGISTER); ++low) { // NOLINT(build/unsigned)
+    const uint32_t fired = low | ((low * 40503u) & 0xffffu) << SAMPLES_PER_REGISTER; // NOLINT(build/unsigned)
+    Output scalar_output{};
+    Output avx512_output{};
+    const int scalar_nhits = store_scalar(hits, fired, scalar_output.data());
+    const int avx512_nhits = store_avx512(hits, fired, avx512_output.data());
+    require_same_hits(avx512_output, avx512_nhits, scalar_output, scalar_nhits, fired);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
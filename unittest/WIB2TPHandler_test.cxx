@@ -0,0 +1,194 @@
+/**
+ * @file WIB2TPHandler_test.cxx WIB2TPHandler class Unit Tests
+ *
+ * This is part of the DUNE DAQ Application Framework, copyright 2023.
+ * Licensing/copyright details are in the COPYING file that you should have
+ * received with this code.
+ */
+
+#include "fdreadoutlibs/wib2/WIB2TPHandler.hpp"
+
+#define BOOST_TEST_MODULE WIB2TPHandler_test // NOLINT
+
+#include "boost/test/unit_test.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace dunedaq;
+using namespace dunedaq::fdreadoutlibs;
+
+namespace {
+
+constexpr uint64_t s_clocks_per_tick = 32;     // NOLINT(build/unsigned)
+constexpr uint64_t s_ticks_per_window = 64;    // NOLINT(build/unsigned)
+constexpr uint64_t s_tp_timeout = 1000000;     // NOLINT(build/unsigned)
+constexpr uint64_t s_tpset_window_size = 2000; // NOLINT(build/unsigned)
+
+// Keeps what is sent to it
+template<typename Datatype>
+class KeepingSender : public iomanager::SenderConcept<Datatype>
+{
+public:
+  using timeout_t = iomanager::Sender::timeout_t;
+
+  KeepingSender()
+    : iomanager::SenderConcept<Datatype>(iomanager::ConnectionId{ "test" })
+  {}
+
+  void send(Datatype&& data, timeout_t /*timeout*/) override { sent.push_back(std::move(data)); }
+  bool try_send(Datatype&& data, timeout_t /*timeout*/) override
+  {
+    sent.push_back(std::move(data));
+    return true;
+  }
+  void send_with_topic(Datatype&& data, timeout_t /*timeout*/, std::string /*topic*/) override
+  {
+    sent.push_back(std::move(data));
+  }
+
+  std::vector<Datatype> sent;
+};
+
+// The TPs of a window in the order the kernels find them: by end time,
+// then by channel. Hits last up to 3/4 of a window, so their start
+// times are out of order and reach back into the previous window
+std::vector<triggeralgs::TriggerPrimitive>
+make_window(uint64_t timestamp, size_t num_channels, std::mt19937& rng) // NOLINT(build/unsigned)
+{
+  std::uniform_int_distribution<uint64_t> tover(1, s_ticks_per_window * 3 / 4); // NOLINT(build/unsigned)
+  std::bernoulli_distribution ends_now(0.05);
+  std::vector<triggeralgs::TriggerPrimitive> tps;
+  for (uint64_t itime = 0; itime < s_ticks_per_window; ++itime) { // NOLINT(build/unsigned)
+    for (size_t channel = 0; channel < num_channels; ++channel) {
+      if (ends_now(rng)) {
+        triggeralgs::TriggerPrimitive tp;
+        tp.channel = channel;
+        tp.time_over_threshold = tover(rng) * s_clocks_per_tick;
+        tp.time_start = timestamp + itime * s_clocks_per_tick - tp.time_over_threshold;
+        tps.push_back(tp);
+      }
+    }
+  }
+  return tps;
+}
+
+bool
+by_start(const triggeralgs::TriggerPrimitive& a, const triggeralgs::TriggerPrimitive& b)
+{
+  return a.time_start < b.time_start;
+}
+
+// Feed num_windows windows to a handler, as the TP handler thread of
+// WIB2FrameProcessor does, then flush it. Returns the wall time spent in
+// add_tps
+std::chrono::nanoseconds
+run_windows(WIB2TPHandler& handler, size_t num_windows, size_t num_channels, size_t& num_tps)
+{
+  std::mt19937 rng(1234);
+  std::chrono::nanoseconds merge_time(0);
+  num_tps = 0;
+  for (size_t i = 1; i <= num_windows; ++i) {
+    const uint64_t timestamp = i * s_ticks_per_window * s_clocks_per_tick; // NOLINT(build/unsigned)
+    auto tps = make_window(timestamp, num_channels, rng);
+    WIB2TPHandler::sort_tps(tps);
+    num_tps += tps.size();
+
+    const auto start = std::chrono::steady_clock::now();
+    BOOST_REQUIRE_EQUAL(handler.add_tps(tps.begin(), tps.end(), timestamp), 0);
+    merge_time += std::chrono::steady_clock::now() - start;
+    handler.try_sending_tpsets(timestamp);
+  }
+  // Each call sends at most one TPSet
+  for (size_t i = 0; i < num_tps; ++i) {
+    handler.try_sending_tpsets(UINT64_MAX / 2);
+  }
+  return merge_time;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(WIB2TPHandler_test)
+
+BOOST_AUTO_TEST_CASE(SortTPs)
+{
+  std::mt19937 rng(42);
+  auto tps = make_window(1000000, 256, rng);
+  BOOST_REQUIRE(!tps.empty());
+  BOOST_REQUIRE(!std::is_sorted(tps.begin(), tps.end(), by_start));
+
+  WIB2TPHandler::sort_tps(tps);
+  BOOST_REQUIRE(std::is_sorted(tps.begin(), tps.end(), [](const auto& a, const auto& b) {
+    return std::tie(a.time_start, a.channel) < std::tie(b.time_start, b.channel);
+  }));
+}
+
+BOOST_AUTO_TEST_CASE(DropsTimedOut)
+{
+  KeepingSender<types::TriggerPrimitiveTypeAdapter> tp_sink;
+  KeepingSender<trigger::TPSet> tpset_sink;
+  WIB2TPHandler handler(tp_sink, tpset_sink, 100, s_tpset_window_size, daqdataformats::SourceID());
+
+  std::vector<triggeralgs::TriggerPrimitive> tps(3);
+  tps[0].time_start = 800;
+  tps[1].time_start = 900;
+  tps[2].time_start = 950;
+  BOOST_REQUIRE_EQUAL(handler.add_tps(tps.begin(), tps.end(), 1000), 2);
+
+  handler.try_sending_tpsets(UINT64_MAX / 2);
+  BOOST_REQUIRE_EQUAL(tpset_sink.sent.size(), 1);
+  BOOST_REQUIRE_EQUAL(tpset_sink.sent[0].objects.size(), 1);
+  BOOST_REQUIRE_EQUAL(tpset_sink.sent[0].objects[0].time_start, 950);
+}
+
+BOOST_AUTO_TEST_CASE(MergedInOrder)
+{
+  KeepingSender<types::TriggerPrimitiveTypeAdapter> tp_sink;
+  KeepingSender<trigger::TPSet> tpset_sink;
+  WIB2TPHandler handler(tp_sink, tpset_sink, s_tp_timeout, s_tpset_window_size, daqdataformats::SourceID());
+
+  size_t num_tps = 0;
+  run_windows(handler, 200, 256, num_tps);
+
+  BOOST_REQUIRE_EQUAL(tp_sink.sent.size(), num_tps);
+  uint64_t previous_start = 0; // NOLINT(build/unsigned)
+  for (size_t i = 0; i < tpset_sink.sent.size(); ++i) {
+    const auto& tpset = tpset_sink.sent[i];
+    BOOST_REQUIRE_EQUAL(tpset.seqno, i);
+    BOOST_REQUIRE(i == 0 || tpset.start_time > previous_start);
+    previous_start = tpset.start_time;
+    for (const auto& tp : tpset.objects) {
+      BOOST_REQUIRE(tp.time_start >= tpset.start_time && tp.time_start < tpset.end_time);
+    }
+    BOOST_REQUIRE(std::is_sorted(tpset.objects.begin(), tpset.objects.end(), by_start));
+  }
+}
+
+// A window is merged in time linear in its size: 8 times as many TPs
+// per window take about 8 times as long, not 64
+BOOST_AUTO_TEST_CASE(MergeCost)
+{
+  auto best_time = [](size_t num_channels) {
+    std::chrono::nanoseconds best = std::chrono::nanoseconds::max();
+    for (int pass = 0; pass < 3; ++pass) {
+      KeepingSender<types::TriggerPrimitiveTypeAdapter> tp_sink;
+      KeepingSender<trigger::TPSet> tpset_sink;
+      WIB2TPHandler handler(tp_sink, tpset_sink, s_tp_timeout, s_tpset_window_size, daqdataformats::SourceID());
+      size_t num_tps = 0;
+      best = std::min(best, run_windows(handler, 20, num_channels, num_tps));
+    }
+    return best;
+  };
+
+  const auto small = best_time(256);
+  const auto large = best_time(8 * 256);
+  BOOST_TEST_MESSAGE("Merging 20 windows: " << small.count() << " ns for 256 channels, " << large.count()
+                                            << " ns for 2048");
+  BOOST_REQUIRE_LT(large.count(), 24 * small.count());
+}
+
+BOOST_AUTO_TEST_SUITE_END()